@@ -19,7 +19,14 @@
 #include "rokuecp.h"
 #include <libgssdp/gssdp-resource-browser.h>
 #include <libsoup/soup-session.h>
+#include <libsoup/soup-uri-utils.h>
+#include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <stdatomic.h>
+#ifdef HAVE_IO_URING
+#include <liburing.h>
+#include <poll.h>
+#endif
 
 // Not all platforms have strlcpy (ahem... MinGW)
 #ifdef NO_STRLCPY
@@ -35,797 +42,5628 @@ size_t strlcpy(char* dest, const char* src, size_t size) {
 #endif
 
 /** @internal
- * SSDP quit GMainLoop callback: Run after 5 seconds in the loop looking for Roku devices, quits the loop.
- * @param user_data Pointer to the main loop.
- * @return Whether quitting the loop was successful.
+ * Longest an SSDP search runs in milliseconds, unless set with setRokuContextDiscoveryOptions()
  */
-static gboolean ssdpQuitGMainLoopCallback(gpointer user_data) {
-    g_main_loop_quit(user_data);
-    return G_SOURCE_REMOVE;
-}
+#define DEFAULT_DISCOVERY_TIMEOUT 5000
 
 /** @internal
- * User data to pass to the SSDP resource_available callback
+ * State of an SSDP search for Roku devices, which runs in a GMainContext until it times out, fills its list, or is cancelled
  */
-struct ssdpResourceAvailableCallbackData {
-    GMainLoop* mainLoop; /**< Pointer to the main loop */
-    int devicesFound; /**< Number of devices found */
-    char** deviceList; /**< List of device URL strings to populate */
-    const size_t maxDevices; /**< Max number of devices that can be found */
-    const size_t deviceStrSize; /**< Max size of each URL string */
+struct discovery {
+    RokuContext* ctx; /**< Context the search is run with, whose discovery cache devices found are added to */
+    GMainContext* mainContext; /**< Context the search runs in */
+    char* iface; /**< Name of the interface searched on, or NULL for the primary one */
+    GSSDPClient* client; /**< SSDP client searching on the chosen interface */
+    GSSDPResourceBrowser* browser; /**< Browser looking for roku:ecp resources */
+    GSource* timeoutSource; /**< Source ending the search when its time is up */
+    GSource* idleSource; /**< Source ending the search once no new device has been found for idleTimeout, or NULL */
+    GSource* cancelSource; /**< Source ending the search when it is cancelled, or NULL */
+    GCancellable* cancellable; /**< GCancellable of the call, or NULL */
+    char** deviceList; /**< List of device URL strings to populate, or NULL if found is set */
+    size_t maxDevices; /**< Max number of devices that can be found */
+    size_t deviceStrSize; /**< Max size of each URL string */
+    size_t devicesFound; /**< Number of devices found */
+    GHashTable* seen; /**< Set of the USNs and URLs of the devices found so far */
+    size_t duplicates; /**< Number of answers ignored because their USN or URL was already found */
+    size_t expectedDevices; /**< Number of devices after which the search ends, or 0 for none */
+    guint idleTimeout; /**< Milliseconds without a new device after which the search ends once it has found one, or 0 for none */
+    bool ended; /**< Set once the search is over, so later results are ignored */
+    /** Function called for each device found instead of adding it to deviceList, returning false to end the search, or NULL */
+    bool (*found)(struct discovery* discovery, const char* url, const char* usn);
+    gpointer foundData; /**< Data for found */
+    void (*finish)(struct discovery* discovery); /**< Function called in mainContext once the search is over and cleaned up */
+    gpointer finishData; /**< Data for finish */
 };
 
 /** @internal
- * SSDP resource_available callback: When SSDP finds a Roku device, add it to the deviceList and increment devicesFound.
- * @param self Pointer to the SSDP resource browser.
- * @param usn USN of the found resource.
- * @param locations List of strings with URLs to the resource.
- * @param user_data Pointer to ssdpResourceAvailableCallbackData struct with data to update
+ * Idle callback ending an SSDP search: free the SSDP objects (outside of their own signal handlers) and report the result
+ * @param user_data Pointer to discovery struct
+ * @return G_SOURCE_REMOVE
  */
-static void ssdpResourceAvailableCallback(GSSDPResourceBrowser* self, const char* usn, const GList* locations, void* user_data) {
-    struct ssdpResourceAvailableCallbackData* data = user_data;
-    // Stop if the end of the device list has been reached
-    if (data->devicesFound >= data->maxDevices - 1) {
-        g_main_loop_quit(data->mainLoop);
+static gboolean ssdpFinishCallback(gpointer user_data) {
+    struct discovery* discovery = user_data;
+    g_source_destroy(discovery->timeoutSource);
+    g_source_unref(discovery->timeoutSource);
+    if (discovery->idleSource) {
+        g_source_destroy(discovery->idleSource);
+        g_source_unref(discovery->idleSource);
+    }
+    if (discovery->cancelSource) {
+        g_source_destroy(discovery->cancelSource);
+        g_source_unref(discovery->cancelSource);
     }
+    g_object_unref(discovery->browser);
+    g_object_unref(discovery->client);
+    g_hash_table_destroy(discovery->seen);
+    g_free(discovery->iface);
 
-    // Update the list and increment devicesFound, then update the device find state
-    strlcpy(data->deviceList[data->devicesFound++], locations->data, data->deviceStrSize);
+    // Any remaining list entries are made empty strings
+    for (size_t i = discovery->devicesFound; i < discovery->maxDevices && discovery->deviceList && discovery->deviceStrSize; i++) {
+        *discovery->deviceList[i] = '\0';
+    }
+    discovery->finish(discovery);
+    return G_SOURCE_REMOVE;
 }
 
 /** @internal
- * Send a GET or POST request to the given URL
- * @param url string containing the URL to request
- * @param method type of request to send (e.g. "GET" or "POST")
- * @param response Pointer to GBytes pointer, to send response data to
- * @return libsoup error code, or HTTP status code, or 0 if the status is 200 OK
+ * End an SSDP search, if it hasn't ended already
+ * @param discovery Search to end
  */
-static int sendRequest(const char* url, const char* method, GBytes** response) {
-    // Set up session and send request
-    SoupSession* session = soup_session_new();
-    SoupMessage* msg = soup_message_new(method, url);
-    GError* error = NULL;
-    GBytes* request = soup_session_send_and_read(session, msg, NULL, &error);
-    if (response) {
-        *response = request;
-    } else {
-        g_bytes_unref(request);
+static void endDiscovery(struct discovery* discovery) {
+    if (discovery->ended) {
+        return;
     }
-    SoupStatus status = soup_message_get_status(msg);
+    discovery->ended = true;
+    GSource* source = g_idle_source_new();
+    g_source_set_callback(source, ssdpFinishCallback, discovery, NULL);
+    g_source_attach(source, discovery->mainContext);
+    g_source_unref(source);
+}
 
-    // Clean up and report error, if any
-    g_object_unref(session);
-    g_object_unref(msg);
-    if (error) {
-        int errorCode = error->code;
-        g_error_free(error);
-        return errorCode;
+/** @internal
+ * SSDP timeout callback: Run once the search has looked for Roku devices long enough, ends the search.
+ * @param user_data Pointer to discovery struct.
+ * @return G_SOURCE_CONTINUE, as the source is removed once the search is cleaned up.
+ */
+static gboolean ssdpTimeoutCallback(gpointer user_data) {
+    endDiscovery(user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+/** @internal
+ * Restart the timer ending an SSDP search once no new device has been found for a while, if the search has one
+ * @param discovery Search that just found a device
+ */
+static void restartIdleTimer(struct discovery* discovery) {
+    if (!discovery->idleTimeout) {
+        return;
     }
-    if (status == SOUP_STATUS_OK) {
-        return 0;
+    if (discovery->idleSource) {
+        g_source_destroy(discovery->idleSource);
+        g_source_unref(discovery->idleSource);
     }
-    return status;
+    discovery->idleSource = g_timeout_source_new(discovery->idleTimeout);
+    g_source_set_callback(discovery->idleSource, ssdpTimeoutCallback, discovery, NULL);
+    g_source_attach(discovery->idleSource, discovery->mainContext);
 }
 
 /** @internal
- * A mapping from an XML element name to a string it will be copied to
+ * GCancellable source callback for SSDP discovery: ends the search for Roku devices when the call is cancelled.
+ * @param cancellable GCancellable of the call.
+ * @param user_data Pointer to discovery struct.
+ * @return G_SOURCE_CONTINUE, as the source is removed once the search is cleaned up.
  */
-struct xmlElementToStringMap {
-    const char* elementName; /**< Name of the XML element to copy content of */
-    char* destString; /**< String to copy to */
-    size_t destSize; /**< Size of destString in bytes */
-};
+static gboolean ssdpCancelledCallback(GCancellable* cancellable, gpointer user_data) {
+    endDiscovery(user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+static void cacheFoundDevice(RokuContext* ctx, const char* iface, const char* usn, const char* url);
 
 /** @internal
- * Extract data from an XML node and copy results to specified strings
- * @param parentElement XML element to traverse child elements of
- * @param attrMode true if extracting from element attributes, false if extracting from element content
- * @param map Specification for what elements to look for and where to copy them
- * @param mapSize Number of mappings in the array
+ * SSDP resource_available callback: When SSDP finds a Roku device, add it to the deviceList and increment devicesFound.
+ * @param self Pointer to the SSDP resource browser.
+ * @param usn USN of the found resource.
+ * @param locations List of strings with URLs to the resource.
+ * @param user_data Pointer to discovery struct with data to update
  */
-static void fillFromXML(const xmlNode* parentElement, bool attrMode, struct xmlElementToStringMap map[], const size_t mapSize) {
-    // Start by making every dest string empty to avoid returning garbage data
-    for (size_t i = 0; i < mapSize; i++) {
-        *map[i].destString = '\0';
+static void ssdpResourceAvailableCallback(GSSDPResourceBrowser* self, const char* usn, const GList* locations, void* user_data) {
+    struct discovery* discovery = user_data;
+    if (discovery->ended) {
+        return;
     }
 
-    if (attrMode) {
-        // Get every attribute listed in the map and copy to corresponding string
-        xmlChar* value;
-        for (size_t i = 0; i < mapSize; i++) {
-            if (xmlNodeGetAttrValue(parentElement, (const xmlChar*) map[i].elementName, NULL, &value) == 0) {
-                strlcpy(map[i].destString, (char*) value, map[i].destSize);
-                xmlFree(value);
-            }
+    // Multi-homed devices and repeated answers can report the same device more than once, which shouldn't take up a slot
+    const char* url = locations->data;
+    if (g_hash_table_contains(discovery->seen, usn) || g_hash_table_contains(discovery->seen, url)) {
+        discovery->duplicates++;
+        return;
+    }
+    g_hash_table_add(discovery->seen, g_strdup(usn));
+    g_hash_table_add(discovery->seen, g_strdup(url));
+    cacheFoundDevice(discovery->ctx, discovery->iface, usn, url);
+
+    // Report the device or add it to the list, then stop if the end of the device list or the expected count has been reached
+    discovery->devicesFound++;
+    if (discovery->found) {
+        if (!discovery->found(discovery, url, usn)) {
+            endDiscovery(discovery);
+            return;
         }
     } else {
-        // Go through every child element and process those that match an element in the map
-        for (const xmlNode* node = parentElement->children; node != NULL; node = node->next) {
-            for (size_t i = 0; i < mapSize; i++) {
-                if (strcmp((char*) node->name, map[i].elementName) == 0) {
-                    xmlChar* content = xmlNodeGetContent(node);
-                    if (content) {
-                        strlcpy(map[i].destString, (char*) content, map[i].destSize);
-                        xmlFree(content);
-                    }
-                    break;
-                }
-            }
-        }
+        strlcpy(discovery->deviceList[discovery->devicesFound - 1], url, discovery->deviceStrSize);
+    }
+    if (discovery->devicesFound >= discovery->maxDevices || (discovery->expectedDevices && discovery->devicesFound >= discovery->expectedDevices)) {
+        endDiscovery(discovery);
+    } else {
+        restartIdleTimer(discovery);
     }
 }
 
-int findRokuDevices(const char* iface, const size_t maxDevices, const size_t urlStringSize, char* deviceList[]) {
+/** @internal
+ * Start an SSDP search for Roku devices in discovery->mainContext, which must be the thread-default context.
+ * The search looks for as long as the options allow (or until the deadline), then calls discovery->finish in that context.
+ * @param discovery Search to start, with its mainContext, cancellable, list, and finish function filled in
+ * @param iface Name of network interface to search on, or NULL to auto-select the primary interface
+ * @param options Discovery options of the context running the search
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @return 0 if the search started, or a negated gssdp error code
+ */
+static int startDiscovery(struct discovery* discovery, const char* iface, const RokuDiscoveryOptions* options, const gint64 deadline) {
     // Set up gssdp to look for Roku devices
     GError* error = NULL;
-    GSSDPClient* ssdpClient = gssdp_client_new_full(iface, NULL, 0, GSSDP_UDA_VERSION_1_0, &error);
+    discovery->client = gssdp_client_new_full(iface, NULL, 0, GSSDP_UDA_VERSION_1_0, &error);
     if (error) {
         int errorCode = error->code;
-        g_object_unref(ssdpClient);
+        if (discovery->client) {
+            g_object_unref(discovery->client);
+        }
         g_error_free(error);
         return -errorCode;
     }
-    GSSDPResourceBrowser* rokuFinder = gssdp_resource_browser_new(ssdpClient, "roku:ecp");
+    discovery->browser = gssdp_resource_browser_new(discovery->client, "roku:ecp");
+    g_signal_connect(discovery->browser, "resource-available", G_CALLBACK(ssdpResourceAvailableCallback), discovery);
+    discovery->seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    discovery->iface = g_strdup(iface);
 
-    // Set up detection loop and callback
-    GMainLoop* mainLoop = g_main_loop_new(NULL, FALSE);
-    struct ssdpResourceAvailableCallbackData callbackData = {mainLoop, 0, deviceList, maxDevices, urlStringSize};
-    g_signal_connect(rokuFinder, "resource-available", G_CALLBACK(ssdpResourceAvailableCallback), &callbackData);
+    // Activate Roku finder for the context's window (or until the call's deadline) or until list is full
+    guint window = options->timeout ? options->timeout : DEFAULT_DISCOVERY_TIMEOUT;
+    if (deadline > 0) {
+        gint64 remaining = (deadline - g_get_monotonic_time()) / 1000;
+        window = remaining <= 0 ? 0 : MIN(window, (guint) remaining);
+    }
+    discovery->idleTimeout = options->idleTimeout;
+    discovery->expectedDevices = options->expectedDevices;
+    // Devices delay their answers by up to MX seconds (3 by default), so short windows ask them to answer sooner
+    if (window < 3000) {
+        gssdp_resource_browser_set_mx(discovery->browser, (gushort) MAX(window / 1000, 1));
+    }
+    gssdp_resource_browser_set_active(discovery->browser, TRUE);
+    discovery->timeoutSource = g_timeout_source_new(window);
+    g_source_set_callback(discovery->timeoutSource, ssdpTimeoutCallback, discovery, NULL);
+    g_source_attach(discovery->timeoutSource, discovery->mainContext);
+    // Cancelling the call ends the search early too (dispatched inside the context, so it can't be missed)
+    if (discovery->cancellable) {
+        discovery->cancelSource = g_cancellable_source_new(discovery->cancellable);
+        g_source_set_callback(discovery->cancelSource, (GSourceFunc) (void (*)(void)) ssdpCancelledCallback, discovery, NULL);
+        g_source_attach(discovery->cancelSource, discovery->mainContext);
+    }
+    if (discovery->maxDevices == 0) {
+        endDiscovery(discovery);
+    }
+    return 0;
+}
 
-    // Activate Roku finder and run detection loop for 5 seconds or until list is full
-    gssdp_resource_browser_set_active(rokuFinder, TRUE);
-    g_timeout_add_seconds(5, ssdpQuitGMainLoopCallback, mainLoop);
-    g_main_loop_run(mainLoop);
+/** @internal
+ * Tracer registered with setRokuContextTracer()
+ */
+struct tracer {
+    RokuTraceCallback callback; /**< Function called for each event */
+    void* userData; /**< Data passed to callback */
+};
 
-    // Cleanup gssdp when loop is done and return devices found
-    g_main_loop_unref(mainLoop);
-    g_object_unref(rokuFinder);
-    g_object_unref(ssdpClient);
-    return callbackData.devicesFound;
-}
+/**
+ * Shared state used to talk to Roku devices: persistent sessions, parser state, configuration, and statistics.
+ */
+struct RokuContext {
+    GMutex lock; /**< Lock protecting devices and the deviceState structs in it */
+    GHashTable* devices; /**< deviceState structs keyed by device base URL (like "http://192.168.1.162:8060") */
+    GHashTable* flights; /**< flight structs of queries in progress keyed by endpoint URI address, protected by lock */
+    atomic_int transport; /**< RokuTransport used for status-only POSTs */
+    atomic_uint maxRetries; /**< Number of times a failed GET request is retried, or 0 for none */
+    atomic_uint retryDelay; /**< Delay before the first retry in milliseconds, doubled for each retry after it */
+    atomic_uint circuitThreshold; /**< Consecutive failures after which a device's circuit breaker opens, or 0 if circuit breakers are off */
+    atomic_uint probeInterval; /**< Seconds between probes of a device whose circuit breaker is open */
+    atomic_uint prewarmInterval; /**< Seconds between refreshes of pre-warmed connections, or 0 if pre-warming is off */
+    atomic_uint discoveryTimeout; /**< Longest an SSDP search runs in milliseconds, or 0 for the default */
+    atomic_uint discoveryIdleTimeout; /**< Milliseconds without a new device after which an SSDP search ends, or 0 for none */
+    atomic_size_t expectedDevices; /**< Number of devices after which an SSDP search ends, or 0 for none */
+    atomic_uint pipelineDepth; /**< Maximum number of pipelined keypresses in flight on one connection, or 0 or 1 to not pipeline */
+    atomic_uint maxRequestsPerDevice; /**< Maximum number of requests in flight to a single device, or 0 for no limit */
+    double rateLimit; /**< Requests per second each device's token bucket refills at, or 0 for no limit, protected by lock */
+    unsigned rateBurst; /**< Capacity of each device's token bucket, protected by lock */
+    atomic_uint connectTimeout; /**< Connect timeout in milliseconds, or 0 for none */
+    atomic_uint readTimeout; /**< Read timeout in milliseconds, or 0 for none */
+    GMainContext* workerContext; /**< Main context of the worker thread, which runs timers for blocking requests */
+    GMainLoop* workerLoop; /**< Main loop run by the worker thread */
+    GThread* worker; /**< Worker thread */
+    GMutex parserLock; /**< Lock protecting parser, which can only parse one document at a time */
+    xmlParserCtxtPtr parser; /**< XML parser context reused for every response */
+    atomic_uint_fast64_t requests; /**< Number of requests sent */
+    atomic_uint_fast64_t failedRequests; /**< Number of requests that failed or didn't return 200 OK */
+    atomic_uint_fast64_t bytesReceived; /**< Number of response body bytes received */
+    atomic_uint_fast64_t sessionsCreated; /**< Number of sessions created */
+    atomic_uint_fast64_t timeouts; /**< Number of requests that timed out */
+    atomic_uint_fast64_t cancelled; /**< Number of requests that were cancelled */
+    atomic_uint_fast64_t queuedRequests; /**< Number of requests that had to wait for a slot */
+    atomic_uint_fast64_t throttledRequests; /**< Number of requests delayed by the rate limit */
+    atomic_uint_fast64_t coalescedRequests; /**< Number of queries that shared another caller's request */
+    atomic_uint_fast64_t retries; /**< Number of times a failed request was retried */
+    atomic_uint_fast64_t circuitRejections; /**< Number of requests failed fast because their device's circuit breaker was open */
+    atomic_uint_fast64_t warmRequests; /**< Number of requests sent on a connection that was already open */
+    atomic_uint_fast64_t coldRequests; /**< Number of requests that had to open a new connection */
+    atomic_uint_fast64_t prewarms; /**< Number of connections opened or refreshed ahead of time */
+    atomic_uint_fast64_t duplicateResponses; /**< Number of SSDP answers ignored because they repeated a device already found */
+    struct registry* registry; /**< Device registry running on the worker thread, or NULL if none is, protected by lock */
+    /** Discovery cache, with a group for each device named after its interface and USN, or NULL if there's none, protected by lock */
+    GKeyFile* cache;
+    char* cachePath; /**< Path of the discovery cache file, or NULL, protected by lock */
+    bool cacheRefreshing; /**< Set while the discovery cache is being refreshed on the worker thread, protected by lock */
+    GMutex cacheFileLock; /**< Lock held while the discovery cache file is written, so an older copy can't replace a newer one */
+    _Atomic(struct tracer*) tracer; /**< Registered tracer, or NULL if requests aren't traced */
+    GSList* oldTracers; /**< Replaced tracers, kept until the context is destroyed because requests may still be using them, protected by lock */
+    atomic_uint_fast64_t lastRequestId; /**< ID of the last request traced */
+};
 
-int getRokuDevice(const char* url, RokuDevice* device) {
-    // Fill in the device URL
-    strlcpy(device->url, url, sizeof(device->url));
+/** @internal
+ * Context used by functions that aren't given one, created on first use
+ */
+static RokuContext* defaultContext = NULL;
 
-    // Request device-info from device and check for errors
-    char queryURL[(sizeof(device->url) + sizeof("/query/device-info")) / sizeof(char) - 1];
-    strcpy(queryURL, url);
-    strcat(queryURL, "/query/device-info");
-    GBytes* response;
-    int httpError = sendRequest(queryURL, SOUP_METHOD_GET, &response);
-    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
-        g_bytes_unref(response);
-        return -3;
-    }
-    if (httpError) {
-        g_bytes_unref(response);
-        return httpError;
-    }
+/** @internal
+ * Lock protecting defaultContext
+ */
+static GMutex defaultContextLock;
 
-    // Parse XML response and get device-info element
-    xmlDocPtr doc = xmlReadDoc(g_bytes_get_data(response, NULL), "device-info.xml", "UTF-8", 0);
-    g_bytes_unref(response);
-    if (!doc) {
-        return -2;
+/** @internal
+ * Get the context to use for a call, falling back to the default context.
+ * @param ctx Context passed by the caller, or NULL
+ * @return ctx if it isn't NULL, otherwise the default context
+ */
+static RokuContext* resolveContext(RokuContext* ctx) {
+    if (ctx) {
+        return ctx;
     }
-    xmlNodePtr deviceInfoElement = xmlDocGetRootElement(doc);
-    if (!deviceInfoElement) {
-        xmlFreeDoc(doc);
-        return -3;
+    g_mutex_lock(&defaultContextLock);
+    if (!defaultContext) {
+        defaultContext = createRokuContext();
     }
+    ctx = defaultContext;
+    g_mutex_unlock(&defaultContextLock);
+    return ctx;
+}
 
-    // Fill in device fields based on device-info response
-    char tmpPowerMode[8];
-    char tmpIsTV[5];
-    char tmpEcpMode[8];
-    char tmpDeveloperMode[5];
-    char tmpSearchEnabled[5];
-    char tmpHasPrivateListening[5];
-    char tmpHeadphonesConnected[5];
-    struct xmlElementToStringMap map[14] = {
-        {"user-device-name", device->name, sizeof(device->name) / sizeof(char)},
-        {"user-device-location", device->location, sizeof(device->location) / sizeof(char)},
-        {"friendly-model-name", device->model, sizeof(device->model) / sizeof(char)},
-        {"serial-number", device->serial, sizeof(device->serial) / sizeof(char)},
-        {"ui-resolution", device->resolution, sizeof(device->resolution) / sizeof(char)},
-        {"wifi-mac", device->macAddress, sizeof(device->macAddress) / sizeof(char)},
-        {"software-version", device->softwareVersion, sizeof(device->softwareVersion) / sizeof(char)},
-        {"power-mode", tmpPowerMode, 8},
-        {"is-tv", tmpIsTV, 5},
-        {"ecp-setting-mode", tmpEcpMode, 8},
-        {"developer-enabled", tmpDeveloperMode, 5},
-        {"search-enabled", tmpSearchEnabled, 5},
-        {"supports-private-listening", tmpHasPrivateListening, 5},
-        {"headphones-connected", tmpHeadphonesConnected, 5},
-    };
-    fillFromXML(deviceInfoElement, false, map, sizeof(map) / sizeof(*map));
-    device->isOn = strcmp("PowerOn", tmpPowerMode) == 0;
-    device->isTV = strcmp("true", tmpIsTV) == 0;
-    device->isLimited = strcmp("limited", tmpIsTV) == 0;
-    device->developerMode = strcmp("true", tmpDeveloperMode) == 0;
-    device->hasSearchSupport = strcmp("true", tmpSearchEnabled) == 0;
-    device->hasHeadphoneSupport = strcmp("true", tmpHasPrivateListening) == 0;
-    device->headphonesConnected = strcmp("true", tmpHeadphonesConnected) == 0;
+/** @internal
+ * Default maximum number of requests in flight to a single device
+ */
+#define DEFAULT_MAX_REQUESTS_PER_DEVICE 2
 
-    // Clean up and return
-    xmlFreeDoc(doc);
-    return 0;
-}
+/** @internal
+ * Number of priority classes, i.e. the values of RokuPriority other than ROKU_PRIORITY_DEFAULT
+ */
+#define PRIORITY_CLASSES 3
 
-int rokuSendKey(const RokuDevice* device, const char* key) {
-    // Disallow sending keys meant for TVs to non-TV devices
-    if (!device->isTV) {
-        for (int i = 0; i < 12; i++) {
-            const char* tvOnlyKeys[12] = {"VolumeUp", "VolumeDown", "VolumeMute", "PowerOff", "ChannelUp", "ChannelDown",
-                                          "InputTuner", "InputHDMI1", "InputHDMI2", "InputHDMI3", "InputHDMI4", "InputAV1"};
-            if (strcmp(key, tvOnlyKeys[i]) == 0) {
-                return -1;
-            }
+/** @internal
+ * Number of fixed ECP query endpoints, whose URIs are parsed once per device. They come first in RokuEndpoint.
+ */
+#define NUM_QUERY_ENDPOINTS (ROKU_ENDPOINT_ACTIVE_APP + 1)
+
+/** @internal
+ * Paths of the fixed ECP query endpoints, indexed by RokuEndpoint
+ */
+static const char* const endpointPaths[NUM_QUERY_ENDPOINTS] = {"/query/device-info", "/query/tv-channels", "/query/tv-active-channel", "/query/apps",
+                                                               "/query/active-app"};
+
+/** @internal
+ * Number of histogram buckets each power of two of latency is split into, which bounds the error of a percentile to 1/16
+ */
+#define HISTOGRAM_SUB_BUCKETS 16
+
+/** @internal
+ * Number of latency histogram buckets, covering up to 2^26 microseconds (about a minute) with everything slower in the last one
+ */
+#define HISTOGRAM_BUCKETS ((26 - 3) * HISTOGRAM_SUB_BUCKETS)
+
+/** @internal
+ * Request statistics of one endpoint of one device, updated without locking
+ */
+struct endpointStats {
+    atomic_uint_fast64_t requests; /**< Number of requests sent */
+    atomic_uint_fast64_t failedRequests; /**< Number of requests that failed or didn't return 200 OK */
+    atomic_int_fast64_t totalLatency; /**< Sum of request latencies in microseconds */
+    atomic_int_fast64_t maxLatency; /**< Highest request latency in microseconds */
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS]; /**< Log-scale latency histogram, see getHistogramBucket() */
+};
+
+/** @internal
+ * A request waiting for a slot to send to a device
+ */
+struct requestWaiter {
+    GCond cond; /**< Signalled when a blocking waiter is granted a slot or cancelled */
+    bool granted; /**< Set once the waiter owns a slot */
+    bool cancelled; /**< Set if the waiter's call was cancelled while it was waiting */
+    GMainContext* grantContext; /**< Context to call grant in for asynchronous waiters, or NULL for blocking waiters */
+    GSourceFunc grant; /**< Function called in grantContext once an asynchronous waiter owns a slot */
+    GSourceFunc abandon; /**< Function called in grantContext instead of grant if an asynchronous waiter's call is cancelled or runs out of time */
+    gpointer grantData; /**< Data passed to grant or abandon */
+    GQueue* queue; /**< Queue an asynchronous waiter is in */
+    GSource* cancelSource; /**< Source abandoning an asynchronous waiter when its call is cancelled, or NULL */
+    GSource* deadlineSource; /**< Source abandoning an asynchronous waiter once its call's deadline passes, or NULL */
+    GMutex* lock; /**< Lock of the context the waiter is queued in */
+};
+
+/** @internal
+ * State kept for each device a context talks to
+ */
+struct deviceState {
+    RokuContext* ctx; /**< Context owning the device state */
+    const char* baseURL; /**< Base URL of the device (scheme, host, and port), owned by the context's device table */
+    SoupSession* session; /**< Persistent session for the device */
+    size_t baseLength; /**< Length of the device's base URL, which every URL requested from it starts with */
+    char* hostHeader; /**< Host header for the raw transport (like "192.168.1.162:8060") */
+    GSocketAddress* address; /**< Address for the raw transport, or NULL if the device's host isn't an IP address */
+    GUri* endpointURIs[NUM_QUERY_ENDPOINTS]; /**< Pre-parsed URIs of the fixed query endpoints, or NULLs if the base URL couldn't be parsed */
+    GSocket* idleSockets[4]; /**< Kept-alive raw transport connections with no request in progress */
+    unsigned numIdleSockets; /**< Number of sockets in idleSockets */
+    unsigned inFlight; /**< Number of requests currently holding a slot */
+    GQueue waiters[PRIORITY_CLASSES]; /**< requestWaiter structs waiting for a slot for each priority class, oldest first */
+    double tokens; /**< Tokens left in the device's rate limit bucket, negative if requests have reserved tokens not refilled yet */
+    gint64 lastRefill; /**< Monotonic time tokens was last refilled, or 0 if the bucket hasn't been used yet */
+    GSource* prewarmTimer; /**< Source refreshing the device's pre-warmed connection on the worker thread, or NULL */
+    GSource* prewarmConnect; /**< Source waiting on the worker thread for a pre-warmed raw transport connection, or NULL */
+    GSocket* prewarmSocket; /**< Raw transport socket prewarmConnect is waiting for */
+    unsigned failures; /**< Number of requests in a row that failed without the device answering */
+    bool circuitOpen; /**< true if the device is known to be down, so requests to it fail fast */
+    GSource* probeTimer; /**< Source probing the device on the worker thread while its circuit breaker is open, or NULL */
+    SoupMessage* probeMsg; /**< Probe currently being sent, or NULL */
+    struct requestTimer* probeRequestTimer; /**< Timer enforcing timeouts on probeMsg */
+    /** Request statistics of each endpoint, allocated the first time the endpoint is used so idle ones cost nothing */
+    _Atomic(struct endpointStats*) endpointStats[ROKU_NUM_ENDPOINTS];
+};
+
+static bool stopRequestTimer(RokuContext* ctx, struct requestTimer* timer, SoupMessage* msg);
+
+/** @internal
+ * Free the state of a device
+ * @param data Pointer to deviceState struct
+ */
+static void freeDeviceState(gpointer data) {
+    struct deviceState* device = data;
+    if (device->prewarmTimer) {
+        g_source_destroy(device->prewarmTimer);
+        g_source_unref(device->prewarmTimer);
+    }
+    if (device->prewarmConnect) {
+        g_source_destroy(device->prewarmConnect);
+        g_source_unref(device->prewarmConnect);
+        g_object_unref(device->prewarmSocket);
+    }
+    if (device->probeTimer) {
+        g_source_destroy(device->probeTimer);
+        g_source_unref(device->probeTimer);
+    }
+    if (device->probeMsg) {
+        stopRequestTimer(device->ctx, device->probeRequestTimer, device->probeMsg);
+        g_object_unref(device->probeMsg);
+    }
+    g_object_unref(device->session);
+    for (unsigned i = 0; i < device->numIdleSockets; i++) {
+        g_object_unref(device->idleSockets[i]);
+    }
+    if (device->address) {
+        g_object_unref(device->address);
+    }
+    g_free(device->hostHeader);
+    for (int i = 0; i < NUM_QUERY_ENDPOINTS; i++) {
+        if (device->endpointURIs[i]) {
+            g_uri_unref(device->endpointURIs[i]);
         }
     }
-    if (device->isLimited) {
-        return -2;
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        g_queue_clear(&device->waiters[i]);
     }
-    // Return result of keypress request
-    char* url = malloc(sizeof("/keypress/") + (strlen(device->url) + strlen(key)) * sizeof(char));
-    strcpy(url, device->url);
-    strcat(url, "/keypress/");
-    strcat(url, key);
-    int result = sendRequest(url, SOUP_METHOD_POST, NULL);
-    free(url);
-    if (result == SOUP_STATUS_UNAUTHORIZED) {
-        return -3;
+    for (int i = 0; i < ROKU_NUM_ENDPOINTS; i++) {
+        g_free(atomic_load_explicit(&device->endpointStats[i], memory_order_relaxed));
     }
-    return result;
+    g_free(device);
 }
 
-int getRokuTVChannels(const RokuDevice* device, const int maxChannels, RokuTVChannel channelList[]) {
-    if (!device->isTV) {
-        return -4;
-    }
-    if (device->isLimited) {
-        return -5;
+/** @internal
+ * Get the length of the part of a URL identifying its device, which is everything up to the first slash after the scheme
+ * (i.e. scheme, host, and port)
+ * @param url string containing a URL
+ * @param hostStart Pointer to const char pointer, set to where the URL's host starts, or NULL
+ * @return Length of the device's part of the URL
+ */
+static size_t getDeviceKeyLength(const char* url, const char** hostStart) {
+    const char* host = strstr(url, "://");
+    host = host ? host + 3 : url;
+    if (hostStart) {
+        *hostStart = host;
     }
+    const char* pathStart = strchr(host, '/');
+    return pathStart ? (size_t) (pathStart - url) : strlen(url);
+}
 
-    // Request tv-channels from device and check for errors
-    char queryURL[(sizeof(device->url) + sizeof("/query/tv-channels")) / sizeof(char) - 1];
-    strcpy(queryURL, device->url);
-    strcat(queryURL, "/query/tv-channels");
-    GBytes* response;
-    int httpError = sendRequest(queryURL, SOUP_METHOD_GET, &response);
-    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
-        g_bytes_unref(response);
-        return -6;
-    }
-    if (httpError) {
-        g_bytes_unref(response);
-        return -1;
-    }
+/** @internal
+ * Get the state of the device a URL points to, creating it if it doesn't exist yet.
+ * Device states live as long as their context, so the returned pointer stays valid until the context is destroyed.
+ * @param ctx Context owning the device states
+ * @param url string containing the URL that will be requested
+ * @return State of the URL's device
+ */
+static struct deviceState* getDeviceState(RokuContext* ctx, const char* url) {
+    const char* hostStart;
+    size_t keyLength = getDeviceKeyLength(url, &hostStart);
 
-    // Parse channel list XML
-    xmlDocPtr doc = xmlReadDoc(g_bytes_get_data(response, NULL), "tv-channels.xml", "UTF-8", 0);
-    g_bytes_unref(response);
-    if (!doc) {
-        return -2;
+    // Device URLs are short, so the key normally fits on the stack and looking up a known device doesn't allocate
+    char keyBuffer[64];
+    char* key = keyLength < sizeof(keyBuffer) ? keyBuffer : g_malloc(keyLength + 1);
+    memcpy(key, url, keyLength);
+    key[keyLength] = '\0';
+
+    g_mutex_lock(&ctx->lock);
+    struct deviceState* device = g_hash_table_lookup(ctx->devices, key);
+    if (!device) {
+        device = g_new0(struct deviceState, 1);
+        device->ctx = ctx;
+        device->session = soup_session_new();
+        device->baseLength = keyLength;
+        device->hostHeader = g_strndup(hostStart, keyLength - (hostStart - url));
+        GUri* uri = g_uri_parse(key, SOUP_HTTP_URI_FLAGS, NULL);
+        if (uri) {
+            if (g_uri_get_port(uri) > 0) {
+                device->address = g_inet_socket_address_new_from_string(g_uri_get_host(uri), g_uri_get_port(uri));
+            }
+            // Parse the fixed endpoints once, so queries don't have to build and parse their URLs every time
+            for (int i = 0; i < NUM_QUERY_ENDPOINTS; i++) {
+                device->endpointURIs[i] = g_uri_parse_relative(uri, endpointPaths[i], SOUP_HTTP_URI_FLAGS, NULL);
+            }
+            g_uri_unref(uri);
+        }
+        for (int i = 0; i < PRIORITY_CLASSES; i++) {
+            g_queue_init(&device->waiters[i]);
+        }
+        char* baseURL = g_strdup(key);
+        device->baseURL = baseURL;
+        g_hash_table_insert(ctx->devices, baseURL, device);
+        atomic_fetch_add_explicit(&ctx->sessionsCreated, 1, memory_order_relaxed);
     }
-    xmlNodePtr rootElement = xmlDocGetRootElement(doc);
-    if (!rootElement) {
-        xmlFreeDoc(doc);
-        return -3;
+    g_mutex_unlock(&ctx->lock);
+    if (key != keyBuffer) {
+        g_free(key);
     }
+    return device;
+}
 
-    // Iterate through channels and add them to the channel list
-    int channelsFound = 0;
-    for (const xmlNode* nextChannel = rootElement->children; nextChannel != NULL && channelsFound < maxChannels; nextChannel = nextChannel->next) {
-        // Skip non-element nodes
-        if (nextChannel->type != XML_ELEMENT_NODE) {
-            continue;
-        }
+/** @internal
+ * Whether a result code is one of the library-wide error codes, which count down from ROKU_ERROR_TIMEOUT
+ * @param result Result code returned by sendRequest()
+ * @return true if the result is a library-wide error code
+ */
+static bool isRokuError(const int result) {
+    return result <= ROKU_ERROR_TIMEOUT;
+}
 
-        char tmpPhysicalChannel[3];
-        char tmpFrequency[7];
-        struct xmlElementToStringMap map[] = {
-            {"channel-id", channelList[channelsFound].id, sizeof(channelList->id) / sizeof(char)},
-            {"broadcast-network-label", channelList[channelsFound].network, sizeof(channelList->network) / sizeof(char)},
-            {"name", channelList[channelsFound].name, sizeof(channelList->name) / sizeof(char)},
-            {"type", channelList[channelsFound].type, sizeof(channelList->type) / sizeof(char)},
-            {"physical-channel", tmpPhysicalChannel, 3},
-            {"physical-frequency", tmpFrequency, 7},
-        };
-        fillFromXML(nextChannel, false, map, sizeof(map) / sizeof(*map));
-        if (*tmpPhysicalChannel) {
-            channelList[channelsFound].physicalChannel = strtoul(tmpPhysicalChannel, NULL, 10);
-        } else {
-            channelList[channelsFound].physicalChannel = 0;
-        }
-        if (*tmpFrequency) {
-            channelList[channelsFound].frequency = strtoul(tmpFrequency, NULL, 10) * 1000UL;
-        } else {
-            channelList[channelsFound].frequency = 0;
+/** @internal
+ * A request being timed and traced
+ */
+struct requestSpan {
+    struct deviceState* device; /**< State of the device the request is sent to */
+    RokuEndpoint endpoint; /**< Endpoint the request is sent to */
+    guint64 id; /**< ID of the request in trace events, or 0 if it isn't traced */
+    gint64 start; /**< Monotonic time the request was started */
+};
+
+/** @internal
+ * Get an ID for a request about to be started, if the context has a tracer
+ * @param ctx Context the request is sent with
+ * @return New request ID, or 0 if the request won't be traced
+ */
+static guint64 getRequestId(RokuContext* ctx) {
+    if (!atomic_load_explicit(&ctx->tracer, memory_order_relaxed)) {
+        return 0;
+    }
+    return atomic_fetch_add_explicit(&ctx->lastRequestId, 1, memory_order_relaxed) + 1;
+}
+
+/** @internal
+ * Pass an event in the life of a request to the context's tracer, if the request is traced
+ * @param ctx Context the request is sent with
+ * @param span Span of the request
+ * @param type Point the request reached
+ * @param result Result code to report with the event
+ */
+static void traceRequest(RokuContext* ctx, const struct requestSpan* span, const RokuTraceEventType type, const int result) {
+    struct tracer* tracer = span->id ? atomic_load_explicit(&ctx->tracer, memory_order_acquire) : NULL;
+    if (!tracer) {
+        return;
+    }
+    RokuTraceEvent event;
+    event.type = type;
+    event.requestId = span->id;
+    event.url = span->device->baseURL;
+    event.endpoint = span->endpoint;
+    event.timestamp = type == ROKU_TRACE_START ? span->start : g_get_monotonic_time();
+    event.startTime = span->start;
+    event.result = result;
+    tracer->callback(&event, tracer->userData);
+}
+
+/** @internal
+ * Start timing and tracing a request
+ * @param ctx Context the request is sent with
+ * @param span Span to fill in
+ * @param device State of the device the request is sent to
+ * @param endpoint Endpoint the request is sent to
+ */
+static void startSpan(RokuContext* ctx, struct requestSpan* span, struct deviceState* device, const RokuEndpoint endpoint) {
+    span->device = device;
+    span->endpoint = endpoint;
+    span->id = getRequestId(ctx);
+    span->start = g_get_monotonic_time();
+    traceRequest(ctx, span, ROKU_TRACE_START, 0);
+}
+
+/** @internal
+ * Trace the parsing of a query's response
+ * @param ctx Context the request was sent with
+ * @param span Span of the request, which is only read if the request succeeded
+ * @param httpError Result of the request, as returned by finishRequest()
+ * @param result Return value of the call
+ */
+static void traceParsed(RokuContext* ctx, const struct requestSpan* span, const int httpError, const int result) {
+    // Only successful queries have a response that was parsed
+    if (!httpError && span->endpoint < NUM_QUERY_ENDPOINTS) {
+        traceRequest(ctx, span, ROKU_TRACE_PARSE_COMPLETE, result);
+    }
+}
+
+/** @internal
+ * Timer enforcing a request's connect timeout, read timeout, and deadline by cancelling the request when they pass.
+ * It is shared between the request and the timer's GSource, and freed when both are done with it.
+ */
+struct requestTimer {
+    gint refs; /**< Reference count */
+    GSource* source; /**< Source cancelling the request when its ready time passes */
+    GCancellable* cancellable; /**< Cancellable passed to libsoup for the request */
+    gint64 deadline; /**< Absolute deadline of the call in monotonic time, or 0 for none */
+    unsigned readTimeout; /**< Read timeout in milliseconds, or 0 for none */
+    RokuContext* ctx; /**< Context the request is sent with */
+    const struct requestSpan* span; /**< Span of the request, or NULL if it isn't traced */
+    gint connected; /**< Set once the request has a connection and the read timeout applies instead of the connect timeout */
+    gint newConnection; /**< Set if the request had to open a new connection */
+    gint timedOut; /**< Set if the request was cancelled because it timed out */
+};
+
+/** @internal
+ * Release a reference to a request timer, freeing it once unused
+ * @param data Pointer to requestTimer struct
+ */
+static void unrefRequestTimer(gpointer data) {
+    struct requestTimer* timer = data;
+    if (g_atomic_int_dec_and_test(&timer->refs)) {
+        g_object_unref(timer->cancellable);
+        g_free(timer);
+    }
+}
+
+/** @internal
+ * Dispatch function for timer sources, which only become ready when their ready time passes
+ */
+static gboolean dispatchTimerSource(GSource* source, GSourceFunc callback, gpointer user_data) {
+    g_source_set_ready_time(source, -1);
+    return callback(user_data);
+}
+
+/** @internal
+ * GSourceFuncs for timer sources
+ */
+static GSourceFuncs timerSourceFuncs = {NULL, NULL, dispatchTimerSource, NULL, NULL, NULL};
+
+/** @internal
+ * Get the earlier of a timeout starting now and a deadline
+ * @param timeout Timeout in milliseconds, or 0 for none
+ * @param deadline Absolute deadline in monotonic time, or 0 for none
+ * @return Absolute expiry in monotonic time, or -1 if there is neither a timeout nor a deadline
+ */
+static gint64 getExpiry(const unsigned timeout, const gint64 deadline) {
+    gint64 expiry = timeout ? g_get_monotonic_time() + timeout * (gint64) 1000 : -1;
+    if (deadline > 0 && (expiry < 0 || deadline < expiry)) {
+        expiry = deadline;
+    }
+    return expiry;
+}
+
+/** @internal
+ * Timer source callback: the request took too long, so cancel it
+ * @param user_data Pointer to requestTimer struct
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean requestTimerCallback(gpointer user_data) {
+    struct requestTimer* timer = user_data;
+    g_atomic_int_set(&timer->timedOut, 1);
+    g_cancellable_cancel(timer->cancellable);
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Switch a request's timer from its connect timeout to its read timeout, if that hasn't happened yet
+ * @param timer Pointer to requestTimer struct
+ */
+static void startReadTimeout(struct requestTimer* timer) {
+    if (g_atomic_int_compare_and_exchange(&timer->connected, 0, 1)) {
+        g_source_set_ready_time(timer->source, getExpiry(timer->readTimeout, timer->deadline));
+        if (timer->span) {
+            traceRequest(timer->ctx, timer->span, ROKU_TRACE_CONNECT, 0);
         }
+    }
+}
 
-        channelsFound++;
+/** @internal
+ * SoupMessage network-event callback: once a new connection is complete, the read timeout applies
+ */
+static void requestNetworkEventCallback(SoupMessage* msg, GSocketClientEvent event, GIOStream* connection, gpointer user_data) {
+    if (event == G_SOCKET_CLIENT_COMPLETE) {
+        struct requestTimer* timer = user_data;
+        g_atomic_int_set(&timer->newConnection, 1);
+        startReadTimeout(timer);
     }
+}
 
-    // Clean up and return number of channels found
-    xmlFreeDoc(doc);
-    return channelsFound;
+/** @internal
+ * SoupMessage wrote-headers callback: the request has a connection (possibly a reused one), so the read timeout applies
+ */
+static void requestWroteHeadersCallback(SoupMessage* msg, gpointer user_data) {
+    startReadTimeout(user_data);
 }
 
-int getActiveRokuTVChannel(const RokuDevice* device, RokuExtTVChannel* channel) {
-    if (!device->isTV) {
-        return -3;
+/** @internal
+ * SoupMessage got-headers callback: the response has started arriving
+ */
+static void requestGotHeadersCallback(SoupMessage* msg, gpointer user_data) {
+    struct requestTimer* timer = user_data;
+    traceRequest(timer->ctx, timer->span, ROKU_TRACE_FIRST_BYTE, 0);
+}
+
+/** @internal
+ * Start enforcing a context's timeouts and a call's deadline on a request
+ * @param ctx Context the request is sent with
+ * @param span Span of the request to trace its connection and response with, which must outlive the timer, or NULL
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @param timerContext GMainContext to run the timer in
+ * @param msg Message being sent
+ * @return New timer, whose cancellable must be passed to libsoup, to be stopped with stopRequestTimer()
+ */
+static struct requestTimer* startRequestTimer(RokuContext* ctx, const struct requestSpan* span, const gint64 deadline, GMainContext* timerContext,
+                                              SoupMessage* msg) {
+    struct requestTimer* timer = g_new0(struct requestTimer, 1);
+    timer->refs = 2;
+    timer->ctx = ctx;
+    timer->span = span;
+    timer->cancellable = g_cancellable_new();
+    timer->deadline = deadline;
+    timer->readTimeout = atomic_load_explicit(&ctx->readTimeout, memory_order_relaxed);
+    timer->source = g_source_new(&timerSourceFuncs, sizeof(GSource));
+    g_source_set_callback(timer->source, requestTimerCallback, timer, unrefRequestTimer);
+    g_source_set_ready_time(timer->source, getExpiry(atomic_load_explicit(&ctx->connectTimeout, memory_order_relaxed), deadline));
+    g_signal_connect(msg, "network-event", G_CALLBACK(requestNetworkEventCallback), timer);
+    g_signal_connect(msg, "wrote-headers", G_CALLBACK(requestWroteHeadersCallback), timer);
+    if (span && span->id) {
+        g_signal_connect(msg, "got-headers", G_CALLBACK(requestGotHeadersCallback), timer);
     }
-    if (device->isLimited) {
-        return -4;
+    g_source_attach(timer->source, timerContext);
+    return timer;
+}
+
+/** @internal
+ * Count a request as sent on a warm (already open) or cold (new) connection
+ * @param ctx Context the request was sent with
+ * @param cold true if the request had to open a new connection
+ */
+static void countConnectionUse(RokuContext* ctx, const bool cold) {
+    atomic_fetch_add_explicit(cold ? &ctx->coldRequests : &ctx->warmRequests, 1, memory_order_relaxed);
+}
+
+/** @internal
+ * Stop a request's timer once the request is finished
+ * @param ctx Context the request was sent with
+ * @param timer Timer returned by startRequestTimer()
+ * @param msg Message that was sent
+ * @return true if the request was cancelled because it timed out
+ */
+static bool stopRequestTimer(RokuContext* ctx, struct requestTimer* timer, SoupMessage* msg) {
+    g_signal_handlers_disconnect_by_data(msg, timer);
+    if (g_atomic_int_get(&timer->connected)) {
+        countConnectionUse(ctx, g_atomic_int_get(&timer->newConnection));
     }
+    g_source_destroy(timer->source);
+    g_source_unref(timer->source);
+    bool timedOut = g_atomic_int_get(&timer->timedOut);
+    unrefRequestTimer(timer);
+    return timedOut;
+}
 
-    // Request tv-active-channel from device and check for errors
-    char queryURL[(sizeof(device->url) + sizeof("/query/tv-active-channel")) / sizeof(char) - 1];
-    strcpy(queryURL, device->url);
-    strcat(queryURL, "/query/tv-active-channel");
-    GBytes* response;
-    int httpError = sendRequest(queryURL, SOUP_METHOD_GET, &response);
-    if (httpError ==  SOUP_STATUS_UNAUTHORIZED) {
-        return -5;
+/** @internal
+ * Check whether a call's deadline has already passed
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @return true if the deadline has passed
+ */
+static bool deadlinePassed(const gint64 deadline) {
+    return deadline > 0 && g_get_monotonic_time() >= deadline;
+}
+
+/** @internal
+ * GCancellable callback passing cancellation of a call on to its current request
+ * @param cancellable GCancellable of the call
+ * @param user_data GCancellable of the request
+ */
+static void cancelRequestCallback(GCancellable* cancellable, gpointer user_data) {
+    g_cancellable_cancel(user_data);
+}
+
+/** @internal
+ * Make cancelling a call's GCancellable cancel a request too
+ * @param cancellable GCancellable of the call, or NULL
+ * @param timer Timer of the request, whose cancellable is passed to libsoup
+ * @return Handler ID to pass to unlinkCancellable(), or 0 if there is nothing to unlink
+ */
+static gulong linkCancellable(GCancellable* cancellable, struct requestTimer* timer) {
+    if (!cancellable) {
+        return 0;
     }
-    if (httpError) {
-        g_bytes_unref(response);
-        return httpError;
+    return g_cancellable_connect(cancellable, G_CALLBACK(cancelRequestCallback), g_object_ref(timer->cancellable), g_object_unref);
+}
+
+/** @internal
+ * Undo linkCancellable() once a request is finished
+ * @param cancellable GCancellable of the call, or NULL
+ * @param handler Handler ID returned by linkCancellable()
+ */
+static void unlinkCancellable(GCancellable* cancellable, const gulong handler) {
+    if (cancellable && handler) {
+        g_cancellable_disconnect(cancellable, handler);
     }
+}
 
-    // Parse active channel XML and get channel element
-    xmlDocPtr doc = xmlReadDoc(g_bytes_get_data(response, NULL), "tv-active-channel.xml", "UTF-8", 0);
-    g_bytes_unref(response);
-    if (!doc) {
-        return -1;
+/** @internal
+ * Get the deadline from a call's options
+ * @param options Options passed to the call, or NULL
+ * @return Absolute deadline in monotonic time, or 0 for none
+ */
+static gint64 getDeadline(const RokuCallOptions* options) {
+    return options ? options->deadline : 0;
+}
+
+/** @internal
+ * Check whether a call should stop before sending its next request
+ * @param ctx Context the call is using
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @param cancellable GCancellable of the call, or NULL
+ * @return ROKU_ERROR_TIMEOUT if the deadline has passed, ROKU_ERROR_CANCELLED if the call was cancelled, otherwise 0
+ */
+static int checkCallState(RokuContext* ctx, const gint64 deadline, GCancellable* cancellable) {
+    if (deadlinePassed(deadline)) {
+        atomic_fetch_add_explicit(&ctx->timeouts, 1, memory_order_relaxed);
+        return ROKU_ERROR_TIMEOUT;
     }
-    xmlNodePtr rootElement = xmlDocGetRootElement(doc);
-    if (!rootElement) {
-        xmlFreeDoc(doc);
-        return -2;
+    if (g_cancellable_is_cancelled(cancellable)) {
+        atomic_fetch_add_explicit(&ctx->cancelled, 1, memory_order_relaxed);
+        return ROKU_ERROR_CANCELLED;
     }
-    // Make sure channel is not empty
-    xmlNode* channelElement = rootElement->children;
-    if (!channelElement) {
-        xmlFreeDoc(doc);
-        return -2;
+    return 0;
+}
+
+/** @internal
+ * Get the priority class a request is sent with
+ * @param options Options passed to the call sending the request, or NULL
+ * @param defaultPriority Priority class of the call if its options don't set one
+ * @return ROKU_PRIORITY_INTERACTIVE, ROKU_PRIORITY_NORMAL, or ROKU_PRIORITY_BACKGROUND
+ */
+static RokuPriority getPriority(const RokuCallOptions* options, const RokuPriority defaultPriority) {
+    if (options && options->priority > ROKU_PRIORITY_DEFAULT && options->priority <= ROKU_PRIORITY_BACKGROUND) {
+        return options->priority;
     }
-    if (channelElement->type != XML_ELEMENT_NODE) {
-        channelElement = channelElement->next;
+    return defaultPriority;
+}
+
+/** @internal
+ * Check whether a device has room for another request of a priority class.
+ * Background requests never take a device's last slot, so an interactive request never has to wait for a bulk download.
+ * @param maxRequests Maximum number of requests in flight per device, or 0 for no limit
+ * @param inFlight Number of requests in flight to the device, not counting the one being checked
+ * @param priority Priority class of the request
+ * @return true if the request may be sent
+ */
+static bool slotAvailable(const unsigned maxRequests, const unsigned inFlight, const RokuPriority priority) {
+    if (maxRequests == 0) {
+        return true;
     }
+    unsigned limit = priority == ROKU_PRIORITY_BACKGROUND && maxRequests > 1 ? maxRequests - 1 : maxRequests;
+    return inFlight < limit;
+}
 
-    // Fill in channel with data from XML
-    char tmpPhysicalChannel[3];
-    char tmpFrequency[7];
-    char tmpActive[6];
-    struct xmlElementToStringMap map[] = {
-        {"channel-id", channel->channel.id, sizeof(channel->channel.id) / sizeof(char)},
-        {"broadcast-network-label", channel->channel.network, sizeof(channel->channel.network) / sizeof(char)},
-        {"name", channel->channel.name, sizeof(channel->channel.name) / sizeof(char)},
-        {"type", channel->channel.type, sizeof(channel->channel.type) / sizeof(char)},
-        {"physical-channel", tmpPhysicalChannel, 3},
-        {"physical-frequency", tmpFrequency, 7},
-        {"active-input", tmpActive, 6},
-    };
-    fillFromXML(channelElement, false, map, sizeof(map) / sizeof(*map));
-    if (*tmpPhysicalChannel) {
-        channel->channel.physicalChannel = strtoul(tmpPhysicalChannel, NULL, 10);
+/** @internal
+ * Take a slot for a device without waiting, if one is free and no request of the same or a higher priority class is
+ * queued for one. Must be called with the context's lock held.
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @param priority Priority class of the request
+ * @return true if a slot was taken
+ */
+static bool takeFreeSlot(RokuContext* ctx, struct deviceState* device, const RokuPriority priority) {
+    for (int i = 0; i < priority; i++) {
+        if (!g_queue_is_empty(&device->waiters[i])) {
+            return false;
+        }
+    }
+    if (slotAvailable(atomic_load_explicit(&ctx->maxRequestsPerDevice, memory_order_relaxed), device->inFlight, priority)) {
+        device->inFlight++;
+        return true;
+    }
+    return false;
+}
+
+/** @internal
+ * GCancellable callback waking up a blocking waiter whose call was cancelled
+ * @param cancellable GCancellable of the call
+ * @param user_data Pointer to requestWaiter struct
+ */
+static void cancelWaiterCallback(GCancellable* cancellable, gpointer user_data) {
+    struct requestWaiter* waiter = user_data;
+    g_mutex_lock(waiter->lock);
+    waiter->cancelled = true;
+    g_cond_signal(&waiter->cond);
+    g_mutex_unlock(waiter->lock);
+}
+
+/** @internal
+ * Wait until a request can be sent to a device without going over the context's per-device limit.
+ * Higher priority classes are let through first, and requests of the same class in the order they started waiting.
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @param priority Priority class of the request
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @param cancellable GCancellable of the call, or NULL
+ * @return 0 once a slot is taken, to be given back with releaseRequestSlot(), or ROKU_ERROR_TIMEOUT or ROKU_ERROR_CANCELLED
+ */
+static int acquireRequestSlot(RokuContext* ctx, struct deviceState* device, const RokuPriority priority, const gint64 deadline, GCancellable* cancellable) {
+    g_mutex_lock(&ctx->lock);
+    if (takeFreeSlot(ctx, device, priority)) {
+        g_mutex_unlock(&ctx->lock);
+        return 0;
+    }
+    g_mutex_unlock(&ctx->lock);
+    atomic_fetch_add_explicit(&ctx->queuedRequests, 1, memory_order_relaxed);
+
+    // Connect to the cancellable before locking, since the handler is run right away if the call is already cancelled
+    GQueue* queue = &device->waiters[priority - 1];
+    struct requestWaiter waiter = {.lock = &ctx->lock};
+    g_cond_init(&waiter.cond);
+    gulong cancelHandler = cancellable ? g_cancellable_connect(cancellable, G_CALLBACK(cancelWaiterCallback), &waiter, NULL) : 0;
+
+    g_mutex_lock(&ctx->lock);
+    if (takeFreeSlot(ctx, device, priority)) {
+        waiter.granted = true;
     } else {
-        channel->channel.physicalChannel = 0;
+        g_queue_push_tail(queue, &waiter);
+        bool timedOut = false;
+        while (!waiter.granted && !waiter.cancelled && !timedOut) {
+            if (deadline > 0) {
+                timedOut = !g_cond_wait_until(&waiter.cond, &ctx->lock, deadline);
+            } else {
+                g_cond_wait(&waiter.cond, &ctx->lock);
+            }
+        }
+        if (!waiter.granted) {
+            g_queue_remove(queue, &waiter);
+        }
     }
-    if (*tmpFrequency) {
-        channel->channel.frequency = strtoul(tmpFrequency, NULL, 10) * 1000UL;
+    g_mutex_unlock(&ctx->lock);
+
+    if (cancelHandler) {
+        g_cancellable_disconnect(cancellable, cancelHandler);
+    }
+    g_cond_clear(&waiter.cond);
+    if (waiter.granted) {
+        return 0;
+    }
+    return checkCallState(ctx, deadline, cancellable);
+}
+
+/** @internal
+ * Free an asynchronous waiter once it is out of its queue, removing its sources. Must be called in its grantContext.
+ * @param waiter Waiter to free
+ */
+static void freeAsyncWaiter(struct requestWaiter* waiter) {
+    if (waiter->cancelSource) {
+        g_source_destroy(waiter->cancelSource);
+        g_source_unref(waiter->cancelSource);
+    }
+    if (waiter->deadlineSource) {
+        g_source_destroy(waiter->deadlineSource);
+        g_source_unref(waiter->deadlineSource);
+    }
+    g_main_context_unref(waiter->grantContext);
+    g_free(waiter);
+}
+
+/** @internal
+ * grantContext callback handing a slot to an asynchronous waiter that was given one by releaseRequestSlot()
+ * @param user_data Pointer to requestWaiter struct, which is freed
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean grantWaiterCallback(gpointer user_data) {
+    struct requestWaiter* waiter = user_data;
+    GSourceFunc grant = waiter->grant;
+    gpointer grantData = waiter->grantData;
+    freeAsyncWaiter(waiter);
+    grant(grantData);
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Source callback taking an asynchronous waiter out of its queue once its call is cancelled or runs out of time, so it
+ * doesn't wait behind a hung request. Runs in the waiter's grantContext, like grantWaiterCallback(), so the two can't race.
+ * @param user_data Pointer to requestWaiter struct, which is freed unless it was already granted a slot
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean abandonWaiterCallback(gpointer user_data) {
+    struct requestWaiter* waiter = user_data;
+    g_mutex_lock(waiter->lock);
+    // A waiter granted a slot already has grantWaiterCallback() queued, which frees it
+    if (waiter->granted) {
+        g_mutex_unlock(waiter->lock);
+        return G_SOURCE_REMOVE;
+    }
+    g_queue_remove(waiter->queue, waiter);
+    g_mutex_unlock(waiter->lock);
+    GSourceFunc abandon = waiter->abandon;
+    gpointer grantData = waiter->grantData;
+    freeAsyncWaiter(waiter);
+    abandon(grantData);
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * GCancellable source callback abandoning an asynchronous waiter whose call was cancelled
+ * @param cancellable GCancellable of the call
+ * @param user_data Pointer to requestWaiter struct
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean cancelAsyncWaiterCallback(GCancellable* cancellable, gpointer user_data) {
+    return abandonWaiterCallback(user_data);
+}
+
+/** @internal
+ * Take a slot for an asynchronous request, or queue the request until one is free.
+ * A queued request is taken out of the queue as soon as its call is cancelled or its deadline passes.
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @param priority Priority class of the request
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @param cancellable GCancellable of the call, or NULL
+ * @param grantContext Context to call grant or abandon in if the request has to wait
+ * @param grant Function to call once the request owns a slot, if it has to wait
+ * @param abandon Function to call instead of grant if the call is cancelled or its deadline passes while it waits
+ * @param grantData Data to pass to grant or abandon
+ * @return true if a slot was taken right away, false if grant or abandon will be called later
+ */
+static bool acquireRequestSlotAsync(RokuContext* ctx, struct deviceState* device, const RokuPriority priority, const gint64 deadline, GCancellable* cancellable,
+                                    GMainContext* grantContext, GSourceFunc grant, GSourceFunc abandon, gpointer grantData) {
+    g_mutex_lock(&ctx->lock);
+    if (takeFreeSlot(ctx, device, priority)) {
+        g_mutex_unlock(&ctx->lock);
+        return true;
+    }
+    struct requestWaiter* waiter = g_new0(struct requestWaiter, 1);
+    waiter->lock = &ctx->lock;
+    waiter->grantContext = g_main_context_ref(grantContext);
+    waiter->grant = grant;
+    waiter->abandon = abandon;
+    waiter->grantData = grantData;
+    waiter->queue = &device->waiters[priority - 1];
+    // The sources are set up before the waiter is queued, since it may be granted a slot as soon as the lock is released
+    if (cancellable) {
+        waiter->cancelSource = g_cancellable_source_new(cancellable);
+        g_source_set_callback(waiter->cancelSource, (GSourceFunc) (void (*)(void)) cancelAsyncWaiterCallback, waiter, NULL);
+        g_source_attach(waiter->cancelSource, grantContext);
+    }
+    if (deadline > 0) {
+        waiter->deadlineSource = g_source_new(&timerSourceFuncs, sizeof(GSource));
+        g_source_set_callback(waiter->deadlineSource, abandonWaiterCallback, waiter, NULL);
+        g_source_set_ready_time(waiter->deadlineSource, deadline);
+        g_source_attach(waiter->deadlineSource, grantContext);
+    }
+    g_queue_push_tail(waiter->queue, waiter);
+    g_mutex_unlock(&ctx->lock);
+    atomic_fetch_add_explicit(&ctx->queuedRequests, 1, memory_order_relaxed);
+    return false;
+}
+
+/** @internal
+ * Give back a slot taken with acquireRequestSlot() or acquireRequestSlotAsync(), handing it to the oldest waiter of the
+ * highest priority class that can use it, if there is one
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ */
+static void releaseRequestSlot(RokuContext* ctx, struct deviceState* device) {
+    g_mutex_lock(&ctx->lock);
+    unsigned maxRequests = atomic_load_explicit(&ctx->maxRequestsPerDevice, memory_order_relaxed);
+    struct requestWaiter* waiter = NULL;
+    for (int i = 0; i < PRIORITY_CLASSES && !waiter; i++) {
+        if (!g_queue_is_empty(&device->waiters[i]) && slotAvailable(maxRequests, device->inFlight - 1, i + 1)) {
+            waiter = g_queue_pop_head(&device->waiters[i]);
+        }
+    }
+    if (!waiter) {
+        device->inFlight--;
+        g_mutex_unlock(&ctx->lock);
+        return;
+    }
+
+    // The slot moves straight to the waiter, so inFlight stays the same
+    waiter->granted = true;
+    if (!waiter->grantContext) {
+        g_cond_signal(&waiter->cond);
+        g_mutex_unlock(&ctx->lock);
+        return;
+    }
+    g_mutex_unlock(&ctx->lock);
+    g_main_context_invoke(waiter->grantContext, grantWaiterCallback, waiter);
+}
+
+/** @internal
+ * Take a token from a device's rate limit bucket, reserving one that hasn't been refilled yet if it's empty
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @return Monotonic time the request may be sent at, or 0 if it may be sent now
+ */
+static gint64 reserveToken(RokuContext* ctx, struct deviceState* device) {
+    g_mutex_lock(&ctx->lock);
+    if (ctx->rateLimit <= 0) {
+        g_mutex_unlock(&ctx->lock);
+        return 0;
+    }
+    gint64 now = g_get_monotonic_time();
+    double burst = ctx->rateBurst ? ctx->rateBurst : 1;
+    if (device->lastRefill) {
+        device->tokens = MIN(burst, device->tokens + (now - device->lastRefill) * ctx->rateLimit / G_USEC_PER_SEC);
     } else {
-        channel->channel.frequency = 0;
+        device->tokens = burst;
+    }
+    device->lastRefill = now;
+    device->tokens--;
+    gint64 readyTime = device->tokens < 0 ? now + (gint64) (-device->tokens / ctx->rateLimit * G_USEC_PER_SEC) : 0;
+    g_mutex_unlock(&ctx->lock);
+    return readyTime;
+}
+
+/** @internal
+ * Give back a token reserved with reserveToken() by a request that won't be sent after all
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ */
+static void returnToken(RokuContext* ctx, struct deviceState* device) {
+    g_mutex_lock(&ctx->lock);
+    device->tokens++;
+    g_mutex_unlock(&ctx->lock);
+}
+
+/** @internal
+ * Sleep until a given time, waking up early if a call is cancelled
+ * @param wakeTime Monotonic time to sleep until
+ * @param cancellable GCancellable of the call, or NULL
+ * @return true once wakeTime has passed, or false if the call was cancelled first
+ */
+static bool sleepUntil(const gint64 wakeTime, GCancellable* cancellable) {
+    GMutex lock;
+    g_mutex_init(&lock);
+    struct requestWaiter waiter = {.lock = &lock};
+    g_cond_init(&waiter.cond);
+    gulong cancelHandler = cancellable ? g_cancellable_connect(cancellable, G_CALLBACK(cancelWaiterCallback), &waiter, NULL) : 0;
+    bool ready = false;
+    g_mutex_lock(&lock);
+    while (!waiter.cancelled && !ready) {
+        ready = !g_cond_wait_until(&waiter.cond, &lock, wakeTime);
+    }
+    g_mutex_unlock(&lock);
+    if (cancelHandler) {
+        g_cancellable_disconnect(cancellable, cancelHandler);
+    }
+    g_cond_clear(&waiter.cond);
+    g_mutex_clear(&lock);
+    return !waiter.cancelled;
+}
+
+/** @internal
+ * Wait until a device's rate limit allows another request to be sent
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @param cancellable GCancellable of the call, or NULL
+ * @return 0 once the request may be sent, or ROKU_ERROR_TIMEOUT or ROKU_ERROR_CANCELLED
+ */
+static int waitForToken(RokuContext* ctx, struct deviceState* device, const gint64 deadline, GCancellable* cancellable) {
+    gint64 readyTime = reserveToken(ctx, device);
+    if (!readyTime) {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&ctx->throttledRequests, 1, memory_order_relaxed);
+
+    // There's no point waiting if the token won't be ready before the deadline
+    if (deadline > 0 && deadline < readyTime) {
+        returnToken(ctx, device);
+        atomic_fetch_add_explicit(&ctx->timeouts, 1, memory_order_relaxed);
+        return ROKU_ERROR_TIMEOUT;
+    }
+
+    // Sleep until the token is ready, waking up early if the call is cancelled
+    if (!sleepUntil(readyTime, cancellable)) {
+        returnToken(ctx, device);
+        return checkCallState(ctx, deadline, cancellable);
+    }
+    return 0;
+}
+
+/** @internal
+ * Check whether requests to a device should fail fast because its circuit breaker is open
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @return 0 if requests may be sent, or ROKU_ERROR_CIRCUIT_OPEN
+ */
+static int checkCircuit(RokuContext* ctx, struct deviceState* device) {
+    g_mutex_lock(&ctx->lock);
+    bool open = device->circuitOpen;
+    g_mutex_unlock(&ctx->lock);
+    if (open) {
+        atomic_fetch_add_explicit(&ctx->circuitRejections, 1, memory_order_relaxed);
+        return ROKU_ERROR_CIRCUIT_OPEN;
+    }
+    return 0;
+}
+
+/** @internal
+ * Close a device's circuit breaker and stop probing it. Must be called on the worker thread.
+ * @param device State of the device
+ */
+static void closeCircuit(struct deviceState* device) {
+    g_mutex_lock(&device->ctx->lock);
+    device->circuitOpen = false;
+    device->failures = 0;
+    g_mutex_unlock(&device->ctx->lock);
+    if (device->probeTimer) {
+        g_source_destroy(device->probeTimer);
+        g_source_unref(device->probeTimer);
+        device->probeTimer = NULL;
+    }
+}
+
+/** @internal
+ * libsoup callback for probes of a device whose circuit breaker is open: close it if the device answered
+ * @param source SoupSession the probe was sent with
+ * @param result Result of the probe
+ * @param user_data Pointer to deviceState struct
+ */
+static void probeCallback(GObject* source, GAsyncResult* result, gpointer user_data) {
+    struct deviceState* device = user_data;
+    GBytes* response = soup_session_send_and_read_finish(SOUP_SESSION(source), result, NULL);
+    stopRequestTimer(device->ctx, device->probeRequestTimer, device->probeMsg);
+    unsigned status = soup_message_get_status(device->probeMsg);
+    g_object_unref(device->probeMsg);
+    device->probeMsg = NULL;
+    if (response) {
+        g_bytes_unref(response);
+        if (status == SOUP_STATUS_OK) {
+            closeCircuit(device);
+        }
+    }
+}
+
+/** @internal
+ * Worker thread timer callback: probe a device whose circuit breaker is open by requesting its device-info
+ * @param user_data Pointer to deviceState struct
+ * @return G_SOURCE_CONTINUE until the circuit breaker is closed
+ */
+static gboolean probeTimerCallback(gpointer user_data) {
+    struct deviceState* device = user_data;
+    RokuContext* ctx = device->ctx;
+    // Turning circuit breakers off closes any open ones
+    if (atomic_load_explicit(&ctx->circuitThreshold, memory_order_relaxed) == 0) {
+        closeCircuit(device);
+        return G_SOURCE_REMOVE;
+    }
+    if (!device->probeMsg) {
+        device->probeMsg = soup_message_new_from_uri(SOUP_METHOD_GET, device->endpointURIs[ROKU_ENDPOINT_DEVICE_INFO]);
+        device->probeRequestTimer = startRequestTimer(ctx, NULL, 0, ctx->workerContext, device->probeMsg);
+        soup_session_send_and_read_async(device->session, device->probeMsg, G_PRIORITY_LOW, device->probeRequestTimer->cancellable, probeCallback, device);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/** @internal
+ * Worker thread callback: start probing a device whose circuit breaker just opened
+ * @param user_data Pointer to deviceState struct
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean startProbingCallback(gpointer user_data) {
+    struct deviceState* device = user_data;
+    if (!device->probeTimer) {
+        unsigned interval = atomic_load_explicit(&device->ctx->probeInterval, memory_order_relaxed);
+        device->probeTimer = g_timeout_source_new_seconds(interval ? interval : 1);
+        g_source_set_callback(device->probeTimer, probeTimerCallback, device, NULL);
+        g_source_attach(device->probeTimer, device->ctx->workerContext);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Feed the outcome of a request into its device's circuit breaker, opening it after too many failures in a row
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @param failed true if the request failed without the device answering
+ */
+static void recordDeviceHealth(RokuContext* ctx, struct deviceState* device, const bool failed) {
+    unsigned threshold = atomic_load_explicit(&ctx->circuitThreshold, memory_order_relaxed);
+    g_mutex_lock(&ctx->lock);
+    bool opened = false;
+    if (!failed) {
+        device->failures = 0;
+    } else if (++device->failures >= threshold && threshold && !device->circuitOpen && device->endpointURIs[ROKU_ENDPOINT_DEVICE_INFO]) {
+        // Only devices that can be probed get a circuit breaker, since probing is what closes it again
+        device->circuitOpen = opened = true;
+    }
+    g_mutex_unlock(&ctx->lock);
+    if (opened) {
+        g_main_context_invoke(ctx->workerContext, startProbingCallback, device);
+    }
+}
+
+/** @internal
+ * Paths of every endpoint other than ROKU_ENDPOINT_OTHER without their leading slash, indexed by RokuEndpoint
+ */
+static const char* const endpointPrefixes[ROKU_ENDPOINT_OTHER] = {"query/device-info", "query/tv-channels", "query/tv-active-channel", "query/apps",
+                                                                  "query/active-app",  "query/icon",        "keypress",
+                                                                  "launch",            "input",             "search"};
+
+/** @internal
+ * Work out which endpoint a request path belongs to
+ * @param path Path of the request, which may start with any number of slashes
+ * @return Endpoint of the request
+ */
+static RokuEndpoint classifyPath(const char* path) {
+    while (*path == '/') {
+        path++;
+    }
+    for (int i = 0; i < ROKU_ENDPOINT_OTHER; i++) {
+        size_t length = strlen(endpointPrefixes[i]);
+        if (strncmp(path, endpointPrefixes[i], length) == 0 && (path[length] == '\0' || path[length] == '/' || path[length] == '?')) {
+            return i;
+        }
+    }
+    return ROKU_ENDPOINT_OTHER;
+}
+
+/** @internal
+ * Work out which endpoint a request to a device belongs to
+ * @param device State of the device
+ * @param url string containing the URL requested, or NULL if uri is given
+ * @param uri Pre-parsed URI requested, or NULL if url is given
+ * @return Endpoint of the request
+ */
+static RokuEndpoint getRequestEndpoint(const struct deviceState* device, const char* url, GUri* uri) {
+    if (!uri) {
+        return classifyPath(url + device->baseLength);
+    }
+    for (int i = 0; i < NUM_QUERY_ENDPOINTS; i++) {
+        if (uri == device->endpointURIs[i]) {
+            return i;
+        }
+    }
+    return classifyPath(g_uri_get_path(uri));
+}
+
+/** @internal
+ * Find the latency histogram bucket a latency falls in. Latencies under 16 microseconds get a bucket each, and every
+ * power of two above that is split into HISTOGRAM_SUB_BUCKETS equal buckets.
+ * @param latency Latency in microseconds
+ * @return Index of the bucket
+ */
+static unsigned getHistogramBucket(const gint64 latency) {
+    if (latency < HISTOGRAM_SUB_BUCKETS) {
+        return latency > 0 ? (unsigned) latency : 0;
+    }
+    if (latency >= (gint64) 1 << 26) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    unsigned exponent = g_bit_nth_msf((gulong) latency, -1);
+    return (exponent - 3) * HISTOGRAM_SUB_BUCKETS + (unsigned) ((latency >> (exponent - 4)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/** @internal
+ * Get the latency a histogram bucket stands for, which is the middle of the range of latencies it holds
+ * @param bucket Index of the bucket
+ * @return Latency in microseconds
+ */
+static gint64 getBucketLatency(const unsigned bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned exponent = bucket / HISTOGRAM_SUB_BUCKETS + 3;
+    gint64 width = (gint64) 1 << (exponent - 4);
+    return (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) * width + width / 2;
+}
+
+/** @internal
+ * Record a finished request in its device's endpoint statistics
+ * @param span Span of the request
+ * @param failed true if the request failed or didn't return 200 OK
+ */
+static void recordEndpointStats(const struct requestSpan* span, const bool failed) {
+    _Atomic(struct endpointStats*)* slot = &span->device->endpointStats[span->endpoint];
+    struct endpointStats* stats = atomic_load_explicit(slot, memory_order_acquire);
+    if (!stats) {
+        // Whichever thread gets there first installs its statistics, and any others throw theirs away
+        struct endpointStats* newStats = g_new0(struct endpointStats, 1);
+        if (atomic_compare_exchange_strong_explicit(slot, &stats, newStats, memory_order_acq_rel, memory_order_acquire)) {
+            stats = newStats;
+        } else {
+            g_free(newStats);
+        }
+    }
+
+    gint64 latency = MAX(g_get_monotonic_time() - span->start, 0);
+    atomic_fetch_add_explicit(&stats->requests, 1, memory_order_relaxed);
+    if (failed) {
+        atomic_fetch_add_explicit(&stats->failedRequests, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&stats->totalLatency, latency, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->buckets[getHistogramBucket(latency)], 1, memory_order_relaxed);
+    int_fast64_t maxLatency = atomic_load_explicit(&stats->maxLatency, memory_order_relaxed);
+    while (latency > maxLatency &&
+           !atomic_compare_exchange_weak_explicit(&stats->maxLatency, &maxLatency, latency, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/** @internal
+ * Record statistics for a finished request, trace it, and turn its outcome into a result code
+ * @param ctx Context the request was sent with
+ * @param span Span of the request
+ * @param status HTTP status code of the response
+ * @param response Response body, or NULL if the request failed
+ * @param error Error the request failed with, if any, which will be freed
+ * @param timedOut true if the request was cancelled because it timed out
+ * @return libsoup error code, or HTTP status code, or 0 if the status is 200 OK, or ROKU_ERROR_TIMEOUT or ROKU_ERROR_CANCELLED
+ */
+static int finishRequest(RokuContext* ctx, const struct requestSpan* span, const unsigned status, GBytes* response, GError* error, const bool timedOut) {
+    atomic_fetch_add_explicit(&ctx->requests, 1, memory_order_relaxed);
+    if (response) {
+        atomic_fetch_add_explicit(&ctx->bytesReceived, g_bytes_get_size(response), memory_order_relaxed);
+    }
+    // Some transport errors have a code of 0, so go by whether there was an error rather than by the result
+    bool failed = error || status != SOUP_STATUS_OK;
+    int result = status == SOUP_STATUS_OK ? 0 : (int) status;
+    if (error) {
+        result = error->code;
+        if (timedOut || g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+            atomic_fetch_add_explicit(&ctx->timeouts, 1, memory_order_relaxed);
+            result = ROKU_ERROR_TIMEOUT;
+        } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            atomic_fetch_add_explicit(&ctx->cancelled, 1, memory_order_relaxed);
+            result = ROKU_ERROR_CANCELLED;
+        }
+        // A cancelled call says nothing about the device
+        if (result != ROKU_ERROR_CANCELLED) {
+            recordDeviceHealth(ctx, span->device, true);
+        }
+        g_error_free(error);
+    } else {
+        recordDeviceHealth(ctx, span->device, false);
+    }
+    if (failed) {
+        atomic_fetch_add_explicit(&ctx->failedRequests, 1, memory_order_relaxed);
+    }
+    recordEndpointStats(span, failed);
+    traceRequest(ctx, span, ROKU_TRACE_BODY_COMPLETE, result);
+    return result;
+}
+
+/** @internal
+ * Whether a failed request is worth retrying: it timed out, failed without a response, or the device was briefly unavailable
+ * @param result Result code returned by finishRequest()
+ * @return true if the request may succeed if sent again
+ */
+static bool isRetryable(const int result) {
+    // Transport errors are small GIO or libsoup error codes, while responses have HTTP status codes of 100 or more
+    return result == ROKU_ERROR_TIMEOUT || (result > 0 && result < 100) || result == SOUP_STATUS_SERVICE_UNAVAILABLE;
+}
+
+/** @internal
+ * Work out when to send a retry, backing off exponentially with jitter so retries from many callers don't line up
+ * @param ctx Context the request was sent with
+ * @param retry Number of retries already made for the request
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @return Monotonic time to send the retry at, or 0 if the request shouldn't be retried
+ */
+static gint64 getRetryTime(RokuContext* ctx, const unsigned retry, const gint64 deadline) {
+    if (retry >= atomic_load_explicit(&ctx->maxRetries, memory_order_relaxed)) {
+        return 0;
+    }
+    // Cap the doubling at about half a minute, then pick a delay between half and all of it
+    gint64 delay = atomic_load_explicit(&ctx->retryDelay, memory_order_relaxed) * (gint64) 1000 << MIN(retry, 15);
+    delay = MIN(delay, 30 * G_USEC_PER_SEC);
+    delay = delay / 2 + (delay > 1 ? g_random_int_range(0, (gint32) (delay / 2)) : 0);
+    gint64 retryTime = g_get_monotonic_time() + delay;
+    if (deadline > 0 && retryTime >= deadline) {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&ctx->retries, 1, memory_order_relaxed);
+    return retryTime;
+}
+
+/** @internal
+ * Size of the stack buffers the raw transport builds requests and reads responses in
+ */
+#define RAW_BUFFER_SIZE 1024
+
+/** @internal
+ * Check whether a request can be sent with the raw transport
+ * @param ctx Context the request is sent with
+ * @param device State of the device
+ * @param url string containing the URL to request
+ * @param method type of request to send (e.g. "GET" or "POST")
+ * @param response Pointer the caller wants the response body in, or NULL if it only needs the status
+ * @return true if the context uses the raw transport and the request is a POST that only needs a status
+ */
+static bool useRawTransport(RokuContext* ctx, const struct deviceState* device, const char* url, const char* method, GBytes** response) {
+    return !response && device->address && strcmp(method, SOUP_METHOD_POST) == 0 &&
+           atomic_load_explicit(&ctx->transport, memory_order_relaxed) != ROKU_TRANSPORT_LIBSOUP && strlen(url) < RAW_BUFFER_SIZE / 2;
+}
+
+/** @internal
+ * Take an idle raw transport socket for a device, skipping any the device has closed since they were used
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @return Connected socket, or NULL if there are no idle sockets
+ */
+static GSocket* takeRawSocket(RokuContext* ctx, struct deviceState* device) {
+    GSocket* socket = NULL;
+    g_mutex_lock(&ctx->lock);
+    while (!socket && device->numIdleSockets) {
+        socket = device->idleSockets[--device->numIdleSockets];
+        // An idle connection shouldn't have anything to read, so if it does the device has closed it
+        if (g_socket_condition_check(socket, G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+            g_object_unref(socket);
+            socket = NULL;
+        }
+    }
+    g_mutex_unlock(&ctx->lock);
+    return socket;
+}
+
+/** @internal
+ * Keep a raw transport socket open for the next request to a device, or close it if enough are already kept open
+ * @param ctx Context owning the device state
+ * @param device State of the device
+ * @param socket Connected socket with no request in progress
+ */
+static void putRawSocket(RokuContext* ctx, struct deviceState* device, GSocket* socket) {
+    g_mutex_lock(&ctx->lock);
+    if (device->numIdleSockets < G_N_ELEMENTS(device->idleSockets)) {
+        device->idleSockets[device->numIdleSockets++] = socket;
+        socket = NULL;
+    }
+    g_mutex_unlock(&ctx->lock);
+    if (socket) {
+        g_object_unref(socket);
+    }
+}
+
+/** @internal
+ * Wait for a non-blocking socket to become ready
+ * @param socket Socket to wait for
+ * @param condition Condition to wait for
+ * @param expiry Absolute time to give up at in monotonic time, or -1 to wait forever
+ * @param cancellable GCancellable of the call, or NULL
+ * @param error Pointer to GError pointer, set if the socket didn't become ready
+ * @return true if the socket is ready
+ */
+static bool waitForSocket(GSocket* socket, const GIOCondition condition, const gint64 expiry, GCancellable* cancellable, GError** error) {
+    gint64 timeout = expiry < 0 ? -1 : MAX(expiry - g_get_monotonic_time(), 0);
+    return g_socket_condition_timed_wait(socket, condition, timeout, cancellable, error);
+}
+
+/** @internal
+ * Open a new raw transport connection to a device
+ * @param ctx Context the request is sent with
+ * @param device State of the device
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @param cancellable GCancellable of the call, or NULL
+ * @param error Pointer to GError pointer, set if the connection failed
+ * @return Connected non-blocking socket, or NULL if the connection failed
+ */
+static GSocket* connectRawSocket(RokuContext* ctx, const struct deviceState* device, const gint64 deadline, GCancellable* cancellable, GError** error) {
+    GSocket* socket = g_socket_new(g_socket_address_get_family(device->address), G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, error);
+    if (!socket) {
+        return NULL;
+    }
+    g_socket_set_blocking(socket, FALSE);
+    if (g_socket_connect(socket, device->address, cancellable, error)) {
+        return socket;
+    }
+
+    // Non-blocking connects finish in the background, so wait for them to succeed or fail
+    gint64 expiry = getExpiry(atomic_load_explicit(&ctx->connectTimeout, memory_order_relaxed), deadline);
+    if (g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_PENDING)) {
+        g_clear_error(error);
+        if (waitForSocket(socket, G_IO_OUT, expiry, cancellable, error) && g_socket_check_connect_result(socket, error)) {
+            return socket;
+        }
+    }
+    g_object_unref(socket);
+    return NULL;
+}
+
+/** @internal
+ * Find the value of a header in a raw HTTP response head
+ * @param head Response head, ending with an empty line
+ * @param name Name of the header followed by a colon (like "Content-Length:")
+ * @return Pointer to the start of the header's value, or NULL if the response doesn't have it
+ */
+static const char* findRawHeader(const char* head, const char* name) {
+    size_t nameLength = strlen(name);
+    for (const char* line = strstr(head, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+        if (g_ascii_strncasecmp(line + 2, name, nameLength) == 0) {
+            const char* value = line + 2 + nameLength;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/** @internal
+ * Buffer for reading raw transport responses, which keeps any bytes of pipelined responses read ahead of the current one
+ */
+struct rawReader {
+    char buffer[RAW_BUFFER_SIZE]; /**< Bytes received but not consumed yet, followed by a null terminator */
+    size_t used; /**< Number of bytes in buffer */
+};
+
+/** @internal
+ * Write a prebuilt request (or several pipelined ones) on a raw transport socket
+ * @param socket Connected socket
+ * @param request Request to send
+ * @param requestLength Length of request in bytes
+ * @param expiry Absolute time to give up at in monotonic time, or -1 to wait forever
+ * @param cancellable GCancellable of the call, or NULL
+ * @param error Pointer to GError pointer, set if the request couldn't be written
+ * @return true if the whole request was written
+ */
+static bool writeRawRequest(GSocket* socket, const char* request, const size_t requestLength, const gint64 expiry, GCancellable* cancellable, GError** error) {
+    for (size_t sent = 0; sent < requestLength;) {
+        if (!waitForSocket(socket, G_IO_OUT, expiry, cancellable, error)) {
+            return false;
+        }
+        gssize written = g_socket_send(socket, request + sent, requestLength - sent, cancellable, error);
+        if (written < 0) {
+            return false;
+        }
+        sent += written;
+    }
+    return true;
+}
+
+/** @internal
+ * Parse the status line of a raw HTTP response
+ * @param head Response head, null-terminated
+ * @param error Pointer to GError pointer, set if the status line isn't valid
+ * @return HTTP status code, or 0 if the status line isn't valid
+ */
+static unsigned parseRawStatus(const char* head, GError** error) {
+    const char* statusCode = strchr(head, ' ');
+    unsigned status = g_str_has_prefix(head, "HTTP/1.") && statusCode ? (unsigned) g_ascii_strtoull(statusCode + 1, NULL, 10) : 0;
+    if (!status) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid status line");
+    }
+    return status;
+}
+
+/** @internal
+ * Read the next response from a raw transport socket and return its status, discarding the rest of the response
+ * @param socket Connected socket
+ * @param reader Buffer holding anything read ahead of the response
+ * @param expiry Absolute time to give up at in monotonic time, or -1 to wait forever
+ * @param cancellable GCancellable of the call, or NULL
+ * @param reusable Pointer to bool, set to whether the connection can be used for another response
+ * @param error Pointer to GError pointer, set if the response couldn't be read
+ * @return HTTP status code, or 0 if reading the response failed
+ */
+static unsigned readRawResponse(GSocket* socket, struct rawReader* reader, const gint64 expiry, GCancellable* cancellable, bool* reusable, GError** error) {
+    // Read until the end of the response head, which has to fit in the buffer
+    *reusable = false;
+    char* buffer = reader->buffer;
+    buffer[reader->used] = '\0';
+    const char* headEnd = strstr(buffer, "\r\n\r\n");
+    while (!headEnd) {
+        if (reader->used == sizeof(reader->buffer) - 1) {
+            g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Response head too long");
+            return 0;
+        }
+        if (!waitForSocket(socket, G_IO_IN, expiry, cancellable, error)) {
+            return 0;
+        }
+        gssize received = g_socket_receive(socket, buffer + reader->used, sizeof(reader->buffer) - 1 - reader->used, cancellable, error);
+        if (received < 0) {
+            return 0;
+        }
+        if (received == 0) {
+            g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED, "Connection closed before response");
+            return 0;
+        }
+        reader->used += received;
+        buffer[reader->used] = '\0';
+        headEnd = strstr(buffer, "\r\n\r\n");
+    }
+    unsigned status = parseRawStatus(buffer, error);
+    if (!status) {
+        return 0;
+    }
+
+    // The connection can only be reused if the body has a known length and the device isn't about to close it
+    const char* connection = findRawHeader(buffer, "Connection:");
+    const char* contentLength = findRawHeader(buffer, "Content-Length:");
+    if (!contentLength || (connection && g_ascii_strncasecmp(connection, "close", 5) == 0)) {
+        return status;
+    }
+    guint64 bodyLength = g_ascii_strtoull(contentLength, NULL, 10);
+    size_t headLength = headEnd + 4 - buffer;
+    size_t buffered = reader->used - headLength;
+
+    // Keep whatever follows the body in the buffer for the next response
+    if (bodyLength <= buffered) {
+        memmove(buffer, buffer + headLength + bodyLength, buffered - bodyLength);
+        reader->used = buffered - bodyLength;
+        *reusable = true;
+        return status;
+    }
+    guint64 remaining = bodyLength - buffered;
+    reader->used = 0;
+    while (remaining) {
+        if (!waitForSocket(socket, G_IO_IN, expiry, cancellable, NULL)) {
+            return status;
+        }
+        gssize received = g_socket_receive(socket, buffer, MIN(remaining, sizeof(reader->buffer) - 1), cancellable, NULL);
+        if (received <= 0) {
+            return status;
+        }
+        remaining -= received;
+    }
+    *reusable = true;
+    return status;
+}
+
+/** @internal
+ * Send a status-only POST request with the raw transport, which writes a prebuilt HTTP/1.1 request on a kept-alive
+ * socket and only parses the status line of the response, skipping libsoup entirely
+ * @param ctx Context to send the request with
+ * @param span Span of the request, whose device must have an address
+ * @param url string containing the URL to request
+ * @param deadline Absolute deadline of the call in monotonic time, or 0 for none
+ * @param cancellable GCancellable of the call, or NULL
+ * @return libsoup error code, or HTTP status code, or 0 if the status is 200 OK, or ROKU_ERROR_TIMEOUT or ROKU_ERROR_CANCELLED
+ */
+static int sendRawRequest(RokuContext* ctx, const struct requestSpan* span, const char* url, const gint64 deadline, GCancellable* cancellable) {
+    struct deviceState* device = span->device;
+    const char* path = url + device->baseLength;
+    char request[RAW_BUFFER_SIZE];
+    int requestLength = g_snprintf(request, sizeof(request), "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Length: 0\r\n\r\n", *path ? path : "/",
+                                   device->hostHeader);
+
+    GError* error = NULL;
+    unsigned status = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        GSocket* socket = attempt == 0 ? takeRawSocket(ctx, device) : NULL;
+        bool reused = socket != NULL;
+        if (!socket) {
+            socket = connectRawSocket(ctx, device, deadline, cancellable, &error);
+            if (!socket) {
+                break;
+            }
+        }
+        countConnectionUse(ctx, !reused);
+        traceRequest(ctx, span, ROKU_TRACE_CONNECT, 0);
+        bool reusable = false;
+        gint64 expiry = getExpiry(atomic_load_explicit(&ctx->readTimeout, memory_order_relaxed), deadline);
+        if (writeRawRequest(socket, request, requestLength, expiry, cancellable, &error)) {
+            struct rawReader reader;
+            reader.used = 0;
+            status = readRawResponse(socket, &reader, expiry, cancellable, &reusable, &error);
+            if (status) {
+                traceRequest(ctx, span, ROKU_TRACE_FIRST_BYTE, 0);
+            }
+            // Anything left over means the device sent more than was asked for, so don't trust the connection
+            reusable = reusable && reader.used == 0;
+        }
+        if (status && reusable) {
+            putRawSocket(ctx, device, socket);
+        } else {
+            g_object_unref(socket);
+        }
+
+        // A kept-alive connection may have been closed by the device just as the request was sent, so retry on a new one
+        if (status || !reused ||
+            !(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED) || g_error_matches(error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE))) {
+            break;
+        }
+        g_clear_error(&error);
+    }
+    return finishRequest(ctx, span, status, NULL, error, false);
+}
+
+/** @internal
+ * Worker thread socket source callback: a pre-warmed raw transport connection finished connecting, so park it
+ * @param socket Socket that was connecting
+ * @param condition Condition the socket is in
+ * @param user_data Pointer to deviceState struct
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean rawPrewarmCallback(GSocket* socket, GIOCondition condition, gpointer user_data) {
+    struct deviceState* device = user_data;
+    if (g_socket_check_connect_result(socket, NULL)) {
+        putRawSocket(device->ctx, device, socket);
+    } else {
+        g_object_unref(socket);
+    }
+    g_source_unref(device->prewarmConnect);
+    device->prewarmConnect = NULL;
+    device->prewarmSocket = NULL;
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Make sure a device has an idle connection open for the transport its context uses. Must be called on the worker thread.
+ * @param device State of the device
+ */
+static void warmDevice(struct deviceState* device) {
+    RokuContext* ctx = device->ctx;
+    if (atomic_load_explicit(&ctx->transport, memory_order_relaxed) != ROKU_TRANSPORT_LIBSOUP && device->address) {
+        // Leave things alone if a connection is already on its way or there's still a live idle one
+        if (device->prewarmConnect) {
+            return;
+        }
+        GSocket* socket = takeRawSocket(ctx, device);
+        if (socket) {
+            putRawSocket(ctx, device, socket);
+            return;
+        }
+        socket = g_socket_new(g_socket_address_get_family(device->address), G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL);
+        if (!socket) {
+            return;
+        }
+        atomic_fetch_add_explicit(&ctx->prewarms, 1, memory_order_relaxed);
+        g_socket_set_blocking(socket, FALSE);
+        GError* error = NULL;
+        if (g_socket_connect(socket, device->address, NULL, &error)) {
+            putRawSocket(ctx, device, socket);
+        } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_PENDING)) {
+            // Wait for the connection in the worker loop rather than blocking it
+            device->prewarmSocket = socket;
+            device->prewarmConnect = g_socket_create_source(socket, G_IO_OUT, NULL);
+            g_source_set_callback(device->prewarmConnect, (GSourceFunc) (void (*)(void)) rawPrewarmCallback, device, NULL);
+            g_source_attach(device->prewarmConnect, ctx->workerContext);
+        } else {
+            g_object_unref(socket);
+        }
+        g_clear_error(&error);
+    } else if (device->endpointURIs[ROKU_ENDPOINT_DEVICE_INFO]) {
+        // libsoup keeps the connection idle in the session once it's open, and does nothing if one already is
+        atomic_fetch_add_explicit(&ctx->prewarms, 1, memory_order_relaxed);
+        SoupMessage* msg = soup_message_new_from_uri(SOUP_METHOD_GET, device->endpointURIs[ROKU_ENDPOINT_DEVICE_INFO]);
+        soup_session_preconnect_async(device->session, msg, G_PRIORITY_LOW, NULL, NULL, NULL);
+        g_object_unref(msg);
+    }
+}
+
+/** @internal
+ * Worker thread timer callback: refresh a device's pre-warmed connection, in case the device closed it
+ * @param user_data Pointer to deviceState struct
+ * @return G_SOURCE_CONTINUE, or G_SOURCE_REMOVE once pre-warming has been turned off
+ */
+static gboolean refreshPrewarmCallback(gpointer user_data) {
+    struct deviceState* device = user_data;
+    if (atomic_load_explicit(&device->ctx->prewarmInterval, memory_order_relaxed) == 0) {
+        g_source_unref(device->prewarmTimer);
+        device->prewarmTimer = NULL;
+        return G_SOURCE_REMOVE;
+    }
+    warmDevice(device);
+    return G_SOURCE_CONTINUE;
+}
+
+/** @internal
+ * Worker thread callback: warm up a device's connection and start refreshing it periodically
+ * @param user_data Pointer to deviceState struct
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean startPrewarmCallback(gpointer user_data) {
+    struct deviceState* device = user_data;
+    unsigned interval = atomic_load_explicit(&device->ctx->prewarmInterval, memory_order_relaxed);
+    if (interval == 0) {
+        return G_SOURCE_REMOVE;
+    }
+    warmDevice(device);
+    if (!device->prewarmTimer) {
+        device->prewarmTimer = g_timeout_source_new_seconds(interval);
+        g_source_set_callback(device->prewarmTimer, refreshPrewarmCallback, device, NULL);
+        g_source_attach(device->prewarmTimer, device->ctx->workerContext);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Open a keep-alive connection to a device in the background if the context has pre-warming turned on
+ * @param ctx Context to use
+ * @param url ECP URL of the device
+ */
+static void prewarmDevice(RokuContext* ctx, const char* url) {
+    if (atomic_load_explicit(&ctx->prewarmInterval, memory_order_relaxed)) {
+        g_main_context_invoke(ctx->workerContext, startPrewarmCallback, getDeviceState(ctx, url));
+    }
+}
+
+/** @internal
+ * Size of the stack buffer streamed response bodies are read in
+ */
+#define STREAM_CHUNK_SIZE 4096
+
+/** @internal
+ * Function receiving a chunk of a streamed response body
+ * @param data Chunk of the body
+ * @param size Size of the chunk in bytes
+ * @param userData Data given with the function
+ * @return true to keep reading the body, or false to stop and drop the rest
+ */
+typedef bool (*chunkReceiver)(const char* data, size_t size, void* userData);
+
+/** @internal
+ * Destination of a streamed response body, which is handed over in chunks as it arrives instead of buffered whole
+ */
+struct bodySink {
+    chunkReceiver receive; /**< Function receiving each chunk of a 200 OK response's body */
+    void* userData; /**< Data passed to receive */
+    size_t delivered; /**< Number of bytes passed to receive so far */
+};
+
+/** @internal
+ * Read a response body from a stream into a sink, one chunk at a time
+ * @param ctx Context the request was sent with
+ * @param stream Stream of the response body
+ * @param sink Sink to hand the body to
+ * @param cancellable Cancellable of the request
+ * @param error Pointer to GError pointer, set if reading fails
+ */
+static void streamBody(RokuContext* ctx, GInputStream* stream, struct bodySink* sink, GCancellable* cancellable, GError** error) {
+    char buffer[STREAM_CHUNK_SIZE];
+    gssize length;
+    while ((length = g_input_stream_read(stream, buffer, sizeof(buffer), cancellable, error)) > 0) {
+        atomic_fetch_add_explicit(&ctx->bytesReceived, length, memory_order_relaxed);
+        sink->delivered += length;
+        if (!sink->receive(buffer, length, sink->userData)) {
+            break;
+        }
+    }
+}
+
+/** @internal
+ * Send a single GET or POST request to a device
+ * @param ctx Context to send the request with
+ * @param options Options passed to the call sending the request, or NULL
+ * @param priority Priority class of the request if options don't set one
+ * @param device State of the device
+ * @param url string containing the URL to request, or NULL if uri is given
+ * @param uri Pre-parsed URI to request, or NULL to request url
+ * @param method type of request to send (e.g. "GET" or "POST")
+ * @param sink Sink to stream the response body to, or NULL
+ * @param response Pointer to GBytes pointer, to send response data to, or NULL if it isn't needed or is streamed to sink
+ * @param span Span to time and trace the request with, filled in once the request is started, or NULL
+ * @return libsoup error code, or HTTP status code, or 0 if the status is 200 OK, or a ROKU_ERROR code
+ */
+static int sendDeviceRequestOnce(RokuContext* ctx, const RokuCallOptions* options, const RokuPriority priority, struct deviceState* device, const char* url,
+                                 GUri* uri, const char* method, struct bodySink* sink, GBytes** response, struct requestSpan* span) {
+    // Don't bother sending anything if the call is already out of time or cancelled, or the device is known to be down
+    gint64 deadline = getDeadline(options);
+    GCancellable* cancellable = options ? options->cancellable : NULL;
+    int earlyResult = checkCallState(ctx, deadline, cancellable);
+    if (!earlyResult) {
+        earlyResult = checkCircuit(ctx, device);
+    }
+    if (earlyResult) {
+        if (response) {
+            *response = NULL;
+        }
+        return earlyResult;
+    }
+
+    // Wait for the device to have a free slot, so it isn't flooded with parallel requests
+    struct requestSpan localSpan;
+    if (!span) {
+        span = &localSpan;
+    }
+    startSpan(ctx, span, device, getRequestEndpoint(device, url, uri));
+    int slotResult = acquireRequestSlot(ctx, device, getPriority(options, priority), deadline, cancellable);
+    if (!slotResult) {
+        // Then wait for its rate limit, so bursts of requests don't get throttled by the device itself
+        slotResult = waitForToken(ctx, device, deadline, cancellable);
+        if (slotResult) {
+            releaseRequestSlot(ctx, device);
+        }
+    }
+    if (slotResult) {
+        traceRequest(ctx, span, ROKU_TRACE_BODY_COMPLETE, slotResult);
+        if (response) {
+            *response = NULL;
+        }
+        return slotResult;
+    }
+
+    // Status-only POSTs can skip libsoup if the context uses the raw transport
+    if (url && useRawTransport(ctx, device, url, method, response)) {
+        int result = sendRawRequest(ctx, span, url, deadline, cancellable);
+        releaseRequestSlot(ctx, device);
+        return result;
+    }
+
+    // Send request with the device's persistent session, with the worker thread enforcing timeouts
+    SoupMessage* msg = uri ? soup_message_new_from_uri(method, uri) : soup_message_new(method, url);
+    struct requestTimer* timer = startRequestTimer(ctx, span, deadline, ctx->workerContext, msg);
+    gulong cancelHandler = linkCancellable(cancellable, timer);
+    GError* error = NULL;
+    GBytes* request = NULL;
+    if (sink) {
+        // Hand the body over as it arrives rather than holding all of it in memory first
+        GInputStream* stream = soup_session_send(device->session, msg, timer->cancellable, &error);
+        if (stream) {
+            if (soup_message_get_status(msg) == SOUP_STATUS_OK) {
+                streamBody(ctx, stream, sink, timer->cancellable, &error);
+            }
+            g_input_stream_close(stream, NULL, NULL);
+            g_object_unref(stream);
+        }
+    } else {
+        request = soup_session_send_and_read(device->session, msg, timer->cancellable, &error);
+    }
+    unlinkCancellable(cancellable, cancelHandler);
+    bool timedOut = stopRequestTimer(ctx, timer, msg);
+    releaseRequestSlot(ctx, device);
+    int result = finishRequest(ctx, span, soup_message_get_status(msg), request, error, timedOut);
+    if (response) {
+        *response = request;
+    } else if (request) {
+        g_bytes_unref(request);
+    }
+
+    // Clean up and report error, if any
+    g_object_unref(msg);
+    return result;
+}
+
+/** @internal
+ * Send a GET or POST request to a device, retrying failed GETs if the context is set up for it
+ * @param ctx Context to send the request with
+ * @param options Options passed to the call sending the request, or NULL
+ * @param priority Priority class of the request if options don't set one
+ * @param device State of the device
+ * @param url string containing the URL to request, or NULL if uri is given
+ * @param uri Pre-parsed URI to request, or NULL to request url
+ * @param method type of request to send (e.g. "GET" or "POST")
+ * @param sink Sink to stream the response body to, or NULL
+ * @param response Pointer to GBytes pointer, to send response data to, or NULL if it isn't needed or is streamed to sink
+ * @param span Span to time and trace the request with, filled in for the last attempt once it is started, or NULL
+ * @return libsoup error code, or HTTP status code, or 0 if the status is 200 OK, or a ROKU_ERROR code
+ */
+static int sendDeviceRequest(RokuContext* ctx, const RokuCallOptions* options, const RokuPriority priority, struct deviceState* device, const char* url,
+                             GUri* uri, const char* method, struct bodySink* sink, GBytes** response, struct requestSpan* span) {
+    int result = sendDeviceRequestOnce(ctx, options, priority, device, url, uri, method, sink, response, span);
+    // Only GETs are retried, since sending a command twice could do it twice
+    if (strcmp(method, SOUP_METHOD_GET) != 0) {
+        return result;
+    }
+    GCancellable* cancellable = options ? options->cancellable : NULL;
+    // A streamed body can't be taken back from its sink, so stop retrying once any of it was handed over
+    for (unsigned retry = 0; isRetryable(result) && !(sink && sink->delivered); retry++) {
+        gint64 retryTime = getRetryTime(ctx, retry, getDeadline(options));
+        if (!retryTime) {
+            break;
+        }
+        if (!sleepUntil(retryTime, cancellable)) {
+            if (response && *response) {
+                g_bytes_unref(*response);
+                *response = NULL;
+            }
+            return checkCallState(ctx, getDeadline(options), cancellable);
+        }
+        if (response && *response) {
+            g_bytes_unref(*response);
+        }
+        result = sendDeviceRequestOnce(ctx, options, priority, device, url, uri, method, sink, response, span);
+    }
+    return result;
+}
+
+/** @internal
+ * Send a GET or POST request to the given URL
+ * @param ctx Context to send the request with
+ * @param options Options passed to the call sending the request, or NULL
+ * @param priority Priority class of the request if options don't set one
+ * @param url string containing the URL to request
+ * @param method type of request to send (e.g. "GET" or "POST")
+ * @param response Pointer to GBytes pointer, to send response data to
+ * @return libsoup error code, or HTTP status code, or 0 if the status is 200 OK, or ROKU_ERROR_TIMEOUT or ROKU_ERROR_CANCELLED
+ */
+static int sendRequest(RokuContext* ctx, const RokuCallOptions* options, const RokuPriority priority, const char* url, const char* method, GBytes** response) {
+    return sendDeviceRequest(ctx, options, priority, getDeviceState(ctx, url), url, NULL, method, NULL, response, NULL);
+}
+
+/** @internal
+ * Send a GET request to one of a device's fixed query endpoints, using its pre-parsed URI
+ * @param ctx Context to send the request with
+ * @param options Options passed to the call sending the request, or NULL
+ * @param device State of the device
+ * @param deviceURL ECP URL of the device
+ * @param endpoint Endpoint to query
+ * @param sink Sink to stream the response body to, or NULL
+ * @param response Pointer to GBytes pointer, to send response data to, or NULL if it is streamed to sink
+ * @param span Span to fill in, for tracing the parsing of the response
+ * @return libsoup error code, or HTTP status code, or 0 if the status is 200 OK, or a ROKU_ERROR code
+ */
+static int sendEndpointRequest(RokuContext* ctx, const RokuCallOptions* options, struct deviceState* device, const char* deviceURL, const RokuEndpoint endpoint,
+                               struct bodySink* sink, GBytes** response, struct requestSpan* span) {
+    if (device->endpointURIs[endpoint]) {
+        return sendDeviceRequest(ctx, options, ROKU_PRIORITY_NORMAL, device, NULL, device->endpointURIs[endpoint], SOUP_METHOD_GET, sink, response, span);
+    }
+    // The device URL couldn't be parsed ahead of time, so leave it to libsoup
+    char* url = g_strconcat(deviceURL, endpointPaths[endpoint], NULL);
+    int result = sendDeviceRequest(ctx, options, ROKU_PRIORITY_NORMAL, device, url, NULL, SOUP_METHOD_GET, sink, response, span);
+    g_free(url);
+    return result;
+}
+
+/** @internal
+ * Parse an XML response using the context's reusable parser
+ * @param ctx Context owning the parser
+ * @param response Response body to parse
+ * @param name Name of the document, used in error messages
+ * @return Parsed document to be freed with xmlFreeDoc(), or NULL if parsing failed
+ */
+static xmlDocPtr parseXML(RokuContext* ctx, GBytes* response, const char* name) {
+    gsize size;
+    const char* data = g_bytes_get_data(response, &size);
+    g_mutex_lock(&ctx->parserLock);
+    xmlDocPtr doc = xmlCtxtReadMemory(ctx->parser, data, (int) size, name, "UTF-8", 0);
+    g_mutex_unlock(&ctx->parserLock);
+    return doc;
+}
+
+/** @internal
+ * A mapping from an XML element name to a string it will be copied to
+ */
+struct xmlElementToStringMap {
+    const char* elementName; /**< Name of the XML element to copy content of */
+    char* destString; /**< String to copy to */
+    size_t destSize; /**< Size of destString in bytes */
+};
+
+/** @internal
+ * Extract data from an XML node and copy results to specified strings
+ * @param parentElement XML element to traverse child elements of
+ * @param attrMode true if extracting from element attributes, false if extracting from element content
+ * @param map Specification for what elements to look for and where to copy them
+ * @param mapSize Number of mappings in the array
+ */
+static void fillFromXML(const xmlNode* parentElement, bool attrMode, struct xmlElementToStringMap map[], const size_t mapSize) {
+    // Start by making every dest string empty to avoid returning garbage data
+    for (size_t i = 0; i < mapSize; i++) {
+        *map[i].destString = '\0';
+    }
+
+    if (attrMode) {
+        // Get every attribute listed in the map and copy to corresponding string
+        xmlChar* value;
+        for (size_t i = 0; i < mapSize; i++) {
+            if (xmlNodeGetAttrValue(parentElement, (const xmlChar*) map[i].elementName, NULL, &value) == 0) {
+                strlcpy(map[i].destString, (char*) value, map[i].destSize);
+                xmlFree(value);
+            }
+        }
+    } else {
+        // Go through every child element and process those that match an element in the map
+        for (const xmlNode* node = parentElement->children; node != NULL; node = node->next) {
+            for (size_t i = 0; i < mapSize; i++) {
+                if (strcmp((char*) node->name, map[i].elementName) == 0) {
+                    xmlChar* content = xmlNodeGetContent(node);
+                    if (content) {
+                        strlcpy(map[i].destString, (char*) content, map[i].destSize);
+                        xmlFree(content);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/** @internal
+ * Get the discovery options of a context
+ * @param ctx Context to get the options of
+ * @param options Pointer to RokuDiscoveryOptions to fill in
+ */
+static void getDiscoveryOptions(RokuContext* ctx, RokuDiscoveryOptions* options) {
+    options->timeout = atomic_load_explicit(&ctx->discoveryTimeout, memory_order_relaxed);
+    options->idleTimeout = atomic_load_explicit(&ctx->discoveryIdleTimeout, memory_order_relaxed);
+    options->expectedDevices = atomic_load_explicit(&ctx->expectedDevices, memory_order_relaxed);
+}
+
+/** @internal
+ * Get the name of the discovery cache group of a device
+ * @param iface Name of the interface the device was found on, or NULL for the primary one
+ * @param usn USN of the device, or an empty string for the prefix shared by every group of the interface
+ * @return Newly allocated group name
+ */
+static gchar* getCacheGroup(const char* iface, const char* usn) {
+    // Interface names can't contain spaces, and "*" stands for the auto-selected interface
+    return g_strdup_printf("%s %s", iface ? iface : "*", usn);
+}
+
+/** @internal
+ * Add a device to a discovery cache, or update it if it is already cached
+ * @param cache Discovery cache, whose context's lock must be held
+ * @param iface Name of the interface the device was found on, or NULL for the primary one
+ * @param device Device to store, whose serial is left as it was if it is empty
+ */
+static void storeCachedDevice(GKeyFile* cache, const char* iface, const RokuCachedDevice* device) {
+    gchar* group = getCacheGroup(iface, device->usn);
+    g_key_file_set_string(cache, group, "USN", device->usn);
+    g_key_file_set_string(cache, group, "URL", device->url);
+    if (*device->serial) {
+        g_key_file_set_string(cache, group, "Serial", device->serial);
+    }
+    g_key_file_set_int64(cache, group, "LastSeen", device->lastSeen);
+    g_free(group);
+}
+
+/** @internal
+ * Read a device from a discovery cache group, if the group belongs to an interface
+ * @param cache Discovery cache, whose context's lock must be held
+ * @param group Name of the group to read
+ * @param prefix Group name prefix of the interface, from getCacheGroup()
+ * @param device Pointer to RokuCachedDevice to fill in
+ * @return true if device was filled in, or false if the group is for another interface or is missing its USN or URL
+ */
+static bool loadCachedDevice(GKeyFile* cache, const char* group, const char* prefix, RokuCachedDevice* device) {
+    if (!g_str_has_prefix(group, prefix)) {
+        return false;
+    }
+    gchar* usn = g_key_file_get_string(cache, group, "USN", NULL);
+    gchar* url = g_key_file_get_string(cache, group, "URL", NULL);
+    gchar* serial = g_key_file_get_string(cache, group, "Serial", NULL);
+    bool valid = usn && url;
+    if (valid) {
+        strlcpy(device->usn, usn, sizeof(device->usn));
+        strlcpy(device->url, url, sizeof(device->url));
+        strlcpy(device->serial, serial ? serial : "", sizeof(device->serial));
+        device->lastSeen = g_key_file_get_int64(cache, group, "LastSeen", NULL);
+    }
+    g_free(usn);
+    g_free(url);
+    g_free(serial);
+    return valid;
+}
+
+/** @internal
+ * Add a device found by an SSDP search to a context's discovery cache, if it has one
+ * @param ctx Context the search is run with
+ * @param iface Name of the interface searched on, or NULL for the primary one
+ * @param usn USN of the device
+ * @param url ECP URL of the device
+ */
+static void cacheFoundDevice(RokuContext* ctx, const char* iface, const char* usn, const char* url) {
+    g_mutex_lock(&ctx->lock);
+    if (ctx->cache) {
+        RokuCachedDevice device = {.lastSeen = g_get_real_time()};
+        strlcpy(device.url, url, sizeof(device.url));
+        strlcpy(device.usn, usn, sizeof(device.usn));
+        storeCachedDevice(ctx->cache, iface, &device);
+    }
+    g_mutex_unlock(&ctx->lock);
+}
+
+/** @internal
+ * Write a context's discovery cache to its file, if it has one. Errors are ignored, as the cache only saves time.
+ * @param ctx Context whose cache to save
+ */
+static void saveDiscoveryCache(RokuContext* ctx) {
+    g_mutex_lock(&ctx->cacheFileLock);
+    g_mutex_lock(&ctx->lock);
+    gsize length = 0;
+    gchar* data = ctx->cache ? g_key_file_to_data(ctx->cache, &length, NULL) : NULL;
+    gchar* path = g_strdup(ctx->cachePath);
+    g_mutex_unlock(&ctx->lock);
+    // The file is replaced atomically, so a process starting up never reads half of it
+    if (data) {
+        g_file_set_contents(path, data, (gssize) length, NULL);
+    }
+    g_mutex_unlock(&ctx->cacheFileLock);
+    g_free(data);
+    g_free(path);
+}
+
+/** @internal
+ * discovery finish function for blocking searches: quit the loop the search is running in
+ * @param discovery Search that ended
+ */
+static void quitDiscoveryLoop(struct discovery* discovery) {
+    g_main_loop_quit(discovery->finishData);
+}
+
+/** @internal
+ * Get the result of an SSDP search that ended, save the devices it found to the discovery cache, and warm up connections to them
+ * @param ctx Context the search was run with
+ * @param discovery Search that ended
+ * @return Number of devices found, or ROKU_ERROR_CANCELLED
+ */
+static int finishDiscovery(RokuContext* ctx, const struct discovery* discovery) {
+    atomic_fetch_add_explicit(&ctx->duplicateResponses, discovery->duplicates, memory_order_relaxed);
+    if (discovery->devicesFound) {
+        saveDiscoveryCache(ctx);
+    }
+    if (g_cancellable_is_cancelled(discovery->cancellable)) {
+        return ROKU_ERROR_CANCELLED;
+    }
+    for (size_t i = 0; i < discovery->devicesFound && discovery->deviceList; i++) {
+        prewarmDevice(ctx, discovery->deviceList[i]);
+    }
+    return (int) discovery->devicesFound;
+}
+
+/** @internal
+ * Run an SSDP search to its end in a private GMainContext
+ * @param ctx Context to search with
+ * @param options Options passed to the call, or NULL
+ * @param discovery Search to run, with its list or found function filled in
+ * @param iface Name of network interface to search on, or NULL to auto-select the primary interface
+ * @return Number of devices found, or ROKU_ERROR_CANCELLED, or a negated gssdp error code
+ */
+static int runDiscovery(RokuContext* ctx, const RokuCallOptions* options, struct discovery* discovery, const char* iface) {
+    // Run the search in a private context, so concurrent searches on other threads don't share a loop
+    GMainContext* mainContext = g_main_context_new();
+    GMainLoop* mainLoop = g_main_loop_new(mainContext, FALSE);
+    discovery->ctx = ctx;
+    discovery->mainContext = mainContext;
+    discovery->cancellable = options ? options->cancellable : NULL;
+    discovery->finish = quitDiscoveryLoop;
+    discovery->finishData = mainLoop;
+    RokuDiscoveryOptions discoveryOptions;
+    getDiscoveryOptions(ctx, &discoveryOptions);
+    g_main_context_push_thread_default(mainContext);
+    int result = startDiscovery(discovery, iface, &discoveryOptions, getDeadline(options));
+    if (result == 0) {
+        g_main_loop_run(mainLoop);
+        result = finishDiscovery(ctx, discovery);
+    }
+    g_main_context_pop_thread_default(mainContext);
+    g_main_loop_unref(mainLoop);
+    g_main_context_unref(mainContext);
+    return result;
+}
+
+int findRokuDevices_ctx(RokuContext* ctx, const RokuCallOptions* options, const char* iface, const size_t maxDevices, const size_t urlStringSize, char* deviceList[]) {
+    ctx = resolveContext(ctx);
+    struct discovery discovery = {
+        .deviceList = deviceList,
+        .maxDevices = maxDevices,
+        .deviceStrSize = urlStringSize,
+    };
+    return runDiscovery(ctx, options, &discovery, iface);
+}
+
+/** @internal
+ * Caller of streamRokuDevices_ctx() and the callback it passed
+ */
+struct deviceStream {
+    RokuContext* ctx; /**< Context the search is run with */
+    RokuDeviceFoundCallback callback; /**< Function to report devices to */
+    void* userData; /**< Data for callback */
+};
+
+/** @internal
+ * discovery found function for streamRokuDevices_ctx(): warm up a connection to the device and report it
+ * @param discovery Search that found the device, whose foundData is a deviceStream struct
+ * @param url ECP URL of the device
+ * @param usn USN of the device
+ * @return Return value of the caller's callback
+ */
+static bool streamFoundDevice(struct discovery* discovery, const char* url, const char* usn) {
+    struct deviceStream* stream = discovery->foundData;
+    prewarmDevice(stream->ctx, url);
+    return stream->callback(url, usn, stream->userData);
+}
+
+int streamRokuDevices_ctx(RokuContext* ctx, const RokuCallOptions* options, const char* iface, const size_t maxDevices, const RokuDeviceFoundCallback callback,
+                          void* userData) {
+    ctx = resolveContext(ctx);
+    struct deviceStream stream = {ctx, callback, userData};
+    struct discovery discovery = {
+        .maxDevices = maxDevices,
+        .found = streamFoundDevice,
+        .foundData = &stream,
+    };
+    return runDiscovery(ctx, options, &discovery, iface);
+}
+
+/** @internal
+ * Background SSDP browser keeping a table of the devices on the network, running on the worker thread
+ */
+struct registry {
+    RokuContext* ctx; /**< Context running the registry */
+    GSSDPClient* client; /**< SSDP client on the chosen interface */
+    GSSDPResourceBrowser* browser; /**< Browser following roku:ecp resources */
+    GSource* rescanSource; /**< Source searching again every rescan interval, or NULL */
+    GHashTable* devices; /**< RokuRegisteredDevice structs keyed by USN, protected by the context's lock */
+    RokuRegistryCallback callback; /**< Function called when devices change, or NULL */
+    void* userData; /**< Data for callback */
+    bool stopped; /**< Set once the registry is stopped, so later events are ignored, protected by the context's lock */
+};
+
+/** @internal
+ * Free a device registry, along with its SSDP objects
+ * @param data Pointer to registry struct
+ */
+static void freeRegistry(gpointer data) {
+    struct registry* registry = data;
+    if (registry->rescanSource) {
+        g_source_destroy(registry->rescanSource);
+        g_source_unref(registry->rescanSource);
+    }
+    if (registry->browser) {
+        g_object_unref(registry->browser);
+    }
+    if (registry->client) {
+        g_object_unref(registry->client);
+    }
+    g_hash_table_destroy(registry->devices);
+    g_free(registry);
+}
+
+/** @internal
+ * SSDP resource-available callback for device registries: add the device, or refresh it if it is already known
+ * @param self SSDP resource browser of the registry
+ * @param usn USN of the device
+ * @param locations List of strings with URLs to the device
+ * @param user_data Pointer to registry struct
+ */
+static void registryAvailableCallback(GSSDPResourceBrowser* self, const char* usn, const GList* locations, gpointer user_data) {
+    struct registry* registry = user_data;
+    g_mutex_lock(&registry->ctx->lock);
+    if (registry->stopped) {
+        g_mutex_unlock(&registry->ctx->lock);
+        return;
+    }
+    RokuRegistryChange change = ROKU_REGISTRY_UPDATED;
+    RokuRegisteredDevice* device = g_hash_table_lookup(registry->devices, usn);
+    if (!device) {
+        change = ROKU_REGISTRY_ADDED;
+        device = g_new0(RokuRegisteredDevice, 1);
+        strlcpy(device->usn, usn, sizeof(device->usn));
+        g_hash_table_insert(registry->devices, g_strdup(usn), device);
+    }
+    strlcpy(device->url, locations->data, sizeof(device->url));
+    device->lastSeen = g_get_monotonic_time();
+    // The callback gets a copy, so it can run without the lock while the table changes
+    RokuRegisteredDevice changed = *device;
+    g_mutex_unlock(&registry->ctx->lock);
+
+    prewarmDevice(registry->ctx, changed.url);
+    if (registry->callback) {
+        registry->callback(change, &changed, registry->userData);
+    }
+}
+
+/** @internal
+ * SSDP resource-unavailable callback for device registries: remove the device
+ * @param self SSDP resource browser of the registry
+ * @param usn USN of the device
+ * @param user_data Pointer to registry struct
+ */
+static void registryUnavailableCallback(GSSDPResourceBrowser* self, const char* usn, gpointer user_data) {
+    struct registry* registry = user_data;
+    g_mutex_lock(&registry->ctx->lock);
+    RokuRegisteredDevice* device = registry->stopped ? NULL : g_hash_table_lookup(registry->devices, usn);
+    if (!device) {
+        g_mutex_unlock(&registry->ctx->lock);
+        return;
+    }
+    RokuRegisteredDevice removed = *device;
+    g_hash_table_remove(registry->devices, usn);
+    g_mutex_unlock(&registry->ctx->lock);
+
+    if (registry->callback) {
+        registry->callback(ROKU_REGISTRY_REMOVED, &removed, registry->userData);
+    }
+}
+
+/** @internal
+ * Worker thread timer callback: search for devices again, catching any whose announcements were missed
+ * @param user_data Pointer to registry struct
+ * @return G_SOURCE_CONTINUE
+ */
+static gboolean rescanRegistryCallback(gpointer user_data) {
+    struct registry* registry = user_data;
+    gssdp_resource_browser_rescan(registry->browser);
+    return G_SOURCE_CONTINUE;
+}
+
+/** @internal
+ * Request to start a device registry on the worker thread, which the starting thread waits on
+ */
+struct registryStart {
+    struct registry* registry; /**< Registry to start */
+    const char* iface; /**< Name of network interface to search on, or NULL */
+    unsigned rescanInterval; /**< Seconds between searches, or 0 */
+    int result; /**< 0 if the registry started, or a negated gssdp error code */
+    bool done; /**< Set once the worker thread has tried to start the registry, protected by the context's lock */
+    GCond cond; /**< Signalled once done is set */
+};
+
+/** @internal
+ * Worker thread callback: start a device registry, since gssdp watches its sockets in the thread that creates the client
+ * @param user_data Pointer to registryStart struct
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean startRegistryCallback(gpointer user_data) {
+    struct registryStart* start = user_data;
+    struct registry* registry = start->registry;
+    GError* error = NULL;
+    int result = 0;
+    registry->client = gssdp_client_new_full(start->iface, NULL, 0, GSSDP_UDA_VERSION_1_0, &error);
+    if (error) {
+        result = -error->code;
+        g_error_free(error);
+        g_clear_object(&registry->client);
+    } else {
+        registry->browser = gssdp_resource_browser_new(registry->client, "roku:ecp");
+        g_signal_connect(registry->browser, "resource-available", G_CALLBACK(registryAvailableCallback), registry);
+        g_signal_connect(registry->browser, "resource-unavailable", G_CALLBACK(registryUnavailableCallback), registry);
+        gssdp_resource_browser_set_active(registry->browser, TRUE);
+        if (start->rescanInterval) {
+            registry->rescanSource = g_timeout_source_new_seconds(start->rescanInterval);
+            g_source_set_callback(registry->rescanSource, rescanRegistryCallback, registry, NULL);
+            g_source_attach(registry->rescanSource, registry->ctx->workerContext);
+        }
+    }
+
+    g_mutex_lock(&registry->ctx->lock);
+    start->result = result;
+    start->done = true;
+    g_cond_signal(&start->cond);
+    g_mutex_unlock(&registry->ctx->lock);
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Worker thread idle callback: nothing to do, as the registry is freed when the source is
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean stopRegistryCallback(gpointer user_data) {
+    return G_SOURCE_REMOVE;
+}
+
+int startRokuDeviceRegistry(RokuContext* ctx, const char* iface, const unsigned rescanInterval, const RokuRegistryCallback callback, void* userData) {
+    ctx = resolveContext(ctx);
+    struct registry* registry = g_new0(struct registry, 1);
+    registry->ctx = ctx;
+    registry->devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    registry->callback = callback;
+    registry->userData = userData;
+    g_mutex_lock(&ctx->lock);
+    if (ctx->registry) {
+        g_mutex_unlock(&ctx->lock);
+        freeRegistry(registry);
+        return -1;
+    }
+    ctx->registry = registry;
+    g_mutex_unlock(&ctx->lock);
+
+    // Wait for the worker thread to start it, which happens right away if this is the worker thread
+    struct registryStart start = {registry, iface, rescanInterval, 0, false};
+    g_cond_init(&start.cond);
+    g_main_context_invoke(ctx->workerContext, startRegistryCallback, &start);
+    g_mutex_lock(&ctx->lock);
+    while (!start.done) {
+        g_cond_wait(&start.cond, &ctx->lock);
+    }
+    if (start.result) {
+        ctx->registry = NULL;
+    }
+    g_mutex_unlock(&ctx->lock);
+    g_cond_clear(&start.cond);
+    if (start.result) {
+        freeRegistry(registry);
+    }
+    return start.result;
+}
+
+void stopRokuDeviceRegistry(RokuContext* ctx) {
+    ctx = resolveContext(ctx);
+    g_mutex_lock(&ctx->lock);
+    struct registry* registry = ctx->registry;
+    ctx->registry = NULL;
+    if (registry) {
+        registry->stopped = true;
+    }
+    g_mutex_unlock(&ctx->lock);
+
+    // The browser may be in the middle of calling back, so it is freed from an idle source on the worker thread (or when
+    // the worker's context goes away, if the context is destroyed first)
+    if (registry) {
+        GSource* source = g_idle_source_new();
+        g_source_set_callback(source, stopRegistryCallback, registry, freeRegistry);
+        g_source_attach(source, ctx->workerContext);
+        g_source_unref(source);
+    }
+}
+
+int getRokuRegisteredDevices(RokuContext* ctx, const size_t maxDevices, RokuRegisteredDevice devices[]) {
+    ctx = resolveContext(ctx);
+    g_mutex_lock(&ctx->lock);
+    if (!ctx->registry) {
+        g_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    size_t devicesFound = 0;
+    GHashTableIter iter;
+    gpointer device;
+    g_hash_table_iter_init(&iter, ctx->registry->devices);
+    while (devicesFound < maxDevices && g_hash_table_iter_next(&iter, NULL, &device)) {
+        devices[devicesFound++] = *(RokuRegisteredDevice*) device;
+    }
+    g_mutex_unlock(&ctx->lock);
+    return (int) devicesFound;
+}
+
+/** @internal
+ * Background refresh of a context's discovery cache for one interface, running on the worker thread
+ */
+struct cacheRefresh {
+    RokuContext* ctx; /**< Context whose cache is refreshed */
+    char* iface; /**< Name of the interface refreshed, or NULL for the primary one */
+    struct discovery discovery; /**< Search for devices that aren't cached yet or have moved */
+    GHashTable* stale; /**< Set of the USNs of the devices cached when the refresh started */
+    GHashTable* alive; /**< RokuCachedDevice structs of the devices that answered a probe or the search, keyed by USN */
+    unsigned pending; /**< Number of probes and searches still running, plus one while the refresh is starting */
+    bool searched; /**< Set if the search ran, so devices it didn't find and that didn't answer a probe can be dropped */
+};
+
+/** @internal
+ * device-info probe of a cached device, sent by a cache refresh
+ */
+struct cacheProbe {
+    struct cacheRefresh* refresh; /**< Refresh that sent the probe */
+    RokuCachedDevice device; /**< Cached device being probed */
+};
+
+/** @internal
+ * Get the entry of a device that a cache refresh has confirmed, adding it if it hasn't been confirmed yet
+ * @param refresh Cache refresh
+ * @param usn USN of the device
+ * @return Entry of the device
+ */
+static RokuCachedDevice* getAliveDevice(struct cacheRefresh* refresh, const char* usn) {
+    RokuCachedDevice* device = g_hash_table_lookup(refresh->alive, usn);
+    if (!device) {
+        device = g_new0(RokuCachedDevice, 1);
+        strlcpy(device->usn, usn, sizeof(device->usn));
+        g_hash_table_insert(refresh->alive, g_strdup(usn), device);
+    }
+    device->lastSeen = g_get_real_time();
+    return device;
+}
+
+/** @internal
+ * Count a probe or search of a cache refresh as finished. Once all of them have, store the devices that were confirmed,
+ * drop the ones that weren't, and save the cache.
+ * @param refresh Cache refresh, which is freed once it is over
+ */
+static void finishCacheRefresh(struct cacheRefresh* refresh) {
+    if (--refresh->pending) {
+        return;
+    }
+    RokuContext* ctx = refresh->ctx;
+    g_mutex_lock(&ctx->lock);
+    if (ctx->cache) {
+        GHashTableIter iter;
+        gpointer usn;
+        gpointer device;
+        g_hash_table_iter_init(&iter, refresh->alive);
+        while (g_hash_table_iter_next(&iter, NULL, &device)) {
+            storeCachedDevice(ctx->cache, refresh->iface, device);
+        }
+        // Without a search, a network outage would look like every device going away, so nothing is dropped
+        g_hash_table_iter_init(&iter, refresh->stale);
+        while (refresh->searched && g_hash_table_iter_next(&iter, &usn, NULL)) {
+            if (!g_hash_table_contains(refresh->alive, usn)) {
+                gchar* group = getCacheGroup(refresh->iface, usn);
+                g_key_file_remove_group(ctx->cache, group, NULL);
+                g_free(group);
+            }
+        }
+    }
+    ctx->cacheRefreshing = false;
+    g_mutex_unlock(&ctx->lock);
+    saveDiscoveryCache(ctx);
+
+    g_hash_table_destroy(refresh->stale);
+    g_hash_table_destroy(refresh->alive);
+    g_free(refresh->iface);
+    g_free(refresh);
+}
+
+/** @internal
+ * getRokuDevice_async() callback for cache refresh probes: confirm the device and its serial if it answered
+ * @param source Unused
+ * @param result Result of the probe
+ * @param user_data Pointer to cacheProbe struct, which is freed
+ */
+static void cacheProbeCallback(GObject* source, GAsyncResult* result, gpointer user_data) {
+    struct cacheProbe* probe = user_data;
+    struct cacheRefresh* refresh = probe->refresh;
+    RokuDevice device;
+    if (getRokuDevice_finish(result, &device) == 0) {
+        // The search's URL takes precedence, since the device may have answered it from a new address
+        RokuCachedDevice* alive = getAliveDevice(refresh, probe->device.usn);
+        if (!*alive->url) {
+            strlcpy(alive->url, probe->device.url, sizeof(alive->url));
+        }
+        strlcpy(alive->serial, device.serial, sizeof(alive->serial));
+    }
+    g_free(probe);
+    finishCacheRefresh(refresh);
+}
+
+/** @internal
+ * discovery found function for cache refreshes: confirm the device at the URL it answered from
+ * @param discovery Search that found the device, whose foundData is a cacheRefresh struct
+ * @param url ECP URL of the device
+ * @param usn USN of the device
+ * @return true, to keep searching
+ */
+static bool refreshFoundDevice(struct discovery* discovery, const char* url, const char* usn) {
+    struct cacheRefresh* refresh = discovery->foundData;
+    RokuCachedDevice* alive = getAliveDevice(refresh, usn);
+    strlcpy(alive->url, url, sizeof(alive->url));
+    prewarmDevice(refresh->ctx, url);
+    return true;
+}
+
+/** @internal
+ * discovery finish function for cache refreshes: count the search as finished
+ * @param discovery Search that ended, whose finishData is a cacheRefresh struct
+ */
+static void finishRefreshSearch(struct discovery* discovery) {
+    struct cacheRefresh* refresh = discovery->finishData;
+    atomic_fetch_add_explicit(&refresh->ctx->duplicateResponses, discovery->duplicates, memory_order_relaxed);
+    refresh->searched = true;
+    finishCacheRefresh(refresh);
+}
+
+/** @internal
+ * Worker thread callback: start a cache refresh, probing every cached device of its interface while searching for new ones
+ * @param user_data Pointer to cacheRefresh struct
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean startCacheRefreshCallback(gpointer user_data) {
+    struct cacheRefresh* refresh = user_data;
+    RokuContext* ctx = refresh->ctx;
+    GPtrArray* probes = g_ptr_array_new();
+    gchar* prefix = getCacheGroup(refresh->iface, "");
+    g_mutex_lock(&ctx->lock);
+    gchar** groups = ctx->cache ? g_key_file_get_groups(ctx->cache, NULL) : NULL;
+    for (gchar** group = groups; group && *group; group++) {
+        struct cacheProbe* probe = g_new(struct cacheProbe, 1);
+        probe->refresh = refresh;
+        if (loadCachedDevice(ctx->cache, *group, prefix, &probe->device)) {
+            g_hash_table_add(refresh->stale, g_strdup(probe->device.usn));
+            g_ptr_array_add(probes, probe);
+        } else {
+            g_free(probe);
+        }
+    }
+    g_mutex_unlock(&ctx->lock);
+    g_strfreev(groups);
+    g_free(prefix);
+
+    // Every cached device is probed at once, giving up when the search does so a refresh takes no longer than a search
+    RokuDiscoveryOptions discoveryOptions;
+    getDiscoveryOptions(ctx, &discoveryOptions);
+    guint window = discoveryOptions.timeout ? discoveryOptions.timeout : DEFAULT_DISCOVERY_TIMEOUT;
+    RokuCallOptions probeOptions = {.deadline = g_get_monotonic_time() + window * (gint64) 1000, .priority = ROKU_PRIORITY_BACKGROUND};
+    for (guint i = 0; i < probes->len; i++) {
+        struct cacheProbe* probe = probes->pdata[i];
+        refresh->pending++;
+        getRokuDevice_async(ctx, &probeOptions, probe->device.url, ctx->workerContext, NULL, cacheProbeCallback, probe);
+    }
+    g_ptr_array_free(probes, TRUE);
+
+    // Search at the same time, for devices that aren't cached yet or have moved
+    refresh->discovery.ctx = ctx;
+    refresh->discovery.mainContext = ctx->workerContext;
+    refresh->discovery.maxDevices = G_MAXSIZE;
+    refresh->discovery.found = refreshFoundDevice;
+    refresh->discovery.foundData = refresh;
+    refresh->discovery.finish = finishRefreshSearch;
+    refresh->discovery.finishData = refresh;
+    if (startDiscovery(&refresh->discovery, refresh->iface, &discoveryOptions, 0) == 0) {
+        refresh->pending++;
+    }
+    finishCacheRefresh(refresh);
+    return G_SOURCE_REMOVE;
+}
+
+int getCachedRokuDevices(RokuContext* ctx, const char* iface, const size_t maxDevices, RokuCachedDevice devices[]) {
+    ctx = resolveContext(ctx);
+    gchar* prefix = getCacheGroup(iface, "");
+    g_mutex_lock(&ctx->lock);
+    if (!ctx->cache) {
+        g_mutex_unlock(&ctx->lock);
+        g_free(prefix);
+        return -1;
+    }
+    size_t devicesFound = 0;
+    gchar** groups = g_key_file_get_groups(ctx->cache, NULL);
+    for (gchar** group = groups; *group && devicesFound < maxDevices; group++) {
+        if (loadCachedDevice(ctx->cache, *group, prefix, &devices[devicesFound])) {
+            devicesFound++;
+        }
+    }
+    bool refresh = !ctx->cacheRefreshing;
+    ctx->cacheRefreshing = true;
+    g_mutex_unlock(&ctx->lock);
+    g_strfreev(groups);
+    g_free(prefix);
+
+    for (size_t i = 0; i < devicesFound; i++) {
+        prewarmDevice(ctx, devices[i].url);
+    }
+    // The refresh's probes and search run on the worker thread, so the caller can use the cached devices right away
+    if (refresh) {
+        struct cacheRefresh* cacheRefresh = g_new0(struct cacheRefresh, 1);
+        cacheRefresh->ctx = ctx;
+        cacheRefresh->iface = g_strdup(iface);
+        cacheRefresh->stale = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        cacheRefresh->alive = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        cacheRefresh->pending = 1;
+        g_main_context_invoke(ctx->workerContext, startCacheRefreshCallback, cacheRefresh);
+    }
+    return (int) devicesFound;
+}
+
+/** @internal
+ * Function that turns the outcome of a request into the return value of the ECP call that sent it
+ * @param ctx Context the request was sent with
+ * @param httpError Result of the request, as returned by sendRequest()
+ * @param response Response body (or NULL), which will be freed
+ * @param output Pointer to where the results of the call should be stored
+ * @param maxItems Maximum number of items output can hold, for calls returning a list
+ * @return Return value of the ECP call
+ */
+typedef int (*requestCompleter)(RokuContext* ctx, int httpError, GBytes* response, void* output, int maxItems);
+
+/** @internal
+ * requestCompleter for device-info requests, filling in a RokuDevice
+ */
+static int completeDeviceInfo(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxItems) {
+    RokuDevice* device = output;
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        g_bytes_unref(response);
+        return -3;
+    }
+    if (httpError) {
+        g_bytes_unref(response);
+        return httpError;
+    }
+
+    // Parse XML response and get device-info element
+    xmlDocPtr doc = parseXML(ctx, response, "device-info.xml");
+    g_bytes_unref(response);
+    if (!doc) {
+        return -2;
+    }
+    xmlNodePtr deviceInfoElement = xmlDocGetRootElement(doc);
+    if (!deviceInfoElement) {
+        xmlFreeDoc(doc);
+        return -3;
+    }
+
+    // Fill in device fields based on device-info response
+    char tmpPowerMode[8];
+    char tmpIsTV[5];
+    char tmpEcpMode[8];
+    char tmpDeveloperMode[5];
+    char tmpSearchEnabled[5];
+    char tmpHasPrivateListening[5];
+    char tmpHeadphonesConnected[5];
+    struct xmlElementToStringMap map[14] = {
+        {"user-device-name", device->name, sizeof(device->name) / sizeof(char)},
+        {"user-device-location", device->location, sizeof(device->location) / sizeof(char)},
+        {"friendly-model-name", device->model, sizeof(device->model) / sizeof(char)},
+        {"serial-number", device->serial, sizeof(device->serial) / sizeof(char)},
+        {"ui-resolution", device->resolution, sizeof(device->resolution) / sizeof(char)},
+        {"wifi-mac", device->macAddress, sizeof(device->macAddress) / sizeof(char)},
+        {"software-version", device->softwareVersion, sizeof(device->softwareVersion) / sizeof(char)},
+        {"power-mode", tmpPowerMode, 8},
+        {"is-tv", tmpIsTV, 5},
+        {"ecp-setting-mode", tmpEcpMode, 8},
+        {"developer-enabled", tmpDeveloperMode, 5},
+        {"search-enabled", tmpSearchEnabled, 5},
+        {"supports-private-listening", tmpHasPrivateListening, 5},
+        {"headphones-connected", tmpHeadphonesConnected, 5},
+    };
+    fillFromXML(deviceInfoElement, false, map, sizeof(map) / sizeof(*map));
+    device->isOn = strcmp("PowerOn", tmpPowerMode) == 0;
+    device->isTV = strcmp("true", tmpIsTV) == 0;
+    device->isLimited = strcmp("limited", tmpIsTV) == 0;
+    device->developerMode = strcmp("true", tmpDeveloperMode) == 0;
+    device->hasSearchSupport = strcmp("true", tmpSearchEnabled) == 0;
+    device->hasHeadphoneSupport = strcmp("true", tmpHasPrivateListening) == 0;
+    device->headphonesConnected = strcmp("true", tmpHeadphonesConnected) == 0;
+
+    // Clean up and return, warming up a connection for the commands likely to follow
+    xmlFreeDoc(doc);
+    prewarmDevice(ctx, device->url);
+    return 0;
+}
+
+/** @internal
+ * A query in flight that other callers asking for the same thing can wait for instead of sending their own
+ */
+struct flight {
+    gint refs; /**< Number of callers using the flight, protected by the context's lock */
+    GCond cond; /**< Broadcast when the query is done, or when a waiting caller is cancelled */
+    GMutex* lock; /**< Lock of the context the flight belongs to */
+    bool done; /**< Set once result and output are filled in */
+    int result; /**< Return value of the query */
+    void* output; /**< Copy of the query's output */
+};
+
+/** @internal
+ * Release a caller's reference to a flight, freeing it once unused. Must be called with the context's lock held.
+ * @param flight Pointer to flight struct
+ */
+static void unrefFlight(struct flight* flight) {
+    if (--flight->refs == 0) {
+        g_cond_clear(&flight->cond);
+        g_free(flight->output);
+        g_free(flight);
+    }
+}
+
+/** @internal
+ * GCancellable callback waking up the callers waiting for a flight, so a cancelled one can stop waiting
+ * @param cancellable GCancellable of the call
+ * @param user_data Pointer to flight struct
+ */
+static void wakeFlightCallback(GCancellable* cancellable, gpointer user_data) {
+    struct flight* flight = user_data;
+    g_mutex_lock(flight->lock);
+    g_cond_broadcast(&flight->cond);
+    g_mutex_unlock(flight->lock);
+}
+
+/** @internal
+ * Send a query and complete it into a single output struct, sharing the request with any concurrent callers making the
+ * same query. One caller sends the request and parses the response, and the others each get a copy of its output.
+ * @param ctx Context to send the query with
+ * @param options Options passed to the call, or NULL
+ * @param deviceURL ECP URL of the device
+ * @param endpoint Endpoint to query
+ * @param complete Function turning the response into the return value of the call
+ * @param output Pointer to the struct to fill in
+ * @param outputSize Size of the output struct
+ * @return Return value of complete
+ */
+static int sendSharedQuery(RokuContext* ctx, const RokuCallOptions* options, const char* deviceURL, const RokuEndpoint endpoint, requestCompleter complete,
+                           void* output, const size_t outputSize) {
+    gint64 deadline = getDeadline(options);
+    GCancellable* cancellable = options ? options->cancellable : NULL;
+
+    // Queries are identified by the address of their endpoint's URI in the device's state
+    struct deviceState* device = getDeviceState(ctx, deviceURL);
+    gpointer key = &device->endpointURIs[endpoint];
+    while (true) {
+        g_mutex_lock(&ctx->lock);
+        struct flight* flight = g_hash_table_lookup(ctx->flights, key);
+        if (!flight) {
+            // Nobody is making this query, so make it and share the result
+            flight = g_new0(struct flight, 1);
+            flight->refs = 1;
+            flight->lock = &ctx->lock;
+            g_cond_init(&flight->cond);
+            g_hash_table_insert(ctx->flights, key, flight);
+            g_mutex_unlock(&ctx->lock);
+
+            GBytes* response;
+            struct requestSpan span;
+            int httpError = sendEndpointRequest(ctx, options, device, deviceURL, endpoint, NULL, &response, &span);
+            int result = complete(ctx, httpError, response, output, 1);
+            traceParsed(ctx, &span, httpError, result);
+
+            g_mutex_lock(&ctx->lock);
+            flight->result = result;
+            flight->output = g_memdup2(output, outputSize);
+            flight->done = true;
+            g_hash_table_remove(ctx->flights, key);
+            g_cond_broadcast(&flight->cond);
+            unrefFlight(flight);
+            g_mutex_unlock(&ctx->lock);
+            return result;
+        }
+
+        // Wait for the caller making the query, giving up if this call is cancelled or runs out of time
+        flight->refs++;
+        g_mutex_unlock(&ctx->lock);
+        gulong cancelHandler = cancellable ? g_cancellable_connect(cancellable, G_CALLBACK(wakeFlightCallback), flight, NULL) : 0;
+        g_mutex_lock(&ctx->lock);
+        bool timedOut = false;
+        while (!flight->done && !timedOut && !g_cancellable_is_cancelled(cancellable)) {
+            if (deadline > 0) {
+                timedOut = !g_cond_wait_until(&flight->cond, &ctx->lock, deadline);
+            } else {
+                g_cond_wait(&flight->cond, &ctx->lock);
+            }
+        }
+        bool done = flight->done;
+        int result = flight->result;
+        // If the other caller was cancelled or ran out of time, that doesn't apply to this call, so its output isn't used
+        bool shared = done && !isRokuError(result);
+        if (shared) {
+            memcpy(output, flight->output, outputSize);
+        }
+        g_mutex_unlock(&ctx->lock);
+        if (cancelHandler) {
+            g_cancellable_disconnect(cancellable, cancelHandler);
+        }
+        g_mutex_lock(&ctx->lock);
+        unrefFlight(flight);
+        g_mutex_unlock(&ctx->lock);
+
+        if (!done) {
+            return checkCallState(ctx, deadline, cancellable);
+        }
+        // Otherwise this call tries again, maybe making the query itself
+        if (shared) {
+            atomic_fetch_add_explicit(&ctx->coalescedRequests, 1, memory_order_relaxed);
+            return result;
+        }
+    }
+}
+
+int getRokuDevice_ctx(RokuContext* ctx, const RokuCallOptions* options, const char* url, RokuDevice* device) {
+    ctx = resolveContext(ctx);
+    // Fill in the device URL
+    strlcpy(device->url, url, sizeof(device->url));
+
+    // Request device-info from device and fill in the device from the response
+    int result = sendSharedQuery(ctx, options, url, ROKU_ENDPOINT_DEVICE_INFO, completeDeviceInfo, device, sizeof(RokuDevice));
+    // A shared response comes with the URL of the caller that made the query, which may be spelled differently
+    strlcpy(device->url, url, sizeof(device->url));
+    return result;
+}
+
+/** @internal
+ * Check whether a key can be sent to a device
+ * @param device Pointer to RokuDevice the key would be sent to
+ * @param key The key code to check
+ * @return 0 if the key can be sent, -1 if the key isn't valid for that device type, or -2 if the device is in Limited mode
+ */
+static int checkKey(const RokuDevice* device, const char* key) {
+    // Disallow sending keys meant for TVs to non-TV devices
+    if (!device->isTV) {
+        for (int i = 0; i < 12; i++) {
+            const char* tvOnlyKeys[12] = {"VolumeUp", "VolumeDown", "VolumeMute", "PowerOff", "ChannelUp", "ChannelDown",
+                                          "InputTuner", "InputHDMI1", "InputHDMI2", "InputHDMI3", "InputHDMI4", "InputAV1"};
+            if (strcmp(key, tvOnlyKeys[i]) == 0) {
+                return -1;
+            }
+        }
+    }
+    if (device->isLimited) {
+        return -2;
+    }
+    return 0;
+}
+
+/** @internal
+ * requestCompleter for keypress requests
+ */
+static int completeKeypress(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxItems) {
+    g_bytes_unref(response);
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        return -3;
+    }
+    return httpError;
+}
+
+int rokuSendKey_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* key) {
+    ctx = resolveContext(ctx);
+    int keyError = checkKey(device, key);
+    if (keyError) {
+        return keyError;
+    }
+    // The URL normally fits on the stack (the raw transport only takes URLs this short anyway), so with the raw transport
+    // a successful keypress to a known device doesn't allocate
+    char urlBuffer[RAW_BUFFER_SIZE / 2];
+    int urlLength = g_snprintf(urlBuffer, sizeof(urlBuffer), "%s/keypress/%s", device->url, key);
+    char* url = urlLength < (int) sizeof(urlBuffer) ? urlBuffer : g_strconcat(device->url, "/keypress/", key, NULL);
+
+    // Return result of keypress request
+    int result = sendRequest(ctx, options, ROKU_PRIORITY_INTERACTIVE, url, SOUP_METHOD_POST, NULL);
+    if (url != urlBuffer) {
+        g_free(url);
+    }
+    return completeKeypress(ctx, result, NULL, NULL, 0);
+}
+
+/** @internal
+ * Send keypresses with HTTP/1.1 pipelining: up to the context's pipeline depth of requests are written back-to-back on
+ * one raw transport connection, then their responses are read in order.
+ * @param ctx Context to send the keypresses with
+ * @param options Options passed to the call, or NULL
+ * @param device State of the device, which must have an address
+ * @param urls Array of keypress URLs to send
+ * @param depth Maximum number of requests in flight on the connection at once
+ * @param errorCode Pointer to int, set to the result of the last keypress as returned by completeKeypress()
+ * @return Index of the first keypress the device didn't answer because it closed the connection, or whose URL is too long
+ *         to pipeline, which should be sent without pipelining, or the number of URLs if there are none left to send
+ */
+static guint sendPipelinedKeypresses(RokuContext* ctx, const RokuCallOptions* options, struct deviceState* device, GPtrArray* urls, const unsigned depth,
+                                     int* errorCode) {
+    // Each batch's keypresses are timed from when the batch was started, so the first one includes waiting for a slot
+    struct requestSpan span = {device, ROKU_ENDPOINT_KEYPRESS, 0, g_get_monotonic_time()};
+    gint64 deadline = getDeadline(options);
+    GCancellable* cancellable = options ? options->cancellable : NULL;
+    *errorCode = checkCircuit(ctx, device);
+    if (*errorCode) {
+        return urls->len;
+    }
+    *errorCode = acquireRequestSlot(ctx, device, getPriority(options, ROKU_PRIORITY_INTERACTIVE), deadline, cancellable);
+    if (*errorCode) {
+        return urls->len;
+    }
+    GError* error = NULL;
+    GSocket* socket = takeRawSocket(ctx, device);
+    bool cold = socket == NULL;
+    if (!socket) {
+        socket = connectRawSocket(ctx, device, deadline, cancellable, &error);
+    }
+
+    guint answered = 0;
+    bool reusable = socket != NULL;
+    struct rawReader reader;
+    reader.used = 0;
+    while (reusable && answered < urls->len) {
+        // Build the next batch in one buffer so the requests go out in as few packets as possible
+        char batch[RAW_BUFFER_SIZE * 4];
+        size_t batchLength = 0;
+        guint batchEnd = answered;
+        while (batchEnd < urls->len && batchEnd - answered < depth) {
+            // URLs too long for the raw transport are left to be sent one at a time, like useRawTransport() would
+            const char* url = g_ptr_array_index(urls, batchEnd);
+            if (strlen(url) >= RAW_BUFFER_SIZE / 2) {
+                break;
+            }
+            const char* path = url + device->baseLength;
+            size_t space = sizeof(batch) - batchLength;
+            int length = g_snprintf(batch + batchLength, space, "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Length: 0\r\n\r\n", path, device->hostHeader);
+            if ((size_t) length >= space) {
+                break;
+            }
+            *errorCode = waitForToken(ctx, device, deadline, cancellable);
+            if (*errorCode) {
+                break;
+            }
+            batchLength += length;
+            batchEnd++;
+        }
+        if (*errorCode) {
+            answered = urls->len;
+            break;
+        }
+        // A keypress that can't be pipelined ends pipelining, as an empty batch would never make progress
+        if (batchEnd == answered) {
+            break;
+        }
+
+        // Read the batch's responses in order, stopping if ECP turns out to be disabled
+        gint64 expiry = getExpiry(atomic_load_explicit(&ctx->readTimeout, memory_order_relaxed), deadline);
+        if (!writeRawRequest(socket, batch, batchLength, expiry, cancellable, &error)) {
+            reusable = false;
+            break;
+        }
+        while (answered < batchEnd) {
+            // Keypresses are traced as they're read, so those the device never answers aren't traced until they're sent again
+            span.id = getRequestId(ctx);
+            traceRequest(ctx, &span, ROKU_TRACE_START, 0);
+            traceRequest(ctx, &span, ROKU_TRACE_CONNECT, 0);
+            unsigned status = readRawResponse(socket, &reader, expiry, cancellable, &reusable, &error);
+            if (!status) {
+                reusable = false;
+                break;
+            }
+            traceRequest(ctx, &span, ROKU_TRACE_FIRST_BYTE, 0);
+            answered++;
+            countConnectionUse(ctx, cold);
+            cold = false;
+            *errorCode = completeKeypress(ctx, finishRequest(ctx, &span, status, NULL, NULL, false), NULL, NULL, 0);
+            span.id = 0;
+            if (*errorCode == -3) {
+                answered = urls->len;
+                break;
+            }
+            // If the device is closing the connection, the rest of the batch won't be answered
+            if (!reusable) {
+                break;
+            }
+        }
+        span.start = g_get_monotonic_time();
+    }
+
+    // Keep the connection if it's still in a clean state
+    if (socket && reusable && reader.used == 0) {
+        putRawSocket(ctx, device, socket);
+    } else if (socket) {
+        g_object_unref(socket);
+    }
+    releaseRequestSlot(ctx, device);
+
+    // Anything other than the device closing the connection ends the sequence
+    if (error) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED) || g_error_matches(error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE)) {
+            // The keypress being read is sent again without pipelining, so its traced attempt ends here
+            traceRequest(ctx, &span, ROKU_TRACE_BODY_COMPLETE, error->code);
+            g_error_free(error);
+        } else {
+            if (!span.id) {
+                span.id = getRequestId(ctx);
+                traceRequest(ctx, &span, ROKU_TRACE_START, 0);
+            }
+            *errorCode = completeKeypress(ctx, finishRequest(ctx, &span, 0, NULL, error, false), NULL, NULL, 0);
+            answered = urls->len;
+        }
+    }
+    return answered;
+}
+
+/** @internal
+ * Send a sequence of keypresses to a device in order, pipelining them if the context is set up for it
+ * @param ctx Context to send the keypresses with
+ * @param options Options passed to the call, or NULL
+ * @param urls Array of keypress URLs to send, all on the same device
+ * @return Result of the last keypress sent, as returned by completeKeypress()
+ */
+static int sendKeypresses(RokuContext* ctx, const RokuCallOptions* options, GPtrArray* urls) {
+    int errorCode = 0;
+    guint next = 0;
+    if (urls->len == 0) {
+        return 0;
+    }
+
+    // Pipelining needs raw transport requests, so it's only possible if a device is addressed by IP
+    unsigned depth = atomic_load_explicit(&ctx->pipelineDepth, memory_order_relaxed);
+    struct deviceState* device = getDeviceState(ctx, g_ptr_array_index(urls, 0));
+    if (depth > 1 && device->address) {
+        next = sendPipelinedKeypresses(ctx, options, device, urls, depth, &errorCode);
+    }
+
+    // Send anything left one at a time, stopping once ECP turns out to be disabled or the call is cancelled or out of time
+    for (guint i = next; i < urls->len && errorCode != -3 && !isRokuError(errorCode); i++) {
+        errorCode = completeKeypress(ctx, sendRequest(ctx, options, ROKU_PRIORITY_INTERACTIVE, g_ptr_array_index(urls, i), SOUP_METHOD_POST, NULL), NULL, NULL, 0);
+    }
+    return errorCode;
+}
+
+/** @internal
+ * Check every key in a sequence and build its keypress URLs
+ * @param device Pointer to RokuDevice the keys will be sent to
+ * @param keys Array of key codes
+ * @param numKeys Number of key codes in keys
+ * @param urls Pointer to GPtrArray pointer, set to the new array of URLs to be freed with g_ptr_array_unref() if the keys are valid
+ * @return 0 if every key can be sent, otherwise the error code from checkKey()
+ */
+static int buildKeySequenceURLs(const RokuDevice* device, const char* keys[], const size_t numKeys, GPtrArray** urls) {
+    for (size_t i = 0; i < numKeys; i++) {
+        int keyError = checkKey(device, keys[i]);
+        if (keyError) {
+            return keyError;
+        }
+    }
+    *urls = g_ptr_array_new_with_free_func(g_free);
+    for (size_t i = 0; i < numKeys; i++) {
+        g_ptr_array_add(*urls, g_strconcat(device->url, "/keypress/", keys[i], NULL));
+    }
+    return 0;
+}
+
+int rokuSendKeySequence_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* keys[], const size_t numKeys) {
+    ctx = resolveContext(ctx);
+    GPtrArray* urls;
+    int keyError = buildKeySequenceURLs(device, keys, numKeys, &urls);
+    if (keyError) {
+        return keyError;
+    }
+    int result = sendKeypresses(ctx, options, urls);
+    g_ptr_array_unref(urls);
+    return result;
+}
+
+/** @internal
+ * requestCompleter for tv-channels requests, filling in an array of RokuTVChannels
+ */
+static int completeTVChannels(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxChannels) {
+    RokuTVChannel* channelList = output;
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        g_bytes_unref(response);
+        return -6;
+    }
+    if (httpError) {
+        g_bytes_unref(response);
+        return isRokuError(httpError) ? httpError : -1;
+    }
+
+    // Parse channel list XML
+    xmlDocPtr doc = parseXML(ctx, response, "tv-channels.xml");
+    g_bytes_unref(response);
+    if (!doc) {
+        return -2;
+    }
+    xmlNodePtr rootElement = xmlDocGetRootElement(doc);
+    if (!rootElement) {
+        xmlFreeDoc(doc);
+        return -3;
+    }
+
+    // Iterate through channels and add them to the channel list
+    int channelsFound = 0;
+    for (const xmlNode* nextChannel = rootElement->children; nextChannel != NULL && channelsFound < maxChannels; nextChannel = nextChannel->next) {
+        // Skip non-element nodes
+        if (nextChannel->type != XML_ELEMENT_NODE) {
+            continue;
+        }
+
+        char tmpPhysicalChannel[3];
+        char tmpFrequency[7];
+        struct xmlElementToStringMap map[] = {
+            {"channel-id", channelList[channelsFound].id, sizeof(channelList->id) / sizeof(char)},
+            {"broadcast-network-label", channelList[channelsFound].network, sizeof(channelList->network) / sizeof(char)},
+            {"name", channelList[channelsFound].name, sizeof(channelList->name) / sizeof(char)},
+            {"type", channelList[channelsFound].type, sizeof(channelList->type) / sizeof(char)},
+            {"physical-channel", tmpPhysicalChannel, 3},
+            {"physical-frequency", tmpFrequency, 7},
+        };
+        fillFromXML(nextChannel, false, map, sizeof(map) / sizeof(*map));
+        if (*tmpPhysicalChannel) {
+            channelList[channelsFound].physicalChannel = strtoul(tmpPhysicalChannel, NULL, 10);
+        } else {
+            channelList[channelsFound].physicalChannel = 0;
+        }
+        if (*tmpFrequency) {
+            channelList[channelsFound].frequency = strtoul(tmpFrequency, NULL, 10) * 1000UL;
+        } else {
+            channelList[channelsFound].frequency = 0;
+        }
+
+        channelsFound++;
+    }
+
+    // Clean up and return number of channels found
+    xmlFreeDoc(doc);
+    return channelsFound;
+}
+
+int getRokuTVChannels_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const int maxChannels, RokuTVChannel channelList[]) {
+    ctx = resolveContext(ctx);
+    if (!device->isTV) {
+        return -4;
+    }
+    if (device->isLimited) {
+        return -5;
+    }
+
+    // Request tv-channels from device and fill in the channel list from the response
+    GBytes* response;
+    struct requestSpan span;
+    int httpError = sendEndpointRequest(ctx, options, getDeviceState(ctx, device->url), device->url, ROKU_ENDPOINT_TV_CHANNELS, NULL, &response, &span);
+    int channelsFound = completeTVChannels(ctx, httpError, response, channelList, maxChannels);
+    traceParsed(ctx, &span, httpError, channelsFound);
+    return channelsFound;
+}
+
+/** @internal
+ * requestCompleter for tv-active-channel requests, filling in a RokuExtTVChannel
+ */
+static int completeActiveTVChannel(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxItems) {
+    RokuExtTVChannel* channel = output;
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        g_bytes_unref(response);
+        return -5;
+    }
+    if (httpError) {
+        g_bytes_unref(response);
+        return httpError;
+    }
+
+    // Parse active channel XML and get channel element
+    xmlDocPtr doc = parseXML(ctx, response, "tv-active-channel.xml");
+    g_bytes_unref(response);
+    if (!doc) {
+        return -1;
+    }
+    xmlNodePtr rootElement = xmlDocGetRootElement(doc);
+    if (!rootElement) {
+        xmlFreeDoc(doc);
+        return -2;
+    }
+    // Make sure channel is not empty
+    xmlNode* channelElement = rootElement->children;
+    if (!channelElement) {
+        xmlFreeDoc(doc);
+        return -2;
+    }
+    if (channelElement->type != XML_ELEMENT_NODE) {
+        channelElement = channelElement->next;
+    }
+
+    // Fill in channel with data from XML
+    char tmpPhysicalChannel[3];
+    char tmpFrequency[7];
+    char tmpActive[6];
+    struct xmlElementToStringMap map[] = {
+        {"channel-id", channel->channel.id, sizeof(channel->channel.id) / sizeof(char)},
+        {"broadcast-network-label", channel->channel.network, sizeof(channel->channel.network) / sizeof(char)},
+        {"name", channel->channel.name, sizeof(channel->channel.name) / sizeof(char)},
+        {"type", channel->channel.type, sizeof(channel->channel.type) / sizeof(char)},
+        {"physical-channel", tmpPhysicalChannel, 3},
+        {"physical-frequency", tmpFrequency, 7},
+        {"active-input", tmpActive, 6},
+    };
+    fillFromXML(channelElement, false, map, sizeof(map) / sizeof(*map));
+    if (*tmpPhysicalChannel) {
+        channel->channel.physicalChannel = strtoul(tmpPhysicalChannel, NULL, 10);
+    } else {
+        channel->channel.physicalChannel = 0;
+    }
+    if (*tmpFrequency) {
+        channel->channel.frequency = strtoul(tmpFrequency, NULL, 10) * 1000UL;
+    } else {
+        channel->channel.frequency = 0;
+    }
+
+    // Only fill in the rest of the data if the channel is active (inactive channels have these fields blank)
+    channel->isActive = strcmp("true", tmpActive) == 0;
+    if (channel->isActive) {
+        char tmpHasCC[5];
+        char tmpSignalState[5];
+        char tmpSignalQuality[4];
+        char tmpSignalStrength[5];
+        struct xmlElementToStringMap ifActiveMap[] = {
+            {"program-title", channel->program.title, sizeof(channel->program.title) / sizeof(char)},
+            {"program-description", channel->program.description, sizeof(channel->program.description) / sizeof(char)},
+            {"program-ratings", channel->program.rating, sizeof(channel->program.rating) / sizeof(char)},
+            {"program-has-cc", tmpHasCC, 5},
+            {"signal-mode", channel->resolution, sizeof(channel->resolution) / sizeof(char)},
+            {"signal-state", tmpSignalState, 5},
+            {"signal-quality", tmpSignalQuality, 4},
+            {"signal-strength", tmpSignalStrength, 5},
+        };
+        fillFromXML(channelElement, false, ifActiveMap, sizeof(ifActiveMap) / sizeof(*map));
+        channel->program.hasCC = strcmp("true", tmpHasCC) == 0;
+        channel->signalReceived = strcmp("none", tmpSignalState);
+        if (*tmpSignalQuality) {
+            channel->signalQuality = strtoul(tmpSignalQuality, NULL, 10);
+        } else {
+            channel->signalQuality = 0;
+        }
+        if (*tmpSignalStrength) {
+            channel->signalStrength = (int8_t) strtol(tmpSignalStrength, NULL, 10);
+        } else {
+            channel->signalStrength = 0;
+        }
+    } else {
+        *channel->program.title = '\0';
+        *channel->program.description = '\0';
+        *channel->program.rating = '\0';
+        *channel->resolution = '\0';
+        channel->program.hasCC = false;
+        channel->signalReceived = false;
+        channel->signalQuality = 0;
+        channel->signalStrength = 0;
+    }
+
+    // Clean up and return active channel
+    xmlFreeDoc(doc);
+    return 0;
+}
+
+int getActiveRokuTVChannel_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, RokuExtTVChannel* channel) {
+    ctx = resolveContext(ctx);
+    if (!device->isTV) {
+        return -3;
+    }
+    if (device->isLimited) {
+        return -4;
+    }
+
+    // Request tv-active-channel from device and fill in the channel from the response
+    return sendSharedQuery(ctx, options, device->url, ROKU_ENDPOINT_ACTIVE_TV_CHANNEL, completeActiveTVChannel, channel, sizeof(RokuExtTVChannel));
+}
+
+/** @internal
+ * Fill in app launch parameters for launching a Live TV channel
+ * @param channel Pointer to RokuTVChannel to launch
+ * @param paramNames Array of 3 strings to use as parameter names
+ * @param paramValues Array of 3 strings to use as parameter values
+ * @param launchParams Pointer to RokuAppLaunchParams to fill in
+ */
+static void fillTVChannelLaunchParams(const RokuTVChannel* channel, const char* paramNames[3], const char* paramValues[3], RokuAppLaunchParams* launchParams) {
+    paramNames[0] = "chan";
+    paramNames[1] = "lcn";
+    paramNames[2] = "ch";
+    paramValues[0] = channel->id;
+    paramValues[1] = channel->id;
+    paramValues[2] = channel->id;
+    *launchParams = (RokuAppLaunchParams) {
+        "tvinput.dtv",
+        "",
+        NO_TYPE,
+        paramNames,
+        paramValues,
+        3
+    };
+}
+
+int launchRokuTVChannel_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuTVChannel* channel) {
+    if (!device->isTV) {
+        return -2;
+    }
+    const char* paramNames[3];
+    const char* paramValues[3];
+    RokuAppLaunchParams launchParams;
+    fillTVChannelLaunchParams(channel, paramNames, paramValues, &launchParams);
+    return launchRokuApp_ctx(ctx, options, device, &launchParams);
+}
+
+/** @internal
+ * State of the streaming parser filling in an array of RokuApps from an apps response as it arrives
+ */
+struct appsParser {
+    xmlParserCtxtPtr parser; /**< libxml2 push parser the response is fed to */
+    RokuApp* appList; /**< Array being filled in */
+    int maxApps; /**< Number of apps appList can hold */
+    int appsFound; /**< Number of apps completely filled in */
+    int depth; /**< Depth of the element being parsed, where the root element is 1 */
+    bool inApp; /**< true while inside an app element that is being filled in */
+    size_t nameLength; /**< Length of the name of the app being filled in so far */
+};
+
+/** @internal
+ * libxml2 SAX callback for the start of an element in an apps response: start filling in an app from its attributes
+ */
+static void appsStartElement(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI, int nb_namespaces, const xmlChar** namespaces,
+                             int nb_attributes, int nb_defaulted, const xmlChar** attributes) {
+    struct appsParser* state = ctx;
+    // Apps are the children of the root element
+    if (++state->depth != 2 || state->appsFound >= state->maxApps) {
+        return;
+    }
+    RokuApp* app = &state->appList[state->appsFound];
+    memset(app, 0, sizeof(RokuApp));
+    state->inApp = true;
+    state->nameLength = 0;
+
+    // Attributes come as (name, prefix, URI, value start, value end) tuples, with values not null-terminated
+    struct xmlElementToStringMap map[] = {
+        {"id", app->id, sizeof(app->id) / sizeof(char)},
+        {"type", app->type, sizeof(app->type) / sizeof(char)},
+        {"version", app->version, sizeof(app->version) / sizeof(char)},
+    };
+    for (int i = 0; i < nb_attributes; i++) {
+        const xmlChar** attribute = &attributes[i * 5];
+        for (size_t j = 0; j < sizeof(map) / sizeof(*map); j++) {
+            if (strcmp((const char*) attribute[0], map[j].elementName) == 0) {
+                size_t length = MIN((size_t) (attribute[4] - attribute[3]), map[j].destSize - 1);
+                memcpy(map[j].destString, attribute[3], length);
+                map[j].destString[length] = '\0';
+                break;
+            }
+        }
+    }
+}
+
+/** @internal
+ * libxml2 SAX callback for text in an apps response: add it to the name of the app being filled in
+ */
+static void appsCharacters(void* ctx, const xmlChar* ch, int len) {
+    struct appsParser* state = ctx;
+    if (!state->inApp) {
+        return;
+    }
+    RokuApp* app = &state->appList[state->appsFound];
+    size_t length = MIN((size_t) len, sizeof(app->name) - 1 - state->nameLength);
+    memcpy(app->name + state->nameLength, ch, length);
+    state->nameLength += length;
+    app->name[state->nameLength] = '\0';
+}
+
+/** @internal
+ * libxml2 SAX callback for the end of an element in an apps response: finish the app being filled in
+ */
+static void appsEndElement(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI) {
+    struct appsParser* state = ctx;
+    if (state->depth-- == 2 && state->inApp) {
+        state->inApp = false;
+        state->appsFound++;
+    }
+}
+
+/** @internal
+ * SAX handler for apps responses
+ */
+static xmlSAXHandler appsSAXHandler = {
+    .initialized = XML_SAX2_MAGIC,
+    .startElementNs = appsStartElement,
+    .endElementNs = appsEndElement,
+    .characters = appsCharacters,
+};
+
+/** @internal
+ * Start a streaming parser for an apps response
+ * @param state Parser state to set up
+ * @param appList Array of RokuApps to fill in
+ * @param maxApps Number of apps appList can hold
+ */
+static void startAppsParser(struct appsParser* state, RokuApp* appList, const int maxApps) {
+    memset(state, 0, sizeof(struct appsParser));
+    state->parser = xmlCreatePushParserCtxt(&appsSAXHandler, state, NULL, 0, "apps.xml");
+    state->appList = appList;
+    state->maxApps = maxApps;
+}
+
+/** @internal
+ * chunkReceiver feeding part of an apps response to its streaming parser
+ * @param data Chunk of the response
+ * @param size Size of the chunk in bytes
+ * @param userData Pointer to appsParser struct
+ * @return true until the list is full or the response turns out to be malformed
+ */
+static bool feedAppsParser(const char* data, size_t size, void* userData) {
+    struct appsParser* state = userData;
+    return state->appsFound < state->maxApps && xmlParseChunk(state->parser, data, (int) size, 0) == 0 && state->appsFound < state->maxApps;
+}
+
+/** @internal
+ * Finish the streaming parser of an apps response and free it
+ * @param state Parser state
+ * @param httpError Result of the request, as returned by finishRequest()
+ * @return Number of apps found, or the error code getRokuApps() returns
+ */
+static int finishAppsParser(struct appsParser* state, const int httpError) {
+    // If the list filled up, the rest of the response was never read, so it can't be checked
+    bool full = state->appsFound >= state->maxApps;
+    if (!httpError && !full) {
+        xmlParseChunk(state->parser, NULL, 0, 1);
+    }
+    bool wellFormed = state->parser->wellFormed;
+    xmlFreeParserCtxt(state->parser);
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        return -5;
+    }
+    if (httpError) {
+        return isRokuError(httpError) ? httpError : -1;
+    }
+    if (!full && !wellFormed) {
+        return -2;
+    }
+    return state->appsFound;
+}
+
+/** @internal
+ * requestCompleter for apps requests, filling in an array of RokuApps
+ */
+static int completeApps(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxApps) {
+    struct appsParser state;
+    startAppsParser(&state, output, maxApps);
+    if (!httpError) {
+        gsize size;
+        const char* data = g_bytes_get_data(response, &size);
+        feedAppsParser(data, size, &state);
+    }
+    g_bytes_unref(response);
+    return finishAppsParser(&state, httpError);
+}
+
+int getRokuApps_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const int maxApps, RokuApp appList[]) {
+    ctx = resolveContext(ctx);
+    if (device->isLimited) {
+        return -4;
+    }
+
+    // Stream apps from the device into the parser, which fills in the app list as they arrive
+    struct appsParser state;
+    startAppsParser(&state, appList, maxApps);
+    struct bodySink sink = {feedAppsParser, &state, 0};
+    struct requestSpan span;
+    int httpError = sendEndpointRequest(ctx, options, getDeviceState(ctx, device->url), device->url, ROKU_ENDPOINT_APPS, &sink, NULL, &span);
+    int appsFound = finishAppsParser(&state, httpError);
+    traceParsed(ctx, &span, httpError, appsFound);
+    return appsFound;
+}
+
+/** @internal
+ * requestCompleter for active-app requests, filling in a RokuApp
+ */
+static int completeActiveApp(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxItems) {
+    RokuApp* app = output;
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        g_bytes_unref(response);
+        return -3;
+    }
+    if (httpError) {
+        g_bytes_unref(response);
+        return httpError;
+    }
+
+    // Parse active app XML and get app element
+    xmlDocPtr doc = parseXML(ctx, response, "active-app.xml");
+    g_bytes_unref(response);
+    if (!doc) {
+        return -1;
+    }
+    xmlNodePtr rootElement = xmlDocGetRootElement(doc);
+    if (!rootElement) {
+        xmlFreeDoc(doc);
+        return -2;
+    }
+    // Make sure app is not empty
+    xmlNodePtr appElement = rootElement->children;
+    if (!appElement) {
+        xmlFreeDoc(doc);
+        return -2;
+    }
+    if (appElement->type != XML_ELEMENT_NODE) {
+        appElement = appElement->next;
+    }
+
+    // Get app name from XML element content
+    xmlChar* name = xmlNodeGetContent(appElement);
+    if (name) {
+        strlcpy(app->name, (char*) name, sizeof(app->name) / sizeof(char));
+        xmlFree(name);
+    } else {
+        *app->name = '\0';
+    }
+    // Fill in app with data from XML
+    struct xmlElementToStringMap map[] = {
+        {"id", app->id, sizeof(app->id) / sizeof(char)},
+        {"type", app->type, sizeof(app->type) / sizeof(char)},
+        {"version", app->version, sizeof(app->version) / sizeof(char)},
+    };
+    fillFromXML(appElement, true, map, sizeof(map) / sizeof(*map));
+
+    // Clean up and return app
+    xmlFreeDoc(doc);
+    return 0;
+}
+
+int getActiveRokuApp_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, RokuApp* app) {
+    ctx = resolveContext(ctx);
+    // Request active-app from device and fill in the app from the response
+    return sendSharedQuery(ctx, options, device->url, ROKU_ENDPOINT_ACTIVE_APP, completeActiveApp, app, sizeof(RokuApp));
+}
+
+/** @internal
+ * Build the URL for an app launch request
+ * @param device Pointer to RokuDevice to launch the app on
+ * @param params App ID and optional parameters to launch with
+ * @return URL string, to be freed with g_string_free()
+ */
+static GString* buildLaunchURL(const RokuDevice* device, const RokuAppLaunchParams* params) {
+    GString* url = g_string_sized_new((strlen(device->url) + strlen(params->appID)) * sizeof(char) + sizeof("/launch/"));
+    g_string_assign(url, device->url);
+    g_string_append(url, "/launch/");
+    g_string_append(url, params->appID);
+
+    bool hasContentID = *params->contentID != '\0';
+    bool hasMediaType = params->mediaType != NO_TYPE;
+    bool hasOtherParams = params->numOtherParams != 0;
+
+    if (hasContentID) {
+        g_string_append(url, "?contentId=");
+        g_string_append_uri_escaped(url, params->contentID, NULL, TRUE);
+    }
+    if (hasMediaType) {
+        if (hasContentID) {
+            g_string_append_c(url, '&');
+        } else {
+            g_string_append_c(url, '?');
+        }
+    }
+    switch (params->mediaType) {
+        case FILM:
+            g_string_append(url, "MediaType=movie");
+            break;
+        case SERIES:
+            g_string_append(url, "MediaType=series");
+            break;
+        case SEASON:
+            g_string_append(url, "MediaType=season");
+            break;
+        case EPISODE:
+            g_string_append(url, "MediaType=episode");
+            break;
+        case SHORT_FORM_VIDEO:
+            g_string_append(url, "MediaType=shortFormVideo");
+            break;
+        case TV_SPECIAL:
+            g_string_append(url, "MediaType=tvSpecial");
+            break;
+        default:
+            break;
+    }
+
+    if (hasOtherParams) {
+        if (hasContentID || hasMediaType) {
+            g_string_append_c(url, '&');
+        } else {
+            g_string_append_c(url, '?');
+        }
+    }
+    for (size_t i = 0; i < params->numOtherParams; i++) {
+        g_string_append_uri_escaped(url, params->otherParamNames[i], NULL, TRUE);
+        g_string_append_c(url, '=');
+        g_string_append_uri_escaped(url, params->otherParamValues[i], NULL, TRUE);
+        if (i != params->numOtherParams - 1) {
+            g_string_append_c(url, '&');
+        }
+    }
+    return url;
+}
+
+/** @internal
+ * requestCompleter for launch and search requests
+ */
+static int completeLaunch(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxItems) {
+    g_bytes_unref(response);
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        return -1;
+    }
+    return httpError;
+}
+
+int launchRokuApp_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuAppLaunchParams* params) {
+    ctx = resolveContext(ctx);
+    GString* url = buildLaunchURL(device, params);
+    int httpError = sendRequest(ctx, options, ROKU_PRIORITY_INTERACTIVE, url->str, SOUP_METHOD_POST, NULL);
+    g_string_free(url, TRUE);
+    return completeLaunch(ctx, httpError, NULL, NULL, 0);
+}
+
+/** @internal
+ * requestCompleter for icon requests, filling in a RokuAppIcon
+ */
+static int completeIcon(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxItems) {
+    RokuAppIcon* icon = output;
+    // fill icon data and size while freeing GBytes
+    if (response) {
+        gsize size;
+        icon->data = g_bytes_unref_to_data(response, &size);
+        icon->size = size;
+    } else {
+        icon->data = NULL;
+        icon->size = 0;
+    }
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        return -2;
+    }
+    return httpError;
+}
+
+int getRokuAppIcon_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuApp* app, RokuAppIcon* icon) {
+    ctx = resolveContext(ctx);
+    if (device->isLimited) {
+        return -1;
+    }
+    // Request icon from device
+    char* url = g_strconcat(device->url, "/query/icon/", app->id, NULL);
+    GBytes* response;
+    int httpError = sendRequest(ctx, options, ROKU_PRIORITY_BACKGROUND, url, SOUP_METHOD_GET, &response);
+    g_free(url);
+    return completeIcon(ctx, httpError, response, icon, 1);
+}
+
+/** @internal
+ * Caller's sink for a streamed icon, wrapped as a chunkReceiver
+ */
+struct iconSink {
+    RokuDataSink sink; /**< Function the caller gave */
+    void* userData; /**< Data the caller gave */
+};
+
+/** @internal
+ * chunkReceiver passing part of an icon on to the caller's sink
+ */
+static bool receiveIconChunk(const char* data, size_t size, void* userData) {
+    struct iconSink* iconSink = userData;
+    return iconSink->sink((const unsigned char*) data, size, iconSink->userData);
+}
+
+int streamRokuAppIcon_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuApp* app, RokuDataSink sink, void* userData) {
+    ctx = resolveContext(ctx);
+    if (device->isLimited) {
+        return -1;
+    }
+    // Request icon from device, handing it to the sink as it arrives
+    char* url = g_strconcat(device->url, "/query/icon/", app->id, NULL);
+    struct iconSink iconSink = {sink, userData};
+    struct bodySink bodySink = {receiveIconChunk, &iconSink, 0};
+    int httpError = sendDeviceRequest(ctx, options, ROKU_PRIORITY_BACKGROUND, getDeviceState(ctx, url), url, NULL, SOUP_METHOD_GET, &bodySink, NULL, NULL);
+    g_free(url);
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        return -2;
+    }
+    return httpError;
+}
+
+/** @internal
+ * Build the URL for a custom input request
+ * @param device Pointer to RokuDevice to send input to
+ * @param params Number of parameters to send
+ * @param names Array (size params) of strings with the names of the parameters
+ * @param values Array (size params) of strings with the values of the parameters
+ * @return URL string, to be freed with g_string_free()
+ */
+static GString* buildInputURL(const RokuDevice* device, const size_t params, const char* names[], const char* values[]) {
+    // Construct input request string with base and params
+    GString* url = g_string_sized_new(strlen(device->url) * sizeof(char) + sizeof("/input?"));
+    g_string_assign(url, device->url);
+    g_string_append(url, "/input?");
+    for (int i = 0; i < params; i++) {
+        // add parameters to URL, escaping disallowed URL characters
+        g_string_append_uri_escaped(url, names[i], NULL, TRUE);
+        g_string_append_c(url, '=');
+        g_string_append_uri_escaped(url, values[i], NULL, TRUE);
+        if (i < params - 1) {
+            g_string_append_c(url, '&');
+        }
+    }
+    return url;
+}
+
+/** @internal
+ * requestCompleter for custom input requests
+ */
+static int completeInput(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxItems) {
+    g_bytes_unref(response);
+    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
+        return -2;
+    }
+    return httpError;
+}
+
+int sendCustomRokuInput_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const size_t params, const char* names[], const char* values[]) {
+    ctx = resolveContext(ctx);
+    if (device->isLimited) {
+        return -1;
+    }
+    // Clean up and return result of input request
+    GString* url = buildInputURL(device, params, names, values);
+    int httpError = sendRequest(ctx, options, ROKU_PRIORITY_INTERACTIVE, url->str, SOUP_METHOD_POST, NULL);
+    g_string_free(url, TRUE);
+    return completeInput(ctx, httpError, NULL, NULL, 0);
+}
+
+/** @internal
+ * Build the URL for a search request
+ * @param device Pointer to RokuDevice to run the search on
+ * @param keyword Non-empty keyword to be searched
+ * @param params Pointer to RokuSearchParams describing the parameters of the search
+ * @return URL string, to be freed with g_string_free()
+ */
+static GString* buildSearchURL(const RokuDevice* device, const char* keyword, const RokuSearchParams* params) {
+    GString* url = g_string_sized_new((strlen(device->url) + strlen(keyword)) * sizeof(char) + sizeof("/search/browse?keyword="));
+    g_string_assign(url, device->url);
+    g_string_append(url, "/search/browse?keyword=");
+    g_string_append_uri_escaped(url, keyword, NULL, TRUE);
+
+    switch (params->type) {
+        case MOVIE:
+            g_string_append(url, "&type=movie");
+            break;
+        case SHOW:
+            g_string_append(url, "&type=tv-show");
+            break;
+        case PERSON:
+            g_string_append(url, "&type=person");
+            break;
+        case APP:
+            g_string_append(url, "&type=channel");
+            break;
+        case GAME:
+            g_string_append(url, "&type=game");
+            break;
+        default:
+            break;
+    }
+
+    if (params->includeUnavailable) {
+        g_string_append(url, "&show-unavailable=true");
+    }
+    if (params->autoLaunch) {
+        g_string_append(url, "&launch=true");
+    }
+    if (params->autoSelect) {
+        g_string_append(url, "&match-any=true");
+    }
+
+    if (params->season != 0) {
+        g_string_append(url, "&season=");
+        g_string_append_printf(url, "%u", params->season);
+    }
+    if (*params->tmsID) {
+        g_string_append(url, "&tmsid=");
+        g_string_append(url, params->tmsID);
+    }
+
+    if (*params->providerIDs[0]) {
+        g_string_append(url, "&provider-id=");
+        g_string_append(url, params->providerIDs[0]);
+        for (int i = 1; i < 8; i++) {
+            if (*params->providerIDs[i]) {
+                g_string_append_c(url, ',');
+                g_string_append(url, params->providerIDs[i]);
+            }
+        }
+    }
+    return url;
+}
+
+int rokuSearch_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* keyword, const RokuSearchParams* params) {
+    ctx = resolveContext(ctx);
+    if (!device->hasSearchSupport || device->isLimited) {
+        return -1;
+    }
+    if (*keyword == '\0') {
+        return -2;
+    }
+
+    GString* url = buildSearchURL(device, keyword, params);
+    int httpError = sendRequest(ctx, options, ROKU_PRIORITY_INTERACTIVE, url->str, SOUP_METHOD_POST, NULL);
+    g_string_free(url, TRUE);
+    return completeLaunch(ctx, httpError, NULL, NULL, 0);
+}
+
+/** @internal
+ * Build the keypress URLs needed to type a string on a device
+ * @param device Pointer to RokuDevice to send the string to
+ * @param string Wide Unicode string to send
+ * @return Array of URL strings, one "Lit_" keypress per character, to be freed with g_ptr_array_unref()
+ */
+static GPtrArray* buildTypeStringURLs(const RokuDevice* device, const wchar_t* string) {
+    GPtrArray* urls = g_ptr_array_new_with_free_func(g_free);
+
+    // Iterate through wide string
+    while (*string) {
+        // Convert each wide char into a multibyte string for URL escaping
+        char mbstr[MB_CUR_MAX + 1];
+        int len = wctomb(mbstr, *string);
+        // If this is an "invalid character" in the current locale, skip it
+        if (len == -1) {
+            string++;
+            continue;
+        }
+        mbstr[len] = '\0';
+
+        // Escape each character and add the key "Lit_{character}" to the list
+        char* escaped = g_uri_escape_string(mbstr, NULL, FALSE);
+        g_ptr_array_add(urls, g_strconcat(device->url, "/keypress/Lit_", escaped, NULL));
+        g_free(escaped);
+
+        string++;
+    }
+
+    return urls;
+}
+
+int rokuTypeString_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const wchar_t* string) {
+    ctx = resolveContext(ctx);
+    if (device->isLimited) {
+        return -1;
+    }
+
+    // Send each character's keypress to the Roku device, checking for errors
+    GPtrArray* urls = buildTypeStringURLs(device, string);
+    int errorCode = sendKeypresses(ctx, options, urls);
+    g_ptr_array_unref(urls);
+    return errorCode == -3 ? -2 : errorCode;
+}
+
+/** @internal
+ * State of an asynchronous ECP call, stored as its GTask's task data
+ */
+struct asyncCall {
+    RokuContext* ctx; /**< Context the call is using */
+    requestCompleter complete; /**< Function turning each response into the return value of the call */
+    void* output; /**< Buffer the results are kept in until the call is finished, or NULL */
+    size_t itemSize; /**< Size of each item in output */
+    int maxItems; /**< Number of items output can hold */
+    bool isList; /**< true if the call returns the number of items in output, false if output is a single item */
+    RokuPriority priority; /**< Priority class of the call's requests */
+    gint64 deadline; /**< Absolute deadline of the call in monotonic time, or 0 for none */
+    SoupMessage* msg; /**< Message currently being sent */
+    struct deviceState* device; /**< State of the device msg is sent to */
+    struct requestTimer* timer; /**< Timer enforcing timeouts on msg */
+    gulong cancelHandler; /**< Handler passing cancellation of the call's GCancellable on to timer's cancellable */
+    GPtrArray* urls; /**< Keypress URLs for rokuTypeString_async(), or NULL */
+    guint nextURL; /**< Index of the next URL in urls to send */
+    unsigned retries; /**< Number of times the current request has been retried */
+    GSource* backoffSource; /**< Source sending the current request again once its retry backoff is over, or NULL */
+    GSource* backoffCancelSource; /**< Source cutting the retry backoff short when the call is cancelled, or NULL */
+    struct requestSpan span; /**< Span of the current request */
+};
+
+/** @internal
+ * Free the state of an asynchronous ECP call
+ * @param data Pointer to asyncCall struct
+ */
+static void freeAsyncCall(gpointer data) {
+    struct asyncCall* call = data;
+    g_free(call->output);
+    if (call->msg) {
+        g_object_unref(call->msg);
+    }
+    if (call->urls) {
+        g_ptr_array_unref(call->urls);
+    }
+    g_free(call);
+}
+
+/** @internal
+ * Create the GTask for an asynchronous ECP call
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options passed to the call, or NULL
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ * @param complete Function turning each response into the return value of the call
+ * @param itemSize Size of each item the call outputs, or 0 if it has no output
+ * @param maxItems Number of items the call can output
+ * @param isList true if the call returns the number of items output
+ * @param priority Priority class of the call's requests if options don't set one
+ * @return New GTask with an asyncCall as its task data
+ */
+static GTask* newAsyncCall(RokuContext* ctx, const RokuCallOptions* options, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback,
+                           void* userData, requestCompleter complete, size_t itemSize, int maxItems, bool isList, RokuPriority priority) {
+    struct asyncCall* call = g_new0(struct asyncCall, 1);
+    call->ctx = resolveContext(ctx);
+    call->complete = complete;
+    call->itemSize = itemSize;
+    call->maxItems = maxItems;
+    call->isList = isList;
+    call->priority = getPriority(options, priority);
+    call->deadline = getDeadline(options);
+    if (itemSize && maxItems > 0) {
+        call->output = g_malloc0(itemSize * maxItems);
+    }
+
+    // GTask dispatches its callback in the thread-default context at the time it's created
+    if (mainContext) {
+        g_main_context_push_thread_default(mainContext);
+    }
+    if (!cancellable && options) {
+        cancellable = options->cancellable;
+    }
+    GTask* task = g_task_new(NULL, cancellable, callback, userData);
+    if (mainContext) {
+        g_main_context_pop_thread_default(mainContext);
+    }
+    // Cancellation is reported as ROKU_ERROR_CANCELLED through the call's result, which GTask would otherwise replace
+    g_task_set_check_cancellable(task, FALSE);
+    g_task_set_task_data(task, call, freeAsyncCall);
+    return task;
+}
+
+/** @internal
+ * Return the result of an asynchronous ECP call and release the call's reference to its GTask
+ * @param task GTask of the call
+ * @param result Return value of the call
+ */
+static void returnAsyncCall(GTask* task, const int result) {
+    g_task_return_int(task, result);
+    g_object_unref(task);
+}
+
+static void sendAsyncRequest(GTask* task, const char* url, const char* method);
+static void sendAsyncDeviceRequest(GTask* task, struct deviceState* device, SoupMessage* msg);
+
+/** @internal
+ * Complete an asynchronous ECP call with the outcome of its request, or send the next keypress for rokuTypeString_async()
+ * @param task GTask of the call
+ * @param httpError Result of the request, as returned by finishRequest()
+ * @param response Response body (or NULL), which will be freed
+ */
+static void completeAsyncRequest(GTask* task, const int httpError, GBytes* response) {
+    struct asyncCall* call = g_task_get_task_data(task);
+    int callResult = call->complete(call->ctx, httpError, response, call->output, call->maxItems);
+    traceParsed(call->ctx, &call->span, httpError, callResult);
+
+    // Keypress sequences keep sending keypresses until they're all sent or ECP turns out to be disabled
+    if (call->urls && call->nextURL < call->urls->len && httpError != SOUP_STATUS_UNAUTHORIZED && !isRokuError(callResult)) {
+        call->retries = 0;
+        sendAsyncRequest(task, g_ptr_array_index(call->urls, call->nextURL++), SOUP_METHOD_POST);
+        return;
+    }
+    returnAsyncCall(task, callResult);
+}
+
+/** @internal
+ * Timer source callback: send the current request of an asynchronous ECP call again once its backoff is over, or the
+ * call is cancelled
+ * @param user_data GTask of the call
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean retryAsyncRequest(gpointer user_data) {
+    GTask* task = user_data;
+    struct asyncCall* call = g_task_get_task_data(task);
+    g_source_destroy(call->backoffSource);
+    g_source_unref(call->backoffSource);
+    call->backoffSource = NULL;
+    if (call->backoffCancelSource) {
+        g_source_destroy(call->backoffCancelSource);
+        g_source_unref(call->backoffCancelSource);
+        call->backoffCancelSource = NULL;
+    }
+    // A cancelled call is completed with ROKU_ERROR_CANCELLED without sending anything
+    sendAsyncDeviceRequest(task, call->device, soup_message_new_from_uri(soup_message_get_method(call->msg), soup_message_get_uri(call->msg)));
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * GCancellable source callback ending the retry backoff of an asynchronous ECP call that was cancelled
+ * @param cancellable GCancellable of the call
+ * @param user_data GTask of the call
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean cancelBackoffCallback(GCancellable* cancellable, gpointer user_data) {
+    return retryAsyncRequest(user_data);
+}
+
+/** @internal
+ * libsoup callback for requests sent by asynchronous ECP calls
+ * @param source SoupSession the request was sent with
+ * @param result Result of the request
+ * @param user_data GTask of the call
+ */
+static void asyncRequestCallback(GObject* source, GAsyncResult* result, gpointer user_data) {
+    GTask* task = user_data;
+    struct asyncCall* call = g_task_get_task_data(task);
+    GError* error = NULL;
+    GBytes* response = soup_session_send_and_read_finish(SOUP_SESSION(source), result, &error);
+    unlinkCancellable(g_task_get_cancellable(task), call->cancelHandler);
+    call->cancelHandler = 0;
+    bool timedOut = stopRequestTimer(call->ctx, call->timer, call->msg);
+    call->timer = NULL;
+    releaseRequestSlot(call->ctx, call->device);
+    int httpError = finishRequest(call->ctx, &call->span, soup_message_get_status(call->msg), response, error, timedOut);
+
+    // Failed GETs are sent again after a backoff in the task's context, if the context is set up for it
+    gint64 retryTime = 0;
+    if (isRetryable(httpError) && strcmp(soup_message_get_method(call->msg), SOUP_METHOD_GET) == 0) {
+        retryTime = getRetryTime(call->ctx, call->retries, call->deadline);
+    }
+    if (retryTime) {
+        if (response) {
+            g_bytes_unref(response);
+        }
+        call->retries++;
+        call->backoffSource = g_source_new(&timerSourceFuncs, sizeof(GSource));
+        g_source_set_callback(call->backoffSource, retryAsyncRequest, task, NULL);
+        g_source_set_ready_time(call->backoffSource, retryTime);
+        g_source_attach(call->backoffSource, g_task_get_context(task));
+        // Cancelling the call ends the backoff right away instead of leaving it to sleep it out
+        GCancellable* cancellable = g_task_get_cancellable(task);
+        if (cancellable) {
+            call->backoffCancelSource = g_cancellable_source_new(cancellable);
+            g_source_set_callback(call->backoffCancelSource, (GSourceFunc) (void (*)(void)) cancelBackoffCallback, task, NULL);
+            g_source_attach(call->backoffCancelSource, g_task_get_context(task));
+        }
+        return;
+    }
+    completeAsyncRequest(task, httpError, response);
+}
+
+/** @internal
+ * Send the message of an asynchronous ECP call once it owns a slot for its device and its rate limit allows it
+ * @param user_data GTask of the call
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean sendAsyncMessage(gpointer user_data) {
+    GTask* task = user_data;
+    struct asyncCall* call = g_task_get_task_data(task);
+
+    // The call may have run out of time or been cancelled while it was waiting
+    int earlyResult = checkCallState(call->ctx, call->deadline, g_task_get_cancellable(task));
+    if (earlyResult) {
+        releaseRequestSlot(call->ctx, call->device);
+        traceRequest(call->ctx, &call->span, ROKU_TRACE_BODY_COMPLETE, earlyResult);
+        completeAsyncRequest(task, earlyResult, NULL);
+        return G_SOURCE_REMOVE;
+    }
+
+    // Timeouts are enforced in the task's context, and cancelling the call cancels the request
+    GMainContext* mainContext = g_task_get_context(task);
+    call->timer = startRequestTimer(call->ctx, &call->span, call->deadline, mainContext, call->msg);
+    call->cancelHandler = linkCancellable(g_task_get_cancellable(task), call->timer);
+
+    // libsoup runs async requests in the thread-default context, so make that the task's context
+    g_main_context_push_thread_default(mainContext);
+    soup_session_send_and_read_async(call->device->session, call->msg, G_PRIORITY_DEFAULT, call->timer->cancellable, asyncRequestCallback, task);
+    g_main_context_pop_thread_default(mainContext);
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Continue an asynchronous ECP call once it owns a slot for its device, waiting in the task's context for its rate limit
+ * @param user_data GTask of the call
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean startAsyncRequest(gpointer user_data) {
+    GTask* task = user_data;
+    struct asyncCall* call = g_task_get_task_data(task);
+    gint64 readyTime = reserveToken(call->ctx, call->device);
+    if (!readyTime) {
+        return sendAsyncMessage(task);
+    }
+    atomic_fetch_add_explicit(&call->ctx->throttledRequests, 1, memory_order_relaxed);
+    GSource* source = g_source_new(&timerSourceFuncs, sizeof(GSource));
+    g_source_set_callback(source, sendAsyncMessage, task, NULL);
+    g_source_set_ready_time(source, readyTime);
+    g_source_attach(source, g_task_get_context(task));
+    g_source_unref(source);
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Complete an asynchronous ECP call that was cancelled or ran out of time while waiting for a slot for its device
+ * @param user_data GTask of the call
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean abandonAsyncRequest(gpointer user_data) {
+    GTask* task = user_data;
+    struct asyncCall* call = g_task_get_task_data(task);
+    int result = checkCallState(call->ctx, call->deadline, g_task_get_cancellable(task));
+    traceRequest(call->ctx, &call->span, ROKU_TRACE_BODY_COMPLETE, result);
+    completeAsyncRequest(task, result, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+/** @internal
+ * Send a request for an asynchronous ECP call, waiting in the task's context for a slot if its device is busy
+ * @param task GTask of the call
+ * @param device State of the device
+ * @param msg Message to send, which the call takes ownership of
+ */
+static void sendAsyncDeviceRequest(GTask* task, struct deviceState* device, SoupMessage* msg) {
+    struct asyncCall* call = g_task_get_task_data(task);
+    int earlyResult = checkCallState(call->ctx, call->deadline, g_task_get_cancellable(task));
+    if (!earlyResult) {
+        earlyResult = checkCircuit(call->ctx, device);
+    }
+    if (earlyResult) {
+        g_object_unref(msg);
+        completeAsyncRequest(task, earlyResult, NULL);
+        return;
+    }
+    if (call->msg) {
+        g_object_unref(call->msg);
+    }
+    call->msg = msg;
+    call->device = device;
+    startSpan(call->ctx, &call->span, device, classifyPath(g_uri_get_path(soup_message_get_uri(msg))));
+    if (acquireRequestSlotAsync(call->ctx, call->device, call->priority, call->deadline, g_task_get_cancellable(task), g_task_get_context(task), startAsyncRequest,
+                                abandonAsyncRequest, task)) {
+        startAsyncRequest(task);
+    }
+}
+
+/** @internal
+ * Send a request to the given URL for an asynchronous ECP call
+ * @param task GTask of the call
+ * @param url string containing the URL to request
+ * @param method type of request to send (e.g. "GET" or "POST")
+ */
+static void sendAsyncRequest(GTask* task, const char* url, const char* method) {
+    struct asyncCall* call = g_task_get_task_data(task);
+    sendAsyncDeviceRequest(task, getDeviceState(call->ctx, url), soup_message_new(method, url));
+}
+
+/** @internal
+ * Send a GET request to one of a device's fixed query endpoints for an asynchronous ECP call, using its pre-parsed URI
+ * @param task GTask of the call
+ * @param deviceURL ECP URL of the device
+ * @param endpoint Endpoint to query
+ */
+static void sendAsyncEndpointRequest(GTask* task, const char* deviceURL, const RokuEndpoint endpoint) {
+    struct asyncCall* call = g_task_get_task_data(task);
+    struct deviceState* device = getDeviceState(call->ctx, deviceURL);
+    if (device->endpointURIs[endpoint]) {
+        sendAsyncDeviceRequest(task, device, soup_message_new_from_uri(SOUP_METHOD_GET, device->endpointURIs[endpoint]));
+        return;
+    }
+    // The device URL couldn't be parsed ahead of time, so leave it to libsoup
+    char* url = g_strconcat(deviceURL, endpointPaths[endpoint], NULL);
+    sendAsyncRequest(task, url, SOUP_METHOD_GET);
+    g_free(url);
+}
+
+/** @internal
+ * Finish an asynchronous ECP call and copy its results out
+ * @param result GAsyncResult passed to the call's callback
+ * @param output Pointer to where the results of the call should be copied, or NULL
+ * @return Return value of the call
+ */
+static int finishAsyncCall(GAsyncResult* result, void* output) {
+    GTask* task = G_TASK(result);
+    struct asyncCall* call = g_task_get_task_data(task);
+    int callResult = (int) g_task_propagate_int(task, NULL);
+    if (output && call->output) {
+        size_t items = call->isList ? (callResult > 0 ? callResult : 0) : 1;
+        memcpy(output, call->output, items * call->itemSize);
+        // Ownership of any data the results point to (like icon data) has moved to the caller
+        g_free(call->output);
+        call->output = NULL;
+    }
+    return callResult;
+}
+
+void getRokuDevice_async(RokuContext* ctx, const RokuCallOptions* options, const char* url, GMainContext* mainContext, GCancellable* cancellable,
+                         GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeDeviceInfo, sizeof(RokuDevice), 1, false, ROKU_PRIORITY_NORMAL);
+    struct asyncCall* call = g_task_get_task_data(task);
+    RokuDevice* device = call->output;
+    strlcpy(device->url, url, sizeof(device->url));
+    sendAsyncEndpointRequest(task, url, ROKU_ENDPOINT_DEVICE_INFO);
+}
+
+int getRokuDevice_finish(GAsyncResult* result, RokuDevice* device) {
+    return finishAsyncCall(result, device);
+}
+
+void rokuSendKey_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* key, GMainContext* mainContext,
+                       GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeKeypress, 0, 0, false, ROKU_PRIORITY_INTERACTIVE);
+    int keyError = checkKey(device, key);
+    if (keyError) {
+        returnAsyncCall(task, keyError);
+        return;
+    }
+    char* url = g_strconcat(device->url, "/keypress/", key, NULL);
+    sendAsyncRequest(task, url, SOUP_METHOD_POST);
+    g_free(url);
+}
+
+int rokuSendKey_finish(GAsyncResult* result) {
+    return finishAsyncCall(result, NULL);
+}
+
+void getRokuTVChannels_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const int maxChannels, GMainContext* mainContext,
+                             GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeTVChannels, sizeof(RokuTVChannel), maxChannels, true, ROKU_PRIORITY_NORMAL);
+    if (!device->isTV) {
+        returnAsyncCall(task, -4);
+        return;
+    }
+    if (device->isLimited) {
+        returnAsyncCall(task, -5);
+        return;
+    }
+    sendAsyncEndpointRequest(task, device->url, ROKU_ENDPOINT_TV_CHANNELS);
+}
+
+int getRokuTVChannels_finish(GAsyncResult* result, RokuTVChannel channelList[]) {
+    return finishAsyncCall(result, channelList);
+}
+
+void getActiveRokuTVChannel_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, GMainContext* mainContext,
+                                  GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeActiveTVChannel, sizeof(RokuExtTVChannel), 1, false, ROKU_PRIORITY_NORMAL);
+    if (!device->isTV) {
+        returnAsyncCall(task, -3);
+        return;
+    }
+    if (device->isLimited) {
+        returnAsyncCall(task, -4);
+        return;
+    }
+    sendAsyncEndpointRequest(task, device->url, ROKU_ENDPOINT_ACTIVE_TV_CHANNEL);
+}
+
+int getActiveRokuTVChannel_finish(GAsyncResult* result, RokuExtTVChannel* channel) {
+    return finishAsyncCall(result, channel);
+}
+
+void launchRokuTVChannel_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuTVChannel* channel, GMainContext* mainContext,
+                               GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    if (!device->isTV) {
+        GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeLaunch, 0, 0, false, ROKU_PRIORITY_INTERACTIVE);
+        returnAsyncCall(task, -2);
+        return;
+    }
+    const char* paramNames[3];
+    const char* paramValues[3];
+    RokuAppLaunchParams launchParams;
+    fillTVChannelLaunchParams(channel, paramNames, paramValues, &launchParams);
+    launchRokuApp_async(ctx, options, device, &launchParams, mainContext, cancellable, callback, userData);
+}
+
+int launchRokuTVChannel_finish(GAsyncResult* result) {
+    return finishAsyncCall(result, NULL);
+}
+
+void getRokuApps_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const int maxApps, GMainContext* mainContext,
+                       GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeApps, sizeof(RokuApp), maxApps, true, ROKU_PRIORITY_NORMAL);
+    if (device->isLimited) {
+        returnAsyncCall(task, -4);
+        return;
+    }
+    sendAsyncEndpointRequest(task, device->url, ROKU_ENDPOINT_APPS);
+}
+
+int getRokuApps_finish(GAsyncResult* result, RokuApp appList[]) {
+    return finishAsyncCall(result, appList);
+}
+
+void getActiveRokuApp_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, GMainContext* mainContext, GCancellable* cancellable,
+                            GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeActiveApp, sizeof(RokuApp), 1, false, ROKU_PRIORITY_NORMAL);
+    sendAsyncEndpointRequest(task, device->url, ROKU_ENDPOINT_ACTIVE_APP);
+}
+
+int getActiveRokuApp_finish(GAsyncResult* result, RokuApp* app) {
+    return finishAsyncCall(result, app);
+}
+
+void launchRokuApp_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuAppLaunchParams* params, GMainContext* mainContext,
+                         GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeLaunch, 0, 0, false, ROKU_PRIORITY_INTERACTIVE);
+    GString* url = buildLaunchURL(device, params);
+    sendAsyncRequest(task, url->str, SOUP_METHOD_POST);
+    g_string_free(url, TRUE);
+}
+
+int launchRokuApp_finish(GAsyncResult* result) {
+    return finishAsyncCall(result, NULL);
+}
+
+void getRokuAppIcon_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuApp* app, GMainContext* mainContext,
+                          GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeIcon, sizeof(RokuAppIcon), 1, false, ROKU_PRIORITY_BACKGROUND);
+    if (device->isLimited) {
+        returnAsyncCall(task, -1);
+        return;
     }
+    char* url = g_strconcat(device->url, "/query/icon/", app->id, NULL);
+    sendAsyncRequest(task, url, SOUP_METHOD_GET);
+    g_free(url);
+}
 
-    // Only fill in the rest of the data if the channel is active (inactive channels have these fields blank)
-    channel->isActive = strcmp("true", tmpActive) == 0;
-    if (channel->isActive) {
-        char tmpHasCC[5];
-        char tmpSignalState[5];
-        char tmpSignalQuality[4];
-        char tmpSignalStrength[5];
-        struct xmlElementToStringMap ifActiveMap[] = {
-            {"program-title", channel->program.title, sizeof(channel->program.title) / sizeof(char)},
-            {"program-description", channel->program.description, sizeof(channel->program.description) / sizeof(char)},
-            {"program-ratings", channel->program.rating, sizeof(channel->program.rating) / sizeof(char)},
-            {"program-has-cc", tmpHasCC, 5},
-            {"signal-mode", channel->resolution, sizeof(channel->resolution) / sizeof(char)},
-            {"signal-state", tmpSignalState, 5},
-            {"signal-quality", tmpSignalQuality, 4},
-            {"signal-strength", tmpSignalStrength, 5},
-        };
-        fillFromXML(channelElement, false, ifActiveMap, sizeof(ifActiveMap) / sizeof(*map));
-        channel->program.hasCC = strcmp("true", tmpHasCC) == 0;
-        channel->signalReceived = strcmp("none", tmpSignalState);
-        if (*tmpSignalQuality) {
-            channel->signalQuality = strtoul(tmpSignalQuality, NULL, 10);
-        } else {
-            channel->signalQuality = 0;
-        }
-        if (*tmpSignalStrength) {
-            channel->signalStrength = (int8_t) strtol(tmpSignalStrength, NULL, 10);
-        } else {
-            channel->signalStrength = 0;
-        }
-    } else {
-        *channel->program.title = '\0';
-        *channel->program.description = '\0';
-        *channel->program.rating = '\0';
-        *channel->resolution = '\0';
-        channel->program.hasCC = false;
-        channel->signalReceived = false;
-        channel->signalQuality = 0;
-        channel->signalStrength = 0;
+int getRokuAppIcon_finish(GAsyncResult* result, RokuAppIcon* icon) {
+    return finishAsyncCall(result, icon);
+}
+
+void sendCustomRokuInput_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const size_t params, const char* names[],
+                               const char* values[], GMainContext* mainContext, GCancellable* cancellable,
+                               GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeInput, 0, 0, false, ROKU_PRIORITY_INTERACTIVE);
+    if (device->isLimited) {
+        returnAsyncCall(task, -1);
+        return;
     }
+    GString* url = buildInputURL(device, params, names, values);
+    sendAsyncRequest(task, url->str, SOUP_METHOD_POST);
+    g_string_free(url, TRUE);
+}
 
-    // Clean up and return active channel
-    xmlFreeDoc(doc);
-    return 0;
+int sendCustomRokuInput_finish(GAsyncResult* result) {
+    return finishAsyncCall(result, NULL);
 }
 
-int launchRokuTVChannel(const RokuDevice* device, const RokuTVChannel* channel) {
-    if (!device->isTV) {
-        return -2;
+void rokuSearch_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* keyword, const RokuSearchParams* params,
+                      GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeLaunch, 0, 0, false, ROKU_PRIORITY_INTERACTIVE);
+    if (!device->hasSearchSupport || device->isLimited) {
+        returnAsyncCall(task, -1);
+        return;
     }
-    const char* paramNames[3] = {"chan", "lcn", "ch"};
-    const char* paramValues[3] = {channel->id, channel->id, channel->id};
-    RokuAppLaunchParams launchParams = {
-        "tvinput.dtv",
-        "",
-        NO_TYPE,
-        paramNames,
-        paramValues,
-        3
-    };
-    return launchRokuApp(device, &launchParams);
+    if (*keyword == '\0') {
+        returnAsyncCall(task, -2);
+        return;
+    }
+    GString* url = buildSearchURL(device, keyword, params);
+    sendAsyncRequest(task, url->str, SOUP_METHOD_POST);
+    g_string_free(url, TRUE);
 }
 
-int getRokuApps(const RokuDevice* device, const int maxApps, RokuApp appList[]) {
+int rokuSearch_finish(GAsyncResult* result) {
+    return finishAsyncCall(result, NULL);
+}
+
+/** @internal
+ * requestCompleter for rokuTypeString_async() keypress requests, which report ECP being disabled as -2
+ */
+static int completeTypedKeypress(RokuContext* ctx, const int httpError, GBytes* response, void* output, const int maxItems) {
+    int result = completeKeypress(ctx, httpError, response, output, maxItems);
+    return result == -3 ? -2 : result;
+}
+
+void rokuTypeString_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const wchar_t* string, GMainContext* mainContext,
+                          GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeTypedKeypress, 0, 0, false, ROKU_PRIORITY_INTERACTIVE);
     if (device->isLimited) {
-        return -4;
+        returnAsyncCall(task, -1);
+        return;
     }
+    struct asyncCall* call = g_task_get_task_data(task);
+    call->urls = buildTypeStringURLs(device, string);
+    if (call->urls->len == 0) {
+        returnAsyncCall(task, 0);
+        return;
+    }
+    sendAsyncRequest(task, g_ptr_array_index(call->urls, call->nextURL++), SOUP_METHOD_POST);
+}
 
-    // Request apps from device and check for errors
-    char queryURL[(sizeof(device->url) + sizeof("/query/apps")) / sizeof(char) - 1];
-    strcpy(queryURL, device->url);
-    strcat(queryURL, "/query/apps");
-    GBytes* response;
-    int httpError = sendRequest(queryURL, SOUP_METHOD_GET, &response);
-    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
-        g_bytes_unref(response);
-        return -5;
+int rokuTypeString_finish(GAsyncResult* result) {
+    return finishAsyncCall(result, NULL);
+}
+
+void rokuSendKeySequence_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* keys[], const size_t numKeys,
+                               GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, completeKeypress, 0, 0, false, ROKU_PRIORITY_INTERACTIVE);
+    struct asyncCall* call = g_task_get_task_data(task);
+    int keyError = buildKeySequenceURLs(device, keys, numKeys, &call->urls);
+    if (keyError) {
+        returnAsyncCall(task, keyError);
+        return;
     }
-    if (httpError) {
-        g_bytes_unref(response);
-        return -1;
+    if (call->urls->len == 0) {
+        returnAsyncCall(task, 0);
+        return;
     }
+    sendAsyncRequest(task, g_ptr_array_index(call->urls, call->nextURL++), SOUP_METHOD_POST);
+}
 
-    // Parse app list XML and get app element
-    xmlDocPtr doc = xmlReadDoc(g_bytes_get_data(response, NULL), "apps.xml", "UTF-8", 0);
-    g_bytes_unref(response);
-    if (!doc) {
-        return -2;
+int rokuSendKeySequence_finish(GAsyncResult* result) {
+    return finishAsyncCall(result, NULL);
+}
+
+/** @internal
+ * discovery finish function for findRokuDevices_async(): return the result of the call
+ * @param discovery Search that ended, whose finishData is the call's GTask
+ */
+static void returnDiscovery(struct discovery* discovery) {
+    GTask* task = discovery->finishData;
+    struct asyncCall* call = g_task_get_task_data(task);
+    int result = finishDiscovery(call->ctx, discovery);
+    g_free(discovery->deviceList);
+    g_free(discovery);
+    returnAsyncCall(task, result);
+}
+
+void findRokuDevices_async(RokuContext* ctx, const RokuCallOptions* options, const char* iface, const size_t maxDevices, const size_t urlStringSize,
+                           GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData) {
+    GTask* task = newAsyncCall(ctx, options, mainContext, cancellable, callback, userData, NULL, urlStringSize, (int) maxDevices, true, ROKU_PRIORITY_NORMAL);
+    struct asyncCall* call = g_task_get_task_data(task);
+
+    // URLs are found into the call's output buffer, and copied out to the caller's list by findRokuDevices_finish()
+    struct discovery* discovery = g_new0(struct discovery, 1);
+    discovery->ctx = call->ctx;
+    discovery->mainContext = g_task_get_context(task);
+    discovery->cancellable = g_task_get_cancellable(task);
+    discovery->deviceList = g_new(char*, maxDevices ? maxDevices : 1);
+    for (size_t i = 0; i < maxDevices; i++) {
+        discovery->deviceList[i] = (char*) call->output + i * urlStringSize;
     }
-    xmlNodePtr rootElement = xmlDocGetRootElement(doc);
-    if (!rootElement) {
-        xmlFreeDoc(doc);
-        return -3;
+    discovery->maxDevices = call->output ? maxDevices : 0;
+    discovery->deviceStrSize = urlStringSize;
+    discovery->finish = returnDiscovery;
+    discovery->finishData = task;
+
+    // gssdp watches its sockets in the thread-default context at the time the client is created
+    RokuDiscoveryOptions discoveryOptions;
+    getDiscoveryOptions(call->ctx, &discoveryOptions);
+    g_main_context_push_thread_default(discovery->mainContext);
+    int result = startDiscovery(discovery, iface, &discoveryOptions, call->deadline);
+    g_main_context_pop_thread_default(discovery->mainContext);
+    if (result) {
+        g_free(discovery->deviceList);
+        g_free(discovery);
+        returnAsyncCall(task, result);
     }
+}
 
-    // Iterate through apps and add them to the app list
-    int appsFound = 0;
-    for (const xmlNode* nextApp = rootElement->children; nextApp != NULL && appsFound < maxApps; nextApp = nextApp->next) {
-        // Skip non-element nodes
-        if (nextApp->type != XML_ELEMENT_NODE) {
-            continue;
-        }
-        // Get app name from XML element content
-        xmlChar* name = xmlNodeGetContent(nextApp);
-        if (name) {
-            strlcpy(appList[appsFound].name, (char*) name, sizeof(appList->name) / sizeof(char));
-            xmlFree(name);
-        } else {
-            *appList[appsFound].name = '\0';
+int findRokuDevices_finish(GAsyncResult* result, char* deviceList[]) {
+    GTask* task = G_TASK(result);
+    struct asyncCall* call = g_task_get_task_data(task);
+    int callResult = (int) g_task_propagate_int(task, NULL);
+    for (int i = 0; i < call->maxItems && call->output; i++) {
+        if (i < callResult) {
+            memcpy(deviceList[i], (char*) call->output + i * call->itemSize, call->itemSize);
+        } else if (call->itemSize) {
+            *deviceList[i] = '\0';
         }
-        // Fill in app with data from XML
-        struct xmlElementToStringMap map[] = {
-            {"id", appList[appsFound].id, sizeof(appList->id) / sizeof(char)},
-            {"type", appList[appsFound].type, sizeof(appList->type) / sizeof(char)},
-            {"version", appList[appsFound].version, sizeof(appList->version) / sizeof(char)},
-        };
-        fillFromXML(nextApp, true, map, sizeof(map) / sizeof(*map));
-
-        appsFound++;
     }
+    return callResult;
+}
 
-    // Clean up and return number of apps found
-    xmlFreeDoc(doc);
-    return appsFound;
+/**
+ * A GMainContext driven by an external event loop through rokuPrepare() and rokuDispatch()
+ */
+struct RokuEventLoop {
+    GMainContext* context; /**< Context the library's _async calls are run in */
+    GPollFD* fds; /**< File descriptors the context is waiting on, from the last rokuPrepare() */
+    gint allocatedFds; /**< Number of entries fds has room for */
+    gint numFds; /**< Number of entries in fds */
+    gint maxPriority; /**< Priority of the highest priority source that was ready when the context was prepared */
+    gint64 deadline; /**< Monotonic time the context next has a timer due, or -1 for none */
+    bool prepared; /**< Set from rokuPrepare() until rokuDispatch() */
+};
+
+RokuEventLoop* createRokuEventLoop(void) {
+    RokuEventLoop* loop = g_new0(RokuEventLoop, 1);
+    loop->context = g_main_context_new();
+    return loop;
 }
 
-int getActiveRokuApp(const RokuDevice* device, RokuApp* app) {
-    // Request active-app from device and check for errors
-    char queryURL[(sizeof(device->url) + sizeof("/query/active-app")) / sizeof(char) - 1];
-    strcpy(queryURL, device->url);
-    strcat(queryURL, "/query/active-app");
-    GBytes* response;
-    int httpError = sendRequest(queryURL, SOUP_METHOD_GET, &response);
-    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
-        g_bytes_unref(response);
-        return -3;
+void destroyRokuEventLoop(RokuEventLoop* loop) {
+    if (loop->prepared) {
+        g_main_context_release(loop->context);
     }
-    if (httpError) {
-        g_bytes_unref(response);
-        return httpError;
+    g_main_context_unref(loop->context);
+    g_free(loop->fds);
+    g_free(loop);
+}
+
+GMainContext* getRokuEventLoopContext(RokuEventLoop* loop) {
+    return loop->context;
+}
+
+int rokuPrepare(RokuEventLoop* loop, RokuPollFd fds[], const int maxFds, int64_t* deadline) {
+    if (!loop->prepared) {
+        // The context stays acquired until rokuDispatch(), so nothing else can run it in between
+        if (!g_main_context_acquire(loop->context)) {
+            return -1;
+        }
+        g_main_context_prepare(loop->context, &loop->maxPriority);
+        gint timeout;
+        while ((loop->numFds = g_main_context_query(loop->context, loop->maxPriority, &timeout, loop->fds, loop->allocatedFds)) > loop->allocatedFds) {
+            loop->allocatedFds = loop->numFds;
+            loop->fds = g_renew(GPollFD, loop->fds, loop->allocatedFds);
+        }
+        loop->deadline = timeout < 0 ? -1 : g_get_monotonic_time() + timeout * (gint64) 1000;
+        loop->prepared = true;
     }
 
-    // Parse active app XML and get app element
-    xmlDocPtr doc = xmlReadDoc(g_bytes_get_data(response, NULL), "active-app.xml", "UTF-8", 0);
-    g_bytes_unref(response);
-    if (!doc) {
-        return -1;
+    // GIOCondition flags have the same values as poll() events
+    for (int i = 0; i < loop->numFds && i < maxFds; i++) {
+        fds[i].fd = loop->fds[i].fd;
+        fds[i].events = (short) loop->fds[i].events;
+        fds[i].revents = 0;
     }
-    xmlNodePtr rootElement = xmlDocGetRootElement(doc);
-    if (!rootElement) {
-        xmlFreeDoc(doc);
-        return -2;
+    if (deadline) {
+        *deadline = loop->deadline;
     }
-    // Make sure app is not empty
-    xmlNodePtr appElement = rootElement->children;
-    if (!appElement) {
-        xmlFreeDoc(doc);
-        return -2;
+    return loop->numFds;
+}
+
+void rokuDispatch(RokuEventLoop* loop, const RokuPollFd fds[], const int numFds) {
+    if (!loop->prepared) {
+        return;
     }
-    if (appElement->type != XML_ELEMENT_NODE) {
-        appElement = appElement->next;
+    for (int i = 0; i < loop->numFds; i++) {
+        loop->fds[i].revents = i < numFds ? (gushort) fds[i].revents : 0;
     }
+    if (g_main_context_check(loop->context, loop->maxPriority, loop->fds, loop->numFds)) {
+        g_main_context_dispatch(loop->context);
+    }
+    loop->prepared = false;
+    g_main_context_release(loop->context);
+}
 
-    // Get app name from XML element content
-    xmlChar* name = xmlNodeGetContent(appElement);
-    if (name) {
-        strlcpy(app->name, (char*) name, sizeof(app->name) / sizeof(char));
-        xmlFree(name);
-    } else {
-        *app->name = '\0';
+#ifdef HAVE_IO_URING
+/** @internal
+ * Operation the next completion of a keypress sent through io_uring belongs to
+ */
+enum uringStage {
+    URING_CONNECT, /**< Connecting a new socket, with the send linked after it */
+    URING_SEND, /**< Sending the request */
+    URING_RECEIVE, /**< Receiving the response head */
+    URING_DONE /**< Finished, waiting for any cancelled operations to complete */
+};
+
+/** @internal
+ * A single device's keypress in a fleet batch sent through io_uring
+ */
+struct uringKeypress {
+    struct deviceState* device; /**< State of the device */
+    RokuFleetResult* result; /**< Where to store the device's result */
+    GSocket* socket; /**< Raw transport socket the keypress is sent on */
+    bool reused; /**< true if socket was kept alive from an earlier request */
+    enum uringStage stage; /**< Operation the next completion belongs to */
+    unsigned pending; /**< Number of submitted operations that haven't completed yet */
+    struct sockaddr_storage address; /**< Native address of the device, for connecting */
+    socklen_t addressLength; /**< Length of address */
+    char request[RAW_BUFFER_SIZE]; /**< Prebuilt keypress request */
+    size_t requestLength; /**< Length of request */
+    size_t sent; /**< Number of bytes of request sent so far */
+    struct rawReader reader; /**< Buffer the response head is read into */
+    unsigned status; /**< HTTP status code of the response, or 0 if there isn't one (yet) */
+    bool reusable; /**< true if the connection can be kept for another request */
+    bool timedOut; /**< true if the keypress was cancelled because the batch ran out of time */
+    GError* error; /**< Error the keypress failed with, or NULL */
+    struct requestSpan span; /**< Span of the keypress */
+};
+
+/** @internal
+ * Get a submission queue entry, submitting what's queued to make room if the queue is full
+ * @param ring io_uring of the batch
+ * @return Submission queue entry
+ */
+static struct io_uring_sqe* getUringSqe(struct io_uring* ring) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
+    while (!sqe) {
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
     }
-    // Fill in app with data from XML
-    struct xmlElementToStringMap map[] = {
-        {"id", app->id, sizeof(app->id) / sizeof(char)},
-        {"type", app->type, sizeof(app->type) / sizeof(char)},
-        {"version", app->version, sizeof(app->version) / sizeof(char)},
-    };
-    fillFromXML(appElement, true, map, sizeof(map) / sizeof(*map));
+    return sqe;
+}
 
-    // Clean up and return app
-    xmlFreeDoc(doc);
-    return 0;
+/** @internal
+ * Queue the next receive of a keypress's response
+ * @param ring io_uring of the batch
+ * @param keypress Keypress to receive the response of
+ */
+static void queueUringReceive(struct io_uring* ring, struct uringKeypress* keypress) {
+    struct io_uring_sqe* sqe = getUringSqe(ring);
+    io_uring_prep_recv(sqe, g_socket_get_fd(keypress->socket), keypress->reader.buffer + keypress->reader.used,
+                       sizeof(keypress->reader.buffer) - 1 - keypress->reader.used, 0);
+    io_uring_sqe_set_data(sqe, keypress);
+    keypress->stage = URING_RECEIVE;
+    keypress->pending++;
 }
 
-int launchRokuApp(const RokuDevice* device, const RokuAppLaunchParams* params) {
-    GString* url = g_string_sized_new((strlen(device->url) + strlen(params->appID)) * sizeof(char) + sizeof("/launch/"));
-    g_string_assign(url, device->url);
-    g_string_append(url, "/launch/");
-    g_string_append(url, params->appID);
+/** @internal
+ * Queue sending the rest of a keypress's request
+ * @param ring io_uring of the batch
+ * @param keypress Keypress to send
+ * @param flags Flags of the submission, like IOSQE_IO_LINK to only send after the operation queued before it
+ */
+static void queueUringSend(struct io_uring* ring, struct uringKeypress* keypress, const unsigned flags) {
+    struct io_uring_sqe* sqe = getUringSqe(ring);
+    io_uring_prep_send(sqe, g_socket_get_fd(keypress->socket), keypress->request + keypress->sent, keypress->requestLength - keypress->sent,
+                       MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, keypress);
+    sqe->flags |= flags;
+    keypress->pending++;
+}
 
-    bool hasContentID = *params->contentID != '\0';
-    bool hasMediaType = params->mediaType != NO_TYPE;
-    bool hasOtherParams = params->numOtherParams != 0;
+/** @internal
+ * Queue connecting a new socket for a keypress, with sending its request linked after it
+ * @param ring io_uring of the batch
+ * @param keypress Keypress to connect, which is finished with an error if its socket can't be set up
+ */
+static void queueUringConnect(struct io_uring* ring, struct uringKeypress* keypress) {
+    GSocketAddress* address = keypress->device->address;
+    keypress->socket = g_socket_new(g_socket_address_get_family(address), G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, &keypress->error);
+    keypress->addressLength = g_socket_address_get_native_size(address);
+    if (!keypress->socket || !g_socket_address_to_native(address, &keypress->address, sizeof(keypress->address), &keypress->error)) {
+        keypress->stage = URING_DONE;
+        return;
+    }
+    struct io_uring_sqe* sqe = getUringSqe(ring);
+    io_uring_prep_connect(sqe, g_socket_get_fd(keypress->socket), (struct sockaddr*) &keypress->address, keypress->addressLength);
+    io_uring_sqe_set_data(sqe, keypress);
+    sqe->flags |= IOSQE_IO_LINK;
+    keypress->stage = URING_CONNECT;
+    keypress->pending++;
+    queueUringSend(ring, keypress, 0);
+}
 
-    if (hasContentID) {
-        g_string_append(url, "?contentId=");
-        g_string_append_uri_escaped(url, params->contentID, NULL, TRUE);
+/** @internal
+ * Send a keypress again on a new connection if the device closed the kept-alive connection it was sent on before
+ * answering, like the raw transport does
+ * @param ring io_uring of the batch
+ * @param keypress Keypress whose send or receive failed, which has no other operations pending
+ * @param res Result the operation completed with
+ * @return true if the keypress is being sent again (or failed setting up its new connection), false if it should fail
+ */
+static bool retryUringKeypress(struct io_uring* ring, struct uringKeypress* keypress, const int res) {
+    if (!keypress->reused || keypress->reader.used || (res != 0 && res != -ECONNRESET && res != -EPIPE)) {
+        return false;
     }
-    if (hasMediaType) {
-        if (hasContentID) {
-            g_string_append_c(url, '&');
-        } else {
-            g_string_append_c(url, '?');
-        }
+    g_object_unref(keypress->socket);
+    keypress->socket = NULL;
+    keypress->reused = false;
+    keypress->sent = 0;
+    queueUringConnect(ring, keypress);
+    return true;
+}
+
+/** @internal
+ * Fail a keypress sent through io_uring with the error an operation completed with
+ * @param keypress Keypress that failed
+ * @param res Negated errno the operation completed with
+ */
+static void failUringKeypress(struct uringKeypress* keypress, const int res) {
+    if (keypress->stage != URING_DONE) {
+        keypress->stage = URING_DONE;
+        g_set_error_literal(&keypress->error, G_IO_ERROR, g_io_error_from_errno(-res), g_strerror(-res));
     }
-    switch (params->mediaType) {
-        case FILM:
-            g_string_append(url, "MediaType=movie");
-            break;
-        case SERIES:
-            g_string_append(url, "MediaType=series");
-            break;
-        case SEASON:
-            g_string_append(url, "MediaType=season");
-            break;
-        case EPISODE:
-            g_string_append(url, "MediaType=episode");
+}
+
+/** @internal
+ * Handle a completed io_uring operation of a keypress, queueing the keypress's next operation if there is one
+ * @param ring io_uring of the batch
+ * @param keypress Keypress the operation belongs to
+ * @param res Result of the operation
+ */
+static void advanceUringKeypress(struct io_uring* ring, struct uringKeypress* keypress, const int res) {
+    keypress->pending--;
+    switch (keypress->stage) {
+        case URING_CONNECT:
+            // The linked send is already queued, and is cancelled if the connect failed
+            if (res < 0) {
+                failUringKeypress(keypress, res);
+            } else {
+                keypress->stage = URING_SEND;
+            }
             break;
-        case SHORT_FORM_VIDEO:
-            g_string_append(url, "MediaType=shortFormVideo");
+        case URING_SEND:
+            if (res < 0) {
+                if (!retryUringKeypress(ring, keypress, res)) {
+                    failUringKeypress(keypress, res);
+                }
+            } else if ((keypress->sent += res) < keypress->requestLength) {
+                queueUringSend(ring, keypress, 0);
+            } else {
+                queueUringReceive(ring, keypress);
+            }
             break;
-        case TV_SPECIAL:
-            g_string_append(url, "MediaType=tvSpecial");
+        case URING_RECEIVE: {
+            if (res <= 0) {
+                if (!retryUringKeypress(ring, keypress, res)) {
+                    failUringKeypress(keypress, res < 0 ? res : -ECONNRESET);
+                }
+                break;
+            }
+            char* buffer = keypress->reader.buffer;
+            keypress->reader.used += res;
+            buffer[keypress->reader.used] = '\0';
+            const char* headEnd = strstr(buffer, "\r\n\r\n");
+            if (!headEnd) {
+                if (keypress->reader.used == sizeof(keypress->reader.buffer) - 1) {
+                    keypress->stage = URING_DONE;
+                    g_set_error_literal(&keypress->error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Response head too long");
+                } else {
+                    queueUringReceive(ring, keypress);
+                }
+                break;
+            }
+            keypress->stage = URING_DONE;
+            keypress->status = parseRawStatus(buffer, &keypress->error);
+
+            // Only keep the connection if the whole response (with its body, if any) has been read and nothing else
+            const char* connection = findRawHeader(buffer, "Connection:");
+            const char* contentLength = findRawHeader(buffer, "Content-Length:");
+            size_t headLength = headEnd + 4 - buffer;
+            keypress->reusable = keypress->status && contentLength && !(connection && g_ascii_strncasecmp(connection, "close", 5) == 0) &&
+                                 g_ascii_strtoull(contentLength, NULL, 10) == keypress->reader.used - headLength;
             break;
-        default:
+        }
+        case URING_DONE:
+            // A cancelled or failed operation completing after the keypress already finished
             break;
     }
+}
+
+/** @internal
+ * End an io_uring keypress batch early, failing the keypresses that haven't finished and cancelling their operations
+ * @param ring io_uring of the batch
+ * @param keypresses Array (size numKeypresses) of the batch's keypresses, where those not in the batch have no device
+ * @param numKeypresses Number of entries in keypresses
+ * @param cancelled true if the call was cancelled, false if the batch ran out of time
+ * @param removePoll true if the poll on the call's cancellable is still pending and should be removed
+ */
+static void endUringBatch(struct io_uring* ring, struct uringKeypress keypresses[], const size_t numKeypresses, const bool cancelled, const bool removePoll) {
+    for (size_t i = 0; i < numKeypresses; i++) {
+        struct uringKeypress* keypress = &keypresses[i];
+        if (keypress->device && keypress->stage != URING_DONE) {
+            keypress->stage = URING_DONE;
+            keypress->timedOut = !cancelled;
+            g_set_error_literal(&keypress->error, G_IO_ERROR, cancelled ? G_IO_ERROR_CANCELLED : G_IO_ERROR_TIMED_OUT,
+                                cancelled ? "Operation was cancelled" : "Operation timed out");
+        }
+        if (keypress->pending) {
+            struct io_uring_sqe* sqe = getUringSqe(ring);
+            io_uring_prep_cancel(sqe, keypress, 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+    }
+    if (removePoll) {
+        struct io_uring_sqe* sqe = getUringSqe(ring);
+        io_uring_prep_poll_remove(sqe, (__u64) (uintptr_t) ring);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+}
+
+/** @internal
+ * Send a fleet keypress to as many of the devices as possible at once through a single io_uring, batching every
+ * device's connect, send, and receive instead of using a thread per device. Devices it can't handle (like those not
+ * addressed by IP or already busy) are left for the thread pool.
+ * @param ctx Context to send the keypresses with
+ * @param options Options for the operation on each device, or NULL
+ * @param devices Array (size numDevices) of RokuDevices to send the keypress to
+ * @param numDevices Number of devices in devices
+ * @param key Key code to send
+ * @param results Array (size numDevices) of results to fill in
+ * @param handled Array (size numDevices) of flags, set for each device the keypress was sent to
+ */
+static void sendUringKeypresses(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice devices[], const size_t numDevices, const char* key,
+                                RokuFleetResult results[], bool handled[]) {
+    struct io_uring ring;
+    if (io_uring_queue_init((unsigned) MIN(numDevices * 3, 4096), &ring, 0) < 0) {
+        return;
+    }
+    gint64 deadline = getDeadline(options);
+    GCancellable* cancellable = options ? options->cancellable : NULL;
+    struct uringKeypress* keypresses = g_new0(struct uringKeypress, numDevices);
+    unsigned active = 0;
 
-    if (hasOtherParams) {
-        if (hasContentID || hasMediaType) {
-            g_string_append_c(url, '&');
+    // Queue every device's keypress, skipping devices that have to wait for a slot or token
+    for (size_t i = 0; i < numDevices && !checkCallState(ctx, deadline, cancellable); i++) {
+        if (checkKey(&devices[i], key)) {
+            continue;
+        }
+        char* url = g_strconcat(devices[i].url, "/keypress/", key, NULL);
+        struct deviceState* device = getDeviceState(ctx, url);
+        struct uringKeypress* keypress = &keypresses[i];
+        if (!useRawTransport(ctx, device, url, SOUP_METHOD_POST, NULL) || checkCircuit(ctx, device)) {
+            g_free(url);
+            continue;
+        }
+        g_mutex_lock(&ctx->lock);
+        bool slotTaken = takeFreeSlot(ctx, device, getPriority(options, ROKU_PRIORITY_INTERACTIVE));
+        g_mutex_unlock(&ctx->lock);
+        if (!slotTaken) {
+            g_free(url);
+            continue;
+        }
+        if (reserveToken(ctx, device)) {
+            returnToken(ctx, device);
+            releaseRequestSlot(ctx, device);
+            g_free(url);
+            continue;
+        }
+        const char* path = url + device->baseLength;
+        keypress->requestLength = g_snprintf(keypress->request, sizeof(keypress->request), "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Length: 0\r\n\r\n",
+                                             path, device->hostHeader);
+        g_free(url);
+        keypress->device = device;
+        keypress->result = &results[i];
+        startSpan(ctx, &keypress->span, device, ROKU_ENDPOINT_KEYPRESS);
+        handled[i] = true;
+        active++;
+
+        keypress->socket = takeRawSocket(ctx, device);
+        keypress->reused = keypress->socket != NULL;
+        if (!keypress->socket) {
+            queueUringConnect(&ring, keypress);
         } else {
-            g_string_append_c(url, '?');
+            traceRequest(ctx, &keypress->span, ROKU_TRACE_CONNECT, 0);
+            keypress->stage = URING_SEND;
+            queueUringSend(&ring, keypress, 0);
         }
     }
-    for (size_t i = 0; i < params->numOtherParams; i++) {
-        g_string_append_uri_escaped(url, params->otherParamNames[i], NULL, TRUE);
-        g_string_append_c(url, '=');
-        g_string_append_uri_escaped(url, params->otherParamValues[i], NULL, TRUE);
-        if (i != params->numOtherParams - 1) {
-            g_string_append_c(url, '&');
+
+    // Cancelling the call completes a poll on the cancellable's fd, ending the batch early
+    int cancelFd = cancellable ? g_cancellable_get_fd(cancellable) : -1;
+    if (cancelFd >= 0) {
+        struct io_uring_sqe* sqe = getUringSqe(&ring);
+        io_uring_prep_poll_add(sqe, cancelFd, POLLIN);
+        io_uring_sqe_set_data(sqe, &ring);
+    }
+
+    // The batch as a whole gets whichever of the connect and read timeouts are set, since its operations all run at once
+    unsigned connectTimeout = atomic_load_explicit(&ctx->connectTimeout, memory_order_relaxed);
+    unsigned readTimeout = atomic_load_explicit(&ctx->readTimeout, memory_order_relaxed);
+    gint64 expiry = getExpiry(connectTimeout + readTimeout, deadline);
+    bool cancelPending = cancelFd >= 0;
+    bool ending = false;
+    for (size_t i = 0; i < numDevices; i++) {
+        if (keypresses[i].device && keypresses[i].stage == URING_DONE && !keypresses[i].pending) {
+            active--;
         }
     }
+    while (active || cancelPending) {
+        // With no keypresses left, only the poll on the cancellable is left to remove
+        if (!active && !ending) {
+            ending = true;
+            endUringBatch(&ring, keypresses, numDevices, false, cancelPending);
+        }
+        struct io_uring_cqe* cqe;
+        int waitResult;
+        if (expiry >= 0 && !ending) {
+            gint64 remaining = MAX(expiry - g_get_monotonic_time(), 0);
+            struct __kernel_timespec timeout = {.tv_sec = remaining / G_USEC_PER_SEC, .tv_nsec = (remaining % G_USEC_PER_SEC) * 1000};
+            waitResult = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &timeout, NULL);
+        } else {
+            waitResult = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, NULL, NULL);
+        }
+        if (waitResult == -ETIME && !ending) {
+            ending = true;
+            endUringBatch(&ring, keypresses, numDevices, false, cancelPending);
+        }
+        if (waitResult < 0) {
+            continue;
+        }
 
-    int httpError = sendRequest(url->str, SOUP_METHOD_POST, NULL);
-    g_string_free(url, TRUE);
-    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
-        return -1;
+        void* data = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        if (data == &ring) {
+            // The poll completes successfully if the call was cancelled, or with an error if it was removed
+            cancelPending = false;
+            if (res >= 0 && !ending) {
+                ending = true;
+                endUringBatch(&ring, keypresses, numDevices, true, false);
+            }
+        } else if (data) {
+            struct uringKeypress* keypress = data;
+            enum uringStage stage = keypress->stage;
+            advanceUringKeypress(&ring, keypress, res);
+            if (stage == URING_CONNECT && keypress->stage == URING_SEND) {
+                traceRequest(ctx, &keypress->span, ROKU_TRACE_CONNECT, 0);
+            } else if (stage == URING_RECEIVE && keypress->status) {
+                traceRequest(ctx, &keypress->span, ROKU_TRACE_FIRST_BYTE, 0);
+            }
+            if (keypress->stage == URING_DONE && !keypress->pending) {
+                active--;
+            }
+        }
     }
-    return httpError;
-}
+    if (cancelFd >= 0) {
+        g_cancellable_release_fd(cancellable);
+    }
+    io_uring_queue_exit(&ring);
 
-int getRokuAppIcon(const RokuDevice* device, const RokuApp* app, RokuAppIcon* icon) {
-    if (device->isLimited) {
-        return -1;
+    // Record every keypress like the raw transport would, keeping connections that are still clean
+    for (size_t i = 0; i < numDevices; i++) {
+        struct uringKeypress* keypress = &keypresses[i];
+        if (!keypress->device) {
+            continue;
+        }
+        if (keypress->socket && keypress->reusable) {
+            putRawSocket(ctx, keypress->device, keypress->socket);
+        } else if (keypress->socket) {
+            g_object_unref(keypress->socket);
+        }
+        releaseRequestSlot(ctx, keypress->device);
+        if (keypress->socket) {
+            countConnectionUse(ctx, !keypress->reused);
+        }
+        int httpError = finishRequest(ctx, &keypress->span, keypress->status, NULL, keypress->status ? NULL : keypress->error, keypress->timedOut);
+        if (keypress->status) {
+            g_clear_error(&keypress->error);
+        }
+        keypress->result->result = completeKeypress(ctx, httpError, NULL, NULL, 0);
+        keypress->result->latency = g_get_monotonic_time() - keypress->span.start;
     }
-    // Request icon from device
-    char* url = malloc(sizeof("/query/icon/") + (strlen(device->url) + strlen(app->id)) * sizeof(char));
-    strcpy(url, device->url);
-    strcat(url, "/query/icon/");
-    strcat(url, app->id);
-    GBytes* response;
-    int httpError = sendRequest(url, SOUP_METHOD_GET, &response);
-    free(url);
+    g_free(keypresses);
+}
+#endif
 
-    // fill icon data and size while freeing GBytes
-    gsize size;
-    icon->data = g_bytes_unref_to_data(response, &size);
-    icon->size = size;
-    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
-        return -2;
+/** @internal
+ * A single device's share of a fleet operation, pushed to the fleet's thread pool
+ */
+struct fleetJob {
+    RokuContext* ctx; /**< Context to run the operation with */
+    const RokuCallOptions* options; /**< Options to run the operation with */
+    const RokuDevice* device; /**< Device to run the operation on */
+    const RokuFleetOperation* operation; /**< Operation to run */
+    RokuFleetResult* result; /**< Where to store the device's result */
+};
+
+/** @internal
+ * Run a fleet operation on a single device
+ * @param ctx Context to run the operation with
+ * @param options Options to run the operation with
+ * @param device Device to run the operation on
+ * @param operation Operation to run
+ * @return Return value of the function the operation maps to
+ */
+static int runFleetOperation(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuFleetOperation* operation) {
+    switch (operation->type) {
+        case ROKU_FLEET_KEYPRESS:
+            return rokuSendKey_ctx(ctx, options, device, operation->key);
+        case ROKU_FLEET_TYPE_STRING:
+            return rokuTypeString_ctx(ctx, options, device, operation->string);
+        case ROKU_FLEET_LAUNCH_APP:
+            return launchRokuApp_ctx(ctx, options, device, operation->launchParams);
+        case ROKU_FLEET_LAUNCH_TV_CHANNEL:
+            return launchRokuTVChannel_ctx(ctx, options, device, operation->channel);
+        case ROKU_FLEET_CUSTOM_INPUT:
+            return sendCustomRokuInput_ctx(ctx, options, device, operation->numInputParams, operation->inputNames, operation->inputValues);
+        case ROKU_FLEET_SEARCH:
+            return rokuSearch_ctx(ctx, options, device, operation->keyword, operation->searchParams);
+        case ROKU_FLEET_CALLBACK:
+            return operation->callback(ctx, options, device, operation->userData);
     }
-    return httpError;
+    return -1;
 }
 
-int sendCustomRokuInput(const RokuDevice* device, const size_t params, const char* names[], const char* values[]) {
-    if (device->isLimited) {
-        return -1;
+/** @internal
+ * Thread pool function for fleet operations: runs the operation on one device and records its result and latency
+ * @param data Pointer to fleetJob struct
+ * @param user_data Unused
+ */
+static void fleetJobFunc(gpointer data, gpointer user_data) {
+    struct fleetJob* job = data;
+    gint64 start = g_get_monotonic_time();
+    job->result->result = runFleetOperation(job->ctx, job->options, job->device, job->operation);
+    job->result->latency = g_get_monotonic_time() - start;
+}
+
+int runRokuFleetOperation(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice devices[], const size_t numDevices, const RokuFleetOperation* operation,
+                          const unsigned maxParallel, RokuFleetResult results[]) {
+    ctx = resolveContext(ctx);
+    if (numDevices == 0) {
+        return 0;
     }
-    // Construct input request string with base and params
-    GString* url = g_string_sized_new(strlen(device->url) * sizeof(char) + sizeof("/input?"));
-    g_string_assign(url, device->url);
-    g_string_append(url, "/input?");
-    for (int i = 0; i < params; i++) {
-        // add parameters to URL, escaping disallowed URL characters
-        g_string_append_uri_escaped(url, names[i], NULL, TRUE);
-        g_string_append_c(url, '=');
-        g_string_append_uri_escaped(url, values[i], NULL, TRUE);
-        if (i < params - 1) {
-            g_string_append_c(url, '&');
+
+    // Keypresses can be sent to every device at once through io_uring, leaving only the devices it couldn't take
+    bool* handled = g_new0(bool, numDevices);
+#ifdef HAVE_IO_URING
+    if (operation->type == ROKU_FLEET_KEYPRESS && atomic_load_explicit(&ctx->transport, memory_order_relaxed) == ROKU_TRANSPORT_IO_URING) {
+        sendUringKeypresses(ctx, options, devices, numDevices, operation->key, results, handled);
+    }
+#endif
+
+    // Every device has its own session, so one worker per device in flight is enough to send them all at once
+    gint maxThreads = maxParallel == 0 || maxParallel > numDevices ? (gint) numDevices : (gint) maxParallel;
+    GThreadPool* pool = g_thread_pool_new(fleetJobFunc, NULL, maxThreads, FALSE, NULL);
+    struct fleetJob* jobs = g_new(struct fleetJob, numDevices);
+    for (size_t i = 0; i < numDevices; i++) {
+        if (!handled[i]) {
+            jobs[i] = (struct fleetJob) {ctx, options, &devices[i], operation, &results[i]};
+            g_thread_pool_push(pool, &jobs[i], NULL);
         }
     }
 
-    // Clean up and return result of input request
-    int httpError = sendRequest(url->str, SOUP_METHOD_POST, NULL);
-    g_string_free(url, TRUE);
-    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
-        return -2;
+    // Wait for every job to finish, then count the devices the operation succeeded on
+    g_thread_pool_free(pool, FALSE, TRUE);
+    g_free(jobs);
+    g_free(handled);
+    int succeeded = 0;
+    for (size_t i = 0; i < numDevices; i++) {
+        if (results[i].result == 0) {
+            succeeded++;
+        }
     }
-    return httpError;
+    return succeeded;
 }
 
-int rokuSearch(const RokuDevice* device, const char* keyword, const RokuSearchParams* params) {
-    if (!device->hasSearchSupport || device->isLimited) {
-        return -1;
-    }
+/** @internal
+ * Worker thread function: runs the context's worker main loop until the context is destroyed
+ * @param data Pointer to the context
+ * @return NULL
+ */
+static gpointer workerThreadFunc(gpointer data) {
+    RokuContext* ctx = data;
+    g_main_context_push_thread_default(ctx->workerContext);
+    g_main_loop_run(ctx->workerLoop);
+    g_main_context_pop_thread_default(ctx->workerContext);
+    return NULL;
+}
 
-    GString* url = g_string_sized_new((strlen(device->url) + strlen(keyword)) * sizeof(char) + sizeof("/search/browse?keyword="));
-    g_string_assign(url, device->url);
-    g_string_append(url, "/search/browse?keyword=");
-    if (*keyword == '\0') {
-        g_string_free(url, TRUE);
-        return -2;
-    }
-    g_string_append_uri_escaped(url, keyword, NULL, TRUE);
+RokuContext* createRokuContext(void) {
+    RokuContext* ctx = g_new0(RokuContext, 1);
+    g_mutex_init(&ctx->lock);
+    g_mutex_init(&ctx->parserLock);
+    g_mutex_init(&ctx->cacheFileLock);
+    ctx->devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, freeDeviceState);
+    ctx->flights = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ctx->parser = xmlNewParserCtxt();
+    atomic_init(&ctx->connectTimeout, 0);
+    atomic_init(&ctx->readTimeout, 0);
+    atomic_init(&ctx->transport, ROKU_TRANSPORT_LIBSOUP);
+    atomic_init(&ctx->maxRetries, 0);
+    atomic_init(&ctx->retryDelay, 100);
+    atomic_init(&ctx->circuitThreshold, 0);
+    atomic_init(&ctx->probeInterval, 5);
+    atomic_init(&ctx->prewarmInterval, 0);
+    atomic_init(&ctx->discoveryTimeout, 0);
+    atomic_init(&ctx->discoveryIdleTimeout, 0);
+    atomic_init(&ctx->expectedDevices, 0);
+    atomic_init(&ctx->pipelineDepth, 0);
+    atomic_init(&ctx->tracer, NULL);
+    atomic_init(&ctx->maxRequestsPerDevice, DEFAULT_MAX_REQUESTS_PER_DEVICE);
+    atomic_init(&ctx->requests, 0);
+    atomic_init(&ctx->failedRequests, 0);
+    atomic_init(&ctx->bytesReceived, 0);
+    atomic_init(&ctx->sessionsCreated, 0);
+    atomic_init(&ctx->timeouts, 0);
+    atomic_init(&ctx->cancelled, 0);
+    atomic_init(&ctx->queuedRequests, 0);
+    atomic_init(&ctx->throttledRequests, 0);
+    atomic_init(&ctx->coalescedRequests, 0);
+    atomic_init(&ctx->retries, 0);
+    atomic_init(&ctx->circuitRejections, 0);
+    atomic_init(&ctx->warmRequests, 0);
+    atomic_init(&ctx->coldRequests, 0);
+    atomic_init(&ctx->prewarms, 0);
+    atomic_init(&ctx->duplicateResponses, 0);
+    ctx->workerContext = g_main_context_new();
+    ctx->workerLoop = g_main_loop_new(ctx->workerContext, FALSE);
+    ctx->worker = g_thread_new("rokuecp-worker", workerThreadFunc, ctx);
+    return ctx;
+}
 
-    switch (params->type) {
-        case MOVIE:
-            g_string_append(url, "&type=movie");
-            break;
-        case SHOW:
-            g_string_append(url, "&type=tv-show");
-            break;
-        case PERSON:
-            g_string_append(url, "&type=person");
-            break;
-        case APP:
-            g_string_append(url, "&type=channel");
-            break;
-        case GAME:
-            g_string_append(url, "&type=game");
-            break;
-        default:
-            break;
+/** @internal
+ * Worker context callback: quits the worker main loop
+ * @param user_data Pointer to the main loop
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean quitWorkerCallback(gpointer user_data) {
+    g_main_loop_quit(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+void destroyRokuContext(RokuContext* ctx) {
+    if (!ctx) {
+        return;
     }
+    // Stop the worker thread from inside its own loop, so the quit can't be missed before the loop starts running.
+    // It goes first so its sources can't run while the device states they use are freed.
+    g_main_context_invoke(ctx->workerContext, quitWorkerCallback, ctx->workerLoop);
+    g_thread_join(ctx->worker);
 
-    if (params->includeUnavailable) {
-        g_string_append(url, "&show-unavailable=true");
+    // Abort any requests still in progress so their connections are closed before the sessions go away
+    GHashTableIter iter;
+    gpointer device;
+    g_hash_table_iter_init(&iter, ctx->devices);
+    while (g_hash_table_iter_next(&iter, NULL, &device)) {
+        soup_session_abort(((struct deviceState*) device)->session);
     }
-    if (params->autoLaunch) {
-        g_string_append(url, "&launch=true");
+    if (ctx->registry) {
+        freeRegistry(ctx->registry);
     }
-    if (params->autoSelect) {
-        g_string_append(url, "&match-any=true");
+    g_hash_table_destroy(ctx->devices);
+    g_hash_table_destroy(ctx->flights);
+    g_main_loop_unref(ctx->workerLoop);
+    g_main_context_unref(ctx->workerContext);
+
+    g_free(atomic_load_explicit(&ctx->tracer, memory_order_relaxed));
+    g_slist_free_full(ctx->oldTracers, g_free);
+    if (ctx->cache) {
+        g_key_file_free(ctx->cache);
     }
+    g_free(ctx->cachePath);
+    xmlFreeParserCtxt(ctx->parser);
+    g_mutex_clear(&ctx->parserLock);
+    g_mutex_clear(&ctx->cacheFileLock);
+    g_mutex_clear(&ctx->lock);
+    g_free(ctx);
+}
 
-    if (params->season != 0) {
-        g_string_append(url, "&season=");
-        g_string_append_printf(url, "%u", params->season);
+void setRokuContextTimeouts(RokuContext* ctx, const unsigned connectTimeout, const unsigned readTimeout) {
+    ctx = resolveContext(ctx);
+    atomic_store_explicit(&ctx->connectTimeout, connectTimeout, memory_order_relaxed);
+    atomic_store_explicit(&ctx->readTimeout, readTimeout, memory_order_relaxed);
+}
+
+void setRokuContextMaxRequestsPerDevice(RokuContext* ctx, const unsigned maxRequests) {
+    ctx = resolveContext(ctx);
+    atomic_store_explicit(&ctx->maxRequestsPerDevice, maxRequests, memory_order_relaxed);
+}
+
+void setRokuContextRateLimit(RokuContext* ctx, const double requestsPerSecond, const unsigned burst) {
+    ctx = resolveContext(ctx);
+    g_mutex_lock(&ctx->lock);
+    ctx->rateLimit = requestsPerSecond;
+    ctx->rateBurst = burst;
+    g_mutex_unlock(&ctx->lock);
+}
+
+void setRokuContextTransport(RokuContext* ctx, const RokuTransport transport) {
+    ctx = resolveContext(ctx);
+    atomic_store_explicit(&ctx->transport, transport, memory_order_relaxed);
+}
+
+void setRokuContextPipelineDepth(RokuContext* ctx, const unsigned depth) {
+    ctx = resolveContext(ctx);
+    atomic_store_explicit(&ctx->pipelineDepth, depth, memory_order_relaxed);
+}
+
+void setRokuContextRetries(RokuContext* ctx, const unsigned maxRetries, const unsigned baseDelay) {
+    ctx = resolveContext(ctx);
+    atomic_store_explicit(&ctx->maxRetries, maxRetries, memory_order_relaxed);
+    atomic_store_explicit(&ctx->retryDelay, baseDelay, memory_order_relaxed);
+}
+
+void setRokuContextCircuitBreaker(RokuContext* ctx, const unsigned failureThreshold, const unsigned probeInterval) {
+    ctx = resolveContext(ctx);
+    atomic_store_explicit(&ctx->circuitThreshold, failureThreshold, memory_order_relaxed);
+    atomic_store_explicit(&ctx->probeInterval, probeInterval, memory_order_relaxed);
+}
+
+void setRokuContextPrewarm(RokuContext* ctx, const unsigned refreshInterval) {
+    ctx = resolveContext(ctx);
+    atomic_store_explicit(&ctx->prewarmInterval, refreshInterval, memory_order_relaxed);
+}
+
+void setRokuContextTracer(RokuContext* ctx, const RokuTraceCallback callback, void* userData) {
+    ctx = resolveContext(ctx);
+    struct tracer* tracer = NULL;
+    if (callback) {
+        tracer = g_new(struct tracer, 1);
+        tracer->callback = callback;
+        tracer->userData = userData;
     }
-    if (*params->tmsID) {
-        g_string_append(url, "&tmsid=");
-        g_string_append(url, params->tmsID);
+    g_mutex_lock(&ctx->lock);
+    struct tracer* oldTracer = atomic_exchange_explicit(&ctx->tracer, tracer, memory_order_acq_rel);
+    // Requests in progress may still be calling the old tracer, so it can only be freed with the context
+    if (oldTracer) {
+        ctx->oldTracers = g_slist_prepend(ctx->oldTracers, oldTracer);
     }
+    g_mutex_unlock(&ctx->lock);
+}
 
-    if (*params->providerIDs[0]) {
-        g_string_append(url, "&provider-id=");
-        g_string_append(url, params->providerIDs[0]);
-        for (int i = 1; i < 8; i++) {
-            if (*params->providerIDs[i]) {
-                g_string_append_c(url, ',');
-                g_string_append(url, params->providerIDs[i]);
-            }
+void setRokuContextDiscoveryOptions(RokuContext* ctx, const RokuDiscoveryOptions* options) {
+    ctx = resolveContext(ctx);
+    atomic_store_explicit(&ctx->discoveryTimeout, options ? options->timeout : 0, memory_order_relaxed);
+    atomic_store_explicit(&ctx->discoveryIdleTimeout, options ? options->idleTimeout : 0, memory_order_relaxed);
+    atomic_store_explicit(&ctx->expectedDevices, options ? options->expectedDevices : 0, memory_order_relaxed);
+}
+
+int setRokuContextDiscoveryCache(RokuContext* ctx, const char* path) {
+    ctx = resolveContext(ctx);
+    GKeyFile* cache = NULL;
+    int result = 0;
+    if (path) {
+        // A missing file only means nothing has been cached yet, but an unreadable one is dropped rather than half-used
+        GError* error = NULL;
+        cache = g_key_file_new();
+        if (!g_key_file_load_from_file(cache, path, G_KEY_FILE_NONE, &error) && !g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_key_file_free(cache);
+            cache = g_key_file_new();
+            result = -1;
         }
+        g_clear_error(&error);
+    }
+    g_mutex_lock(&ctx->lock);
+    GKeyFile* oldCache = ctx->cache;
+    char* oldPath = ctx->cachePath;
+    ctx->cache = cache;
+    ctx->cachePath = g_strdup(path);
+    g_mutex_unlock(&ctx->lock);
+    if (oldCache) {
+        g_key_file_free(oldCache);
     }
+    g_free(oldPath);
+    return result;
+}
 
-    int httpError = sendRequest(url->str, SOUP_METHOD_POST, NULL);
-    g_string_free(url, TRUE);
-    if (httpError == SOUP_STATUS_UNAUTHORIZED) {
-        return -1;
+void getRokuContextStats(RokuContext* ctx, RokuContextStats* stats) {
+    ctx = resolveContext(ctx);
+    stats->requests = atomic_load_explicit(&ctx->requests, memory_order_relaxed);
+    stats->failedRequests = atomic_load_explicit(&ctx->failedRequests, memory_order_relaxed);
+    stats->bytesReceived = atomic_load_explicit(&ctx->bytesReceived, memory_order_relaxed);
+    stats->sessionsCreated = atomic_load_explicit(&ctx->sessionsCreated, memory_order_relaxed);
+    stats->timeouts = atomic_load_explicit(&ctx->timeouts, memory_order_relaxed);
+    stats->cancelled = atomic_load_explicit(&ctx->cancelled, memory_order_relaxed);
+    stats->queuedRequests = atomic_load_explicit(&ctx->queuedRequests, memory_order_relaxed);
+    stats->throttledRequests = atomic_load_explicit(&ctx->throttledRequests, memory_order_relaxed);
+    stats->coalescedRequests = atomic_load_explicit(&ctx->coalescedRequests, memory_order_relaxed);
+    stats->retries = atomic_load_explicit(&ctx->retries, memory_order_relaxed);
+    stats->circuitRejections = atomic_load_explicit(&ctx->circuitRejections, memory_order_relaxed);
+    stats->warmRequests = atomic_load_explicit(&ctx->warmRequests, memory_order_relaxed);
+    stats->coldRequests = atomic_load_explicit(&ctx->coldRequests, memory_order_relaxed);
+    stats->prewarms = atomic_load_explicit(&ctx->prewarms, memory_order_relaxed);
+    stats->duplicateResponses = atomic_load_explicit(&ctx->duplicateResponses, memory_order_relaxed);
+    g_mutex_lock(&ctx->lock);
+    stats->activeSessions = g_hash_table_size(ctx->devices);
+    g_mutex_unlock(&ctx->lock);
+}
+
+/** @internal
+ * Add one device's statistics for an endpoint to a snapshot
+ * @param stats Pointer to statistics of the device's endpoint, or NULL if it hasn't been used
+ * @param snapshot Snapshot to add to, whose latency percentiles are left alone
+ * @param buckets Latency histogram of the snapshot, to add the device's histogram to
+ */
+static void addEndpointStats(struct endpointStats* stats, RokuEndpointStats* snapshot, uint64_t buckets[HISTOGRAM_BUCKETS]) {
+    if (!stats) {
+        return;
+    }
+    snapshot->requests += atomic_load_explicit(&stats->requests, memory_order_relaxed);
+    snapshot->failedRequests += atomic_load_explicit(&stats->failedRequests, memory_order_relaxed);
+    snapshot->totalLatency += atomic_load_explicit(&stats->totalLatency, memory_order_relaxed);
+    snapshot->maxLatency = MAX(snapshot->maxLatency, (int64_t) atomic_load_explicit(&stats->maxLatency, memory_order_relaxed));
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        buckets[i] += atomic_load_explicit(&stats->buckets[i], memory_order_relaxed);
     }
-    return httpError;
 }
 
-int rokuTypeString(const RokuDevice* device, const wchar_t* string) {
-    if (device->isLimited) {
-        return -1;
+/** @internal
+ * Find a latency percentile in a histogram
+ * @param buckets Latency histogram
+ * @param total Number of latencies in the histogram
+ * @param maxLatency Highest latency in the histogram, which the percentile is capped at
+ * @param permille Thousandths of latencies that should be at or below the percentile (like 990 for p99)
+ * @return Latency in microseconds, or 0 if the histogram is empty
+ */
+static int64_t getPercentile(const uint64_t buckets[HISTOGRAM_BUCKETS], const uint64_t total, const int64_t maxLatency, const unsigned permille) {
+    uint64_t rank = (total * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS && total; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return MIN(getBucketLatency(i), maxLatency);
+        }
     }
-    int errorCode = 0;
+    return total ? maxLatency : 0;
+}
 
-    // Iterate through wide string
-    while (*string) {
-        // Convert each wide char into a multibyte string for URL escaping
-        char mbstr[MB_CUR_MAX + 1];
-        int len = wctomb(mbstr, *string);
-        // If this is an "invalid character" in the current locale, skip it
-        if (len == -1) {
-            string++;
-            continue;
+int getRokuEndpointStats(RokuContext* ctx, const char* url, RokuEndpointStats stats[ROKU_NUM_ENDPOINTS]) {
+    ctx = resolveContext(ctx);
+    struct deviceState* device = NULL;
+    if (url) {
+        char* key = g_strndup(url, getDeviceKeyLength(url, NULL));
+        g_mutex_lock(&ctx->lock);
+        device = g_hash_table_lookup(ctx->devices, key);
+        g_mutex_unlock(&ctx->lock);
+        g_free(key);
+        if (!device) {
+            return -1;
         }
-        mbstr[len] = '\0';
+    }
+
+    // Device states live as long as their context, so only finding them needs the lock, not reading their statistics
+    GPtrArray* devices = g_ptr_array_new();
+    if (device) {
+        g_ptr_array_add(devices, device);
+    } else {
+        g_mutex_lock(&ctx->lock);
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init(&iter, ctx->devices);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            g_ptr_array_add(devices, value);
+        }
+        g_mutex_unlock(&ctx->lock);
+    }
 
-        // Escape each character and send the key "Lit_{character}" to the Roku device, checking for errors
-        const char* escaped = g_uri_escape_string(mbstr, NULL, FALSE);
-        char* key = malloc(sizeof("Lit_") + strlen(escaped) * sizeof(char));
-        strcpy(key, "Lit_");
-        strcat(key, escaped);
-        errorCode = rokuSendKey(device, key);
-        free(key);
-        if (errorCode == -3) {
-            return -2;
+    uint64_t* buckets = g_new(uint64_t, HISTOGRAM_BUCKETS);
+    for (int endpoint = 0; endpoint < ROKU_NUM_ENDPOINTS; endpoint++) {
+        memset(&stats[endpoint], 0, sizeof(RokuEndpointStats));
+        memset(buckets, 0, HISTOGRAM_BUCKETS * sizeof(uint64_t));
+        for (guint i = 0; i < devices->len; i++) {
+            struct deviceState* state = g_ptr_array_index(devices, i);
+            addEndpointStats(atomic_load_explicit(&state->endpointStats[endpoint], memory_order_acquire), &stats[endpoint], buckets);
         }
 
-        string++;
+        // Requests being recorded right now may be in the counters but not the histogram yet, so go by the histogram
+        uint64_t total = 0;
+        for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            total += buckets[i];
+        }
+        stats[endpoint].p50 = getPercentile(buckets, total, stats[endpoint].maxLatency, 500);
+        stats[endpoint].p90 = getPercentile(buckets, total, stats[endpoint].maxLatency, 900);
+        stats[endpoint].p99 = getPercentile(buckets, total, stats[endpoint].maxLatency, 990);
+        stats[endpoint].p999 = getPercentile(buckets, total, stats[endpoint].maxLatency, 999);
     }
+    g_free(buckets);
+    g_ptr_array_free(devices, TRUE);
+    return 0;
+}
 
-    return errorCode;
+void rokuShutdown(void) {
+    g_mutex_lock(&defaultContextLock);
+    destroyRokuContext(defaultContext);
+    defaultContext = NULL;
+    g_mutex_unlock(&defaultContextLock);
+}
+
+int findRokuDevices(const char* iface, const size_t maxDevices, const size_t urlStringSize, char* deviceList[]) {
+    return findRokuDevices_ctx(NULL, NULL, iface, maxDevices, urlStringSize, deviceList);
+}
+
+int streamRokuDevices(const char* iface, const size_t maxDevices, const RokuDeviceFoundCallback callback, void* userData) {
+    return streamRokuDevices_ctx(NULL, NULL, iface, maxDevices, callback, userData);
+}
+
+int getRokuDevice(const char* url, RokuDevice* device) {
+    return getRokuDevice_ctx(NULL, NULL, url, device);
+}
+
+int rokuSendKey(const RokuDevice* device, const char* key) {
+    return rokuSendKey_ctx(NULL, NULL, device, key);
+}
+
+int getRokuTVChannels(const RokuDevice* device, const int maxChannels, RokuTVChannel channelList[]) {
+    return getRokuTVChannels_ctx(NULL, NULL, device, maxChannels, channelList);
+}
+
+int getActiveRokuTVChannel(const RokuDevice* device, RokuExtTVChannel* channel) {
+    return getActiveRokuTVChannel_ctx(NULL, NULL, device, channel);
+}
+
+int launchRokuTVChannel(const RokuDevice* device, const RokuTVChannel* channel) {
+    return launchRokuTVChannel_ctx(NULL, NULL, device, channel);
+}
+
+int getRokuApps(const RokuDevice* device, const int maxApps, RokuApp appList[]) {
+    return getRokuApps_ctx(NULL, NULL, device, maxApps, appList);
+}
+
+int getActiveRokuApp(const RokuDevice* device, RokuApp* app) {
+    return getActiveRokuApp_ctx(NULL, NULL, device, app);
+}
+
+int launchRokuApp(const RokuDevice* device, const RokuAppLaunchParams* params) {
+    return launchRokuApp_ctx(NULL, NULL, device, params);
+}
+
+int getRokuAppIcon(const RokuDevice* device, const RokuApp* app, RokuAppIcon* icon) {
+    return getRokuAppIcon_ctx(NULL, NULL, device, app, icon);
+}
+
+int sendCustomRokuInput(const RokuDevice* device, const size_t params, const char* names[], const char* values[]) {
+    return sendCustomRokuInput_ctx(NULL, NULL, device, params, names, values);
+}
+
+int rokuSearch(const RokuDevice* device, const char* keyword, const RokuSearchParams* params) {
+    return rokuSearch_ctx(NULL, NULL, device, keyword, params);
+}
+
+int streamRokuAppIcon(const RokuDevice* device, const RokuApp* app, RokuDataSink sink, void* userData) {
+    return streamRokuAppIcon_ctx(NULL, NULL, device, app, sink, userData);
+}
+
+int rokuSendKeySequence(const RokuDevice* device, const char* keys[], const size_t numKeys) {
+    return rokuSendKeySequence_ctx(NULL, NULL, device, keys, numKeys);
+}
+
+int rokuTypeString(const RokuDevice* device, const wchar_t* string) {
+    return rokuTypeString_ctx(NULL, NULL, device, string);
 }
@@ -19,10 +19,166 @@
 #ifndef ROKUECP_H
 #define ROKUECP_H
 
+#include <gio/gio.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <wchar.h>
 
+/**
+ * Handle owning the HTTP sessions, XML parser state, configuration, and statistics used to talk to Roku devices.
+ * Every function has a _ctx variant taking a RokuContext; the plain functions use a default context created on first use.
+ * A RokuContext can be shared between threads.
+ */
+typedef struct RokuContext RokuContext;
+
+/**
+ * Error codes that any function sending requests can return, in addition to its own error codes.
+ * They count down from ROKU_ERROR_TIMEOUT so they never overlap function-specific, libsoup, or HTTP codes.
+ */
+enum {
+    ROKU_ERROR_TIMEOUT = -100, /**< A connect or read timeout expired, or the call's deadline passed */
+    ROKU_ERROR_CANCELLED = -101, /**< The call was cancelled through its GCancellable */
+    ROKU_ERROR_CIRCUIT_OPEN = -102 /**< The device's circuit breaker is open, so the call failed without sending anything */
+};
+
+/** Priority classes of ECP requests. When a device is busy, waiting requests of a higher class are sent first. */
+typedef enum {
+    ROKU_PRIORITY_DEFAULT, /**< Use the call's own class: interactive for commands, background for icons, normal otherwise */
+    ROKU_PRIORITY_INTERACTIVE, /**< Requests a user is waiting on, like keypresses */
+    ROKU_PRIORITY_NORMAL, /**< Ordinary queries */
+    ROKU_PRIORITY_BACKGROUND /**< Bulk fetches that can wait, which never take a device's last free slot */
+} RokuPriority;
+
+/** Ways a RokuContext can send requests that only need a status code back, like keypresses and app launches. */
+typedef enum {
+    ROKU_TRANSPORT_LIBSOUP, /**< Send every request with libsoup (the default) */
+    /**
+     * Send blocking status-only POSTs by writing a prebuilt HTTP/1.1 request on a kept-alive socket and parsing only the
+     * status line. A successful rokuSendKey() to a known device then doesn't allocate. Opening a new connection and
+     * reporting an error still do, and other calls still build their URLs on the heap. Other requests, _async calls,
+     * and devices not addressed by IP still use libsoup.
+     */
+    ROKU_TRANSPORT_RAW,
+    /**
+     * Same as ROKU_TRANSPORT_RAW, except runRokuFleetOperation() sends keypresses to every device at once through a
+     * single Linux io_uring, batching their connects, sends, and receives instead of using a thread per device. Only
+     * available if the library was built with the IO_URING option; otherwise it behaves like ROKU_TRANSPORT_RAW.
+     */
+    ROKU_TRANSPORT_IO_URING
+} RokuTransport;
+
+/** Options for a single call of a _ctx or _async function. Passing NULL uses the defaults for every field. */
+typedef struct {
+    /**
+     * Absolute deadline for the whole call (including every request it sends) in g_get_monotonic_time() microseconds,
+     * or 0 for none. The call returns ROKU_ERROR_TIMEOUT once it passes.
+     */
+    int64_t deadline;
+    /**
+     * GCancellable to cancel the call with from another thread, or NULL. Cancelling it aborts any request in progress,
+     * closing its connection, and the call returns ROKU_ERROR_CANCELLED. _async functions use this if they aren't
+     * given a cancellable of their own.
+     */
+    GCancellable* cancellable;
+    /** Priority class of the call's requests, or ROKU_PRIORITY_DEFAULT (0) for the call's usual class. */
+    RokuPriority priority;
+} RokuCallOptions;
+
+/** Statistics gathered by a RokuContext since it was created. */
+typedef struct {
+    uint64_t requests; /**< Number of requests sent */
+    uint64_t failedRequests; /**< Number of requests that failed or didn't return 200 OK */
+    uint64_t bytesReceived; /**< Number of response body bytes received */
+    uint64_t sessionsCreated; /**< Number of per-device sessions created */
+    uint64_t timeouts; /**< Number of requests that failed with ROKU_ERROR_TIMEOUT */
+    uint64_t cancelled; /**< Number of requests that failed with ROKU_ERROR_CANCELLED */
+    uint64_t queuedRequests; /**< Number of requests that had to wait for other requests to the same device to finish */
+    uint64_t throttledRequests; /**< Number of requests delayed by the rate limit */
+    uint64_t coalescedRequests; /**< Number of getRokuDevice(), getActiveRokuApp(), and getActiveRokuTVChannel() calls that shared a concurrent identical call's request */
+    uint64_t retries; /**< Number of times a failed request was retried */
+    uint64_t circuitRejections; /**< Number of requests that failed with ROKU_ERROR_CIRCUIT_OPEN */
+    uint64_t warmRequests; /**< Number of requests sent on a connection that was already open */
+    uint64_t coldRequests; /**< Number of requests that had to open a new connection first */
+    uint64_t prewarms; /**< Number of times a connection was opened or refreshed ahead of time by pre-warming */
+    uint64_t duplicateResponses; /**< Number of SSDP answers ignored by device searches because they repeated the USN or URL of a device already found */
+    unsigned activeSessions; /**< Number of per-device sessions currently kept alive */
+} RokuContextStats;
+
+/** ECP endpoints a RokuContext keeps separate request statistics for. */
+typedef enum {
+    ROKU_ENDPOINT_DEVICE_INFO, /**< /query/device-info */
+    ROKU_ENDPOINT_TV_CHANNELS, /**< /query/tv-channels */
+    ROKU_ENDPOINT_ACTIVE_TV_CHANNEL, /**< /query/tv-active-channel */
+    ROKU_ENDPOINT_APPS, /**< /query/apps */
+    ROKU_ENDPOINT_ACTIVE_APP, /**< /query/active-app */
+    ROKU_ENDPOINT_ICON, /**< /query/icon */
+    ROKU_ENDPOINT_KEYPRESS, /**< /keypress, including the keypresses sent by rokuTypeString() */
+    ROKU_ENDPOINT_LAUNCH, /**< /launch, including TV channel launches */
+    ROKU_ENDPOINT_INPUT, /**< /input */
+    ROKU_ENDPOINT_SEARCH, /**< /search/browse */
+    ROKU_ENDPOINT_OTHER, /**< Any other path */
+    ROKU_NUM_ENDPOINTS /**< Number of endpoints, for sizing arrays of RokuEndpointStats */
+} RokuEndpoint;
+
+/**
+ * Request statistics of one ECP endpoint. Latencies are in microseconds, measured from when a call starts sending a
+ * request (including any time spent waiting for a free slot or the rate limit) until its response is complete.
+ * Percentiles come from a log-scale histogram, so they are accurate to within about 3%.
+ */
+typedef struct {
+    uint64_t requests; /**< Number of requests sent */
+    uint64_t failedRequests; /**< Number of requests that failed or didn't return 200 OK */
+    int64_t totalLatency; /**< Sum of the latencies of all requests, for working out the mean */
+    int64_t maxLatency; /**< Highest latency of any request */
+    int64_t p50; /**< Median latency */
+    int64_t p90; /**< 90th percentile latency */
+    int64_t p99; /**< 99th percentile latency */
+    int64_t p999; /**< 99.9th percentile latency */
+} RokuEndpointStats;
+
+/** Points in the life of a request that a RokuTraceCallback is called at. */
+typedef enum {
+    ROKU_TRACE_START, /**< The call started sending the request, before waiting for a free slot or the rate limit */
+    ROKU_TRACE_CONNECT, /**< The request has a connection, either a new one or one kept alive from an earlier request */
+    ROKU_TRACE_FIRST_BYTE, /**< The response's status line and headers arrived */
+    ROKU_TRACE_BODY_COMPLETE, /**< The request is finished, successfully or not. Every request traced gets one of these. */
+    ROKU_TRACE_PARSE_COMPLETE /**< The XML response of a query was parsed into the call's output */
+} RokuTraceEventType;
+
+/** A point in the life of a request, passed to a RokuTraceCallback. */
+typedef struct {
+    RokuTraceEventType type; /**< Which point the request reached */
+    uint64_t requestId; /**< Number identifying the request, unique within its context, which retries get new ones of */
+    const char* url; /**< Base URL of the device (like "http://192.168.1.162:8060"), valid until the context is destroyed */
+    RokuEndpoint endpoint; /**< Endpoint the request was sent to */
+    int64_t timestamp; /**< g_get_monotonic_time() microseconds at which the request reached this point */
+    int64_t startTime; /**< Timestamp of the request's ROKU_TRACE_START event */
+    int result; /**< For ROKU_TRACE_BODY_COMPLETE, the result code of the request; for ROKU_TRACE_PARSE_COMPLETE, the
+                     return value of the call; otherwise 0 */
+} RokuTraceEvent;
+
+/**
+ * Function called at each point in the life of a request. It is called from whichever thread is sending the request,
+ * possibly several at once, so it should be quick and thread-safe, and must not make ECP calls itself.
+ * @param event Event that happened, only valid during the call
+ * @param userData Data passed to setRokuContextTracer()
+ */
+typedef void (*RokuTraceCallback)(const RokuTraceEvent* event, void* userData);
+
+/** A file descriptor a RokuEventLoop is waiting on, laid out like struct pollfd and using the same event flags. */
+typedef struct {
+    int fd; /**< File descriptor to watch */
+    short events; /**< Events to watch for (POLLIN, POLLOUT, etc.) */
+    short revents; /**< Events that occurred, filled in by the caller before rokuDispatch() */
+} RokuPollFd;
+
+/**
+ * Lets an external event loop (like an epoll-based reactor) drive the library's _async calls without a GMainLoop.
+ * Pass its context to _async functions, then in each turn of the external loop call rokuPrepare(), wait on the file
+ * descriptors it returns until its deadline, and call rokuDispatch() with the events that occurred.
+ */
+typedef struct RokuEventLoop RokuEventLoop;
+
 /** Information about a Roku Device. */
 typedef struct {
     char name[121]; /**< Name of the device, up to Roku's 120-character maximum */
@@ -93,6 +249,15 @@ typedef struct {
     unsigned long size; /**< number of bytes pointed to by the data attribute */
 } RokuAppIcon;
 
+/**
+ * Function receiving data as it is downloaded, like an app icon passed to streamRokuAppIcon().
+ * @param data Chunk of the data, which is only valid until the function returns
+ * @param size Number of bytes in the chunk
+ * @param userData Data given with the function
+ * @return true to keep downloading, or false to stop and drop the rest
+ */
+typedef bool (*RokuDataSink)(const unsigned char* data, size_t size, void* userData);
+
 /** Information about a Roku search to be performed. All fields are optional. */
 typedef struct {
     enum {
@@ -129,6 +294,94 @@ typedef struct {
     size_t numOtherParams; /**< Number of extra parameters */
 } RokuAppLaunchParams;
 
+/** Kind of operation run on every device of a fleet by runRokuFleetOperation(). */
+typedef enum {
+    ROKU_FLEET_KEYPRESS, /**< Send a keypress with rokuSendKey(), using the key field */
+    ROKU_FLEET_TYPE_STRING, /**< Type a string with rokuTypeString(), using the string field */
+    ROKU_FLEET_LAUNCH_APP, /**< Launch an app with launchRokuApp(), using the launchParams field */
+    ROKU_FLEET_LAUNCH_TV_CHANNEL, /**< Launch a TV channel with launchRokuTVChannel(), using the channel field */
+    ROKU_FLEET_CUSTOM_INPUT, /**< Send custom input with sendCustomRokuInput(), using the input fields */
+    ROKU_FLEET_SEARCH, /**< Run a search with rokuSearch(), using the keyword and searchParams fields */
+    ROKU_FLEET_CALLBACK /**< Call a custom function, using the callback and userData fields */
+} RokuFleetOperationType;
+
+/** An operation to run on every device of a fleet. Only the fields used by the operation's type need to be set. */
+typedef struct {
+    RokuFleetOperationType type; /**< Kind of operation to run */
+    const char* key; /**< Key code to send */
+    const wchar_t* string; /**< Wide Unicode string to type */
+    const RokuAppLaunchParams* launchParams; /**< App ID and optional parameters to launch with */
+    const RokuTVChannel* channel; /**< TV channel to launch */
+    size_t numInputParams; /**< Number of custom input parameters to send */
+    const char** inputNames; /**< Array (size numInputParams) of custom input parameter names */
+    const char** inputValues; /**< Array (size numInputParams) of custom input parameter values */
+    const char* keyword; /**< Keyword to search for */
+    const RokuSearchParams* searchParams; /**< Parameters of the search */
+    /**
+     * Custom function to call for each device, returning 0 on success. It may be called from several threads at once,
+     * and should use the context and options it is passed for any requests.
+     */
+    int (*callback)(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, void* userData);
+    void* userData; /**< Data to pass to callback */
+} RokuFleetOperation;
+
+/** How long a RokuContext searches for devices with SSDP. Zeroed fields use their defaults. */
+typedef struct {
+    unsigned timeout; /**< Longest a search runs, in milliseconds, or 0 for the default of five seconds */
+    /**
+     * Milliseconds without a new device answering after which a search that has found at least one device ends, or 0
+     * to not end searches early. Devices answering the same search usually do so within a few hundred milliseconds.
+     */
+    unsigned idleTimeout;
+    size_t expectedDevices; /**< Number of devices after which a search ends, or 0 to only end early once the list is full */
+} RokuDiscoveryOptions;
+
+/**
+ * Function called by streamRokuDevices() for each device as soon as it is found.
+ * @param url ECP URL of the device
+ * @param usn Unique service name of the device (like "uuid:roku:ecp:P0A070000007")
+ * @param userData Data passed to streamRokuDevices()
+ * @return true to keep searching, or false to end the search
+ */
+typedef bool (*RokuDeviceFoundCallback)(const char* url, const char* usn, void* userData);
+
+/** A device in a RokuContext's device registry. */
+typedef struct {
+    char url[30]; /**< ECP URL for the device (like "http://192.168.1.162:8060/") up to 29 characters */
+    char usn[64]; /**< Unique service name of the device (like "uuid:roku:ecp:P0A070000007") up to 63 characters */
+    int64_t lastSeen; /**< g_get_monotonic_time() microseconds at which the device was last reported available */
+} RokuRegisteredDevice;
+
+/** Changes to a RokuContext's device registry. */
+typedef enum {
+    ROKU_REGISTRY_ADDED, /**< A device appeared on the network */
+    ROKU_REGISTRY_UPDATED, /**< A known device was reported available again, possibly at a new URL */
+    ROKU_REGISTRY_REMOVED /**< A device said goodbye, or stopped announcing itself for longer than it said it would stay */
+} RokuRegistryChange;
+
+/**
+ * Function called by a device registry when its table of devices changes. It is called from the context's worker
+ * thread, which also enforces timeouts of blocking calls, so it must return quickly and must not make blocking ECP calls.
+ * @param change What changed
+ * @param device Device that changed, as it is now (or as it was last, if it was removed)
+ * @param userData Data passed to startRokuDeviceRegistry()
+ */
+typedef void (*RokuRegistryCallback)(RokuRegistryChange change, const RokuRegisteredDevice* device, void* userData);
+
+/** A device in a RokuContext's discovery cache. */
+typedef struct {
+    char url[30]; /**< ECP URL for the device (like "http://192.168.1.162:8060/") up to 29 characters */
+    char usn[64]; /**< Unique service name of the device (like "uuid:roku:ecp:P0A070000007") up to 63 characters */
+    char serial[14]; /**< Serial number from the device's device-info, or an empty string if it hasn't answered a probe yet */
+    int64_t lastSeen; /**< g_get_real_time() microseconds at which the device was last found or answered a probe */
+} RokuCachedDevice;
+
+/** Result of a fleet operation on one device. */
+typedef struct {
+    int result; /**< Return value of the function the operation maps to */
+    int64_t latency; /**< Time the operation took on this device, in microseconds */
+} RokuFleetResult;
+
 /**
  * Find Roku devices on the network using SSDP.
  * @param iface Name of network interface to search on. Set NULL to auto-select the primary interface.
@@ -136,10 +389,109 @@ typedef struct {
  * @param urlStringSize Size of destination URL strings (recommended 30)
  * @param deviceList Array (of size maxDevices) of strings (size urlStringSize), which will be updated to contain the
  *                   ECP URLs of found Roku Devices. Remaining elements, if any, will be made empty strings.
- * @return Number of devices found within five seconds, or a negated gssdp error code
+ * @return Number of devices found within five seconds (or as set with setRokuContextDiscoveryOptions()), or a negated
+ *         gssdp error code
  */
 int findRokuDevices(const char* iface, size_t maxDevices, size_t urlStringSize, char* deviceList[]);
 
+/**
+ * Same as findRokuDevices(), using a given RokuContext.
+ * The search ends early if the options' deadline comes first, and returns ROKU_ERROR_CANCELLED if it is cancelled.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int findRokuDevices_ctx(RokuContext* ctx, const RokuCallOptions* options, const char* iface, size_t maxDevices, size_t urlStringSize, char* deviceList[]);
+
+/**
+ * Find Roku devices on the network using SSDP like findRokuDevices(), but report each device to a callback as soon as
+ * it is found instead of collecting them in a list, so callers can start talking to the first device right away.
+ * Answers arriving while the callback runs are queued and reported once it returns, so it can make ECP calls itself.
+ * @param iface Name of network interface to search on. Set NULL to auto-select the primary interface.
+ * @param maxDevices Maximum number of devices to look for
+ * @param callback Function to call for each device found, from the calling thread
+ * @param userData Data to pass to callback
+ * @return Number of devices found, or a negated gssdp error code
+ */
+int streamRokuDevices(const char* iface, size_t maxDevices, RokuDeviceFoundCallback callback, void* userData);
+
+/**
+ * Same as streamRokuDevices(), using a given RokuContext.
+ * The search ends early if the options' deadline comes first, and returns ROKU_ERROR_CANCELLED if it is cancelled.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int streamRokuDevices_ctx(RokuContext* ctx, const RokuCallOptions* options, const char* iface, size_t maxDevices, RokuDeviceFoundCallback callback,
+                          void* userData);
+
+/**
+ * Start keeping a live table of the Roku devices on the network in the background. An SSDP browser on the context's
+ * worker thread adds devices as they answer searches or announce themselves, and removes them when they say goodbye or
+ * their announcements expire, so callers never have to run blocking searches. New devices get pre-warmed connections
+ * if pre-warming is on. Each context can run one registry at a time.
+ * @param ctx Context to use, or NULL for the default context
+ * @param iface Name of network interface to search on. Set NULL to auto-select the primary interface.
+ * @param rescanInterval Seconds between searches for devices that missed being announced, or 0 to only search at the start
+ * @param callback Function to call when a device is added, updated, or removed, or NULL
+ * @param userData Data to pass to callback
+ * @return 0 on success, -1 if the context is already running a registry, or a negated gssdp error code
+ */
+int startRokuDeviceRegistry(RokuContext* ctx, const char* iface, unsigned rescanInterval, RokuRegistryCallback callback, void* userData);
+
+/**
+ * Stop a context's device registry and forget its devices. Once this returns, its callback won't be called again,
+ * except for a call that was already running on the worker thread. Does nothing if no registry is running.
+ * @param ctx Context to use, or NULL for the default context
+ */
+void stopRokuDeviceRegistry(RokuContext* ctx);
+
+/**
+ * Get the devices currently in a context's device registry. This only copies the registry's table, so it never blocks on
+ * the network.
+ * @param ctx Context to use, or NULL for the default context
+ * @param maxDevices Maximum number of devices to get
+ * @param devices Array (of size maxDevices) of RokuRegisteredDevice to fill in
+ * @return Number of devices filled in, or -1 if the context isn't running a registry
+ */
+int getRokuRegisteredDevices(RokuContext* ctx, size_t maxDevices, RokuRegisteredDevice devices[]);
+
+/**
+ * Get the devices a context's discovery cache holds for an interface, without waiting for the network, so a process can
+ * start talking to devices found by an earlier run right away. Each call also starts refreshing the cache in the
+ * background (unless a refresh is already running): the cached devices are probed for their device-info in parallel
+ * while an SSDP search runs, then devices that neither answered nor were found are dropped, and the file is rewritten.
+ * Devices found by findRokuDevices() and the other searches are added to the cache too. Cached devices get
+ * pre-warmed connections if pre-warming is on.
+ * @param ctx Context to use, or NULL for the default context
+ * @param iface Name of network interface the devices were found on, or NULL for the auto-selected primary interface
+ * @param maxDevices Maximum number of devices to get
+ * @param devices Array (of size maxDevices) of RokuCachedDevice to fill in
+ * @return Number of devices filled in, or -1 if the context has no discovery cache
+ */
+int getCachedRokuDevices(RokuContext* ctx, const char* iface, size_t maxDevices, RokuCachedDevice devices[]);
+
+/**
+ * Start findRokuDevices() without blocking. The search runs in mainContext, so passing the context of a RokuEventLoop
+ * runs it in an external event loop without any extra threads.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param iface Name of network interface to search on. Set NULL to auto-select the primary interface.
+ * @param maxDevices Maximum number of devices to look for
+ * @param urlStringSize Size of destination URL strings (recommended 30)
+ * @param mainContext GMainContext to search in and call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void findRokuDevices_async(RokuContext* ctx, const RokuCallOptions* options, const char* iface, size_t maxDevices, size_t urlStringSize, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with findRokuDevices_async().
+ * @param result GAsyncResult passed to the callback
+ * @param deviceList Array (of size maxDevices) of strings (size urlStringSize) to store the found ECP URLs in
+ * @return Same as findRokuDevices_ctx()
+ */
+int findRokuDevices_finish(GAsyncResult* result, char* deviceList[]);
+
 /**
  * Get information about a Roku Device from its ECP URL.
  * @param url The Roku Device's ECP URL (like "http://192.168.1.162:8060/")
@@ -150,6 +502,33 @@ int findRokuDevices(const char* iface, size_t maxDevices, size_t urlStringSize,
  */
 int getRokuDevice(const char* url, RokuDevice* device);
 
+/**
+ * Same as getRokuDevice(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int getRokuDevice_ctx(RokuContext* ctx, const RokuCallOptions* options, const char* url, RokuDevice* device);
+
+/**
+ * Start getRokuDevice() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param url The Roku Device's ECP URL (like "http://192.168.1.162:8060/")
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void getRokuDevice_async(RokuContext* ctx, const RokuCallOptions* options, const char* url, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with getRokuDevice_async().
+ * @param result GAsyncResult passed to the callback
+ * @param device RokuDevice pointer to store device info in
+ * @return Same as getRokuDevice()
+ */
+int getRokuDevice_finish(GAsyncResult* result, RokuDevice* device);
+
 /**
  * Send a keypress to a Roku Device, emulating the press of a button on a Roku Remote.
  * @note This does not work if the device is in Limited mode.
@@ -162,6 +541,75 @@ int getRokuDevice(const char* url, RokuDevice* device);
  */
 int rokuSendKey(const RokuDevice* device, const char* key);
 
+/**
+ * Same as rokuSendKey(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int rokuSendKey_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* key);
+
+/**
+ * Start rokuSendKey() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to send the keypress to
+ * @param key The key code to send to the Roku
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void rokuSendKey_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* key, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with rokuSendKey_async().
+ * @param result GAsyncResult passed to the callback
+ * @return Same as rokuSendKey()
+ */
+int rokuSendKey_finish(GAsyncResult* result);
+
+/**
+ * Send a sequence of keypresses to a Roku Device in order, like a macro. If the context has a pipeline depth set with
+ * setRokuContextPipelineDepth(), blocking calls send several keypresses at once on one connection instead of waiting
+ * for each response, and fall back to sending them one at a time if the device closes the connection.
+ * @note This does not work if the device is in Limited mode.
+ * @param device Pointer to RokuDevice to send the keypresses to
+ * @param keys Array of key codes to send, as accepted by rokuSendKey()
+ * @param numKeys Number of key codes in keys
+ * @return libsoup error code for the last keypress request, or one of the following error codes: -1 if any key isn't valid for that device type (nothing is sent),
+ *                                                                                                -2 if the device is in Limited mode,
+ *                                                                                                -3 if the device has ECP disabled.
+ */
+int rokuSendKeySequence(const RokuDevice* device, const char* keys[], size_t numKeys);
+
+/**
+ * Same as rokuSendKeySequence(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int rokuSendKeySequence_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* keys[], size_t numKeys);
+
+/**
+ * Start rokuSendKeySequence() without blocking. Inputs are copied before this returns. Keypresses are sent one at a time.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to send the keypresses to
+ * @param keys Array of key codes to send
+ * @param numKeys Number of key codes in keys
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void rokuSendKeySequence_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* keys[], size_t numKeys, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with rokuSendKeySequence_async().
+ * @param result GAsyncResult passed to the callback
+ * @return Same as rokuSendKeySequence()
+ */
+int rokuSendKeySequence_finish(GAsyncResult* result);
+
 /**
  * Get a list of TV channels accessible from a given Roku device.
  * @note This does not work if the device is in Limited mode.
@@ -177,6 +625,34 @@ int rokuSendKey(const RokuDevice* device, const char* key);
  */
 int getRokuTVChannels(const RokuDevice* device, int maxChannels, RokuTVChannel channelList[]);
 
+/**
+ * Same as getRokuTVChannels(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int getRokuTVChannels_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, int maxChannels, RokuTVChannel channelList[]);
+
+/**
+ * Start getRokuTVChannels() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to list the channels of
+ * @param maxChannels Maximum number of channels to list
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void getRokuTVChannels_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, int maxChannels, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with getRokuTVChannels_async().
+ * @param result GAsyncResult passed to the callback
+ * @param channelList Array (of the size passed as maxChannels) of RokuTVChannels which will be updated to contain listed channels
+ * @return Same as getRokuTVChannels()
+ */
+int getRokuTVChannels_finish(GAsyncResult* result, RokuTVChannel channelList[]);
+
 /**
  * Get either the current or last active TV channel on a given Roku device.
  * @note This does not work if the device is in Limited mode.
@@ -190,6 +666,33 @@ int getRokuTVChannels(const RokuDevice* device, int maxChannels, RokuTVChannel c
  */
 int getActiveRokuTVChannel(const RokuDevice* device, RokuExtTVChannel* channel);
 
+/**
+ * Same as getActiveRokuTVChannel(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int getActiveRokuTVChannel_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, RokuExtTVChannel* channel);
+
+/**
+ * Start getActiveRokuTVChannel() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to list the active channel of
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void getActiveRokuTVChannel_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with getActiveRokuTVChannel_async().
+ * @param result GAsyncResult passed to the callback
+ * @param channel Pointer to RokuExtTVChannel to store info about the current or last active TV channel
+ * @return Same as getActiveRokuTVChannel()
+ */
+int getActiveRokuTVChannel_finish(GAsyncResult* result, RokuExtTVChannel* channel);
+
 /**
  * Launch a given Live TV channel on a given Roku device.
  * @param device Pointer to RokuDevice to launch channel on
@@ -198,6 +701,33 @@ int getActiveRokuTVChannel(const RokuDevice* device, RokuExtTVChannel* channel);
  */
 int launchRokuTVChannel(const RokuDevice* device, const RokuTVChannel* channel);
 
+/**
+ * Same as launchRokuTVChannel(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int launchRokuTVChannel_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuTVChannel* channel);
+
+/**
+ * Start launchRokuTVChannel() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to launch channel on
+ * @param channel Pointer to RokuTVChannel to launch
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void launchRokuTVChannel_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuTVChannel* channel, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with launchRokuTVChannel_async().
+ * @param result GAsyncResult passed to the callback
+ * @return Same as launchRokuTVChannel()
+ */
+int launchRokuTVChannel_finish(GAsyncResult* result);
+
 /**
  * Get a list of apps on a given Roku device.
  * @note This does not work if the device is in Limited mode.
@@ -212,6 +742,34 @@ int launchRokuTVChannel(const RokuDevice* device, const RokuTVChannel* channel);
 */
 int getRokuApps(const RokuDevice* device, int maxApps, RokuApp appList[]);
 
+/**
+ * Same as getRokuApps(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int getRokuApps_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, int maxApps, RokuApp appList[]);
+
+/**
+ * Start getRokuApps() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to list the apps on
+ * @param maxApps Maximum number of apps to list
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void getRokuApps_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, int maxApps, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with getRokuApps_async().
+ * @param result GAsyncResult passed to the callback
+ * @param appList Array (of the size passed as maxApps) of RokuApps which will be updated to contain listed apps
+ * @return Same as getRokuApps()
+ */
+int getRokuApps_finish(GAsyncResult* result, RokuApp appList[]);
+
 /**
  * Get the current active app on a given Roku device.
  * @param device Pointer to RokuDevice to list the active app of
@@ -222,6 +780,33 @@ int getRokuApps(const RokuDevice* device, int maxApps, RokuApp appList[]);
  */
 int getActiveRokuApp(const RokuDevice* device, RokuApp* app);
 
+/**
+ * Same as getActiveRokuApp(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int getActiveRokuApp_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, RokuApp* app);
+
+/**
+ * Start getActiveRokuApp() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to list the active app of
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void getActiveRokuApp_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with getActiveRokuApp_async().
+ * @param result GAsyncResult passed to the callback
+ * @param app Pointer to RokuApp to store info about the current active app
+ * @return Same as getActiveRokuApp()
+ */
+int getActiveRokuApp_finish(GAsyncResult* result, RokuApp* app);
+
 /**
  * Launch a given app on a given Roku device.
  * @param device Pointer to RokuDevice to launch the app on
@@ -230,6 +815,33 @@ int getActiveRokuApp(const RokuDevice* device, RokuApp* app);
  */
 int launchRokuApp(const RokuDevice* device, const RokuAppLaunchParams* params);
 
+/**
+ * Same as launchRokuApp(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int launchRokuApp_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuAppLaunchParams* params);
+
+/**
+ * Start launchRokuApp() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to launch the app on
+ * @param params App ID and optional parameters to launch with
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void launchRokuApp_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuAppLaunchParams* params, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with launchRokuApp_async().
+ * @param result GAsyncResult passed to the callback
+ * @return Same as launchRokuApp()
+ */
+int launchRokuApp_finish(GAsyncResult* result);
+
 /**
  * Get a given app's icon.
  * @note This does not work if the device is in Limited mode.
@@ -240,6 +852,53 @@ int launchRokuApp(const RokuDevice* device, const RokuAppLaunchParams* params);
  */
 int getRokuAppIcon(const RokuDevice* device, const RokuApp* app, RokuAppIcon* icon);
 
+/**
+ * Same as getRokuAppIcon(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int getRokuAppIcon_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuApp* app, RokuAppIcon* icon);
+
+/**
+ * Start getRokuAppIcon() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice on which the app is installed
+ * @param app Pointer to RokuApp to get the icon of
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void getRokuAppIcon_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuApp* app, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with getRokuAppIcon_async().
+ * @param result GAsyncResult passed to the callback
+ * @param icon Pointer to RokuAppIcon to store the app icon
+ * @return Same as getRokuAppIcon()
+ */
+int getRokuAppIcon_finish(GAsyncResult* result, RokuAppIcon* icon);
+
+/**
+ * Download the icon of an app on a given Roku device, handing it to a sink in chunks as it arrives instead of holding
+ * all of it in memory. The sink is only called if the device sends the icon (with 200 OK).
+ * @note This does not work if the device is in Limited mode.
+ * @param device Pointer to RokuDevice on which the app is installed
+ * @param app Pointer to RokuApp to get the icon of
+ * @param sink Function to call with each chunk of the icon
+ * @param userData Data to pass to sink
+ * @return libsoup error code for icon request, or -1 if the device is in Limited mode, or -2 if the device has ECP disabled.
+ */
+int streamRokuAppIcon(const RokuDevice* device, const RokuApp* app, RokuDataSink sink, void* userData);
+
+/**
+ * Same as streamRokuAppIcon(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int streamRokuAppIcon_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const RokuApp* app, RokuDataSink sink, void* userData);
+
 /**
  * Send custom input to the currently active app on a given Roku device.
  * @param device Pointer to RokuDevice to send input to
@@ -250,6 +909,35 @@ int getRokuAppIcon(const RokuDevice* device, const RokuApp* app, RokuAppIcon* ic
  */
 int sendCustomRokuInput(const RokuDevice* device, size_t params, const char* names[], const char* values[]);
 
+/**
+ * Same as sendCustomRokuInput(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int sendCustomRokuInput_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, size_t params, const char* names[], const char* values[]);
+
+/**
+ * Start sendCustomRokuInput() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to send input to
+ * @param params Number of parameters to send
+ * @param names Array (size params) of strings with the names of the parameters
+ * @param values Array (size params) of strings with the values of the parameters
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void sendCustomRokuInput_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, size_t params, const char* names[], const char* values[], GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with sendCustomRokuInput_async().
+ * @param result GAsyncResult passed to the callback
+ * @return Same as sendCustomRokuInput()
+ */
+int sendCustomRokuInput_finish(GAsyncResult* result);
+
 /**
  * Run search for a movie, TV show, person, or app. Either display the results or auto-launch the first one.
  * @note This does not work if the device is in Limited mode; it will return -1.
@@ -260,14 +948,266 @@ int sendCustomRokuInput(const RokuDevice* device, size_t params, const char* nam
 */
 int rokuSearch(const RokuDevice* device, const char* keyword, const RokuSearchParams* params);
 
+/**
+ * Same as rokuSearch(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int rokuSearch_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* keyword, const RokuSearchParams* params);
+
+/**
+ * Start rokuSearch() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to run the search on
+ * @param keyword Movie/show title, app name, person name, or other keyword to be searched
+ * @param params Pointer to RokuSearchParams describing the parameters of the search
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void rokuSearch_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const char* keyword, const RokuSearchParams* params, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with rokuSearch_async().
+ * @param result GAsyncResult passed to the callback
+ * @return Same as rokuSearch()
+ */
+int rokuSearch_finish(GAsyncResult* result);
+
 /**
  * Send Unicode string to Roku device as a series of keyboard keypresses.
  * @note This does not work if the device is in Limited mode.
  * @note This function depends on locale. Many special characters will fail to send if the standard C locale is used.
+ * @note Keypresses are pipelined like rokuSendKeySequence() if the context has a pipeline depth set.
  * @param device Pointer to RokuDevice to send the string to
  * @param string Wide Unicode string to send
  * @return libsoup error code for the last keypress request, or -1 if the device is in Limited mode, or -2 if the device has ECP disabled.
  */
 int rokuTypeString(const RokuDevice* device, const wchar_t* string);
 
+/**
+ * Same as rokuTypeString(), using a given RokuContext.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ */
+int rokuTypeString_ctx(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const wchar_t* string);
+
+/**
+ * Start rokuTypeString() without blocking. Inputs are copied before this returns.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for this call, or NULL for the defaults
+ * @param device Pointer to RokuDevice to send the string to
+ * @param string Wide Unicode string to send
+ * @param mainContext GMainContext to call callback in, or NULL for the thread-default context
+ * @param cancellable Optional GCancellable to cancel the call with, or NULL
+ * @param callback Function to call when the call is complete
+ * @param userData Data to pass to callback
+ */
+void rokuTypeString_async(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice* device, const wchar_t* string, GMainContext* mainContext, GCancellable* cancellable, GAsyncReadyCallback callback, void* userData);
+
+/**
+ * Finish a call started with rokuTypeString_async().
+ * @param result GAsyncResult passed to the callback
+ * @return Same as rokuTypeString()
+ */
+int rokuTypeString_finish(GAsyncResult* result);
+
+/**
+ * Run the same operation on many Roku devices concurrently.
+ * Blocks until the operation has finished on every device.
+ * @param ctx Context to use, or NULL for the default context
+ * @param options Options for the operation on each device (a deadline applies to all of them), or NULL for the defaults
+ * @param devices Array (size numDevices) of RokuDevices to run the operation on
+ * @param numDevices Number of devices
+ * @param operation Operation to run on each device
+ * @param maxParallel Maximum number of devices to run the operation on at once, or 0 for no limit
+ * @param results Array (size numDevices) of RokuFleetResults which will be updated with each device's result and latency
+ * @return Number of devices the operation returned 0 on
+ */
+int runRokuFleetOperation(RokuContext* ctx, const RokuCallOptions* options, const RokuDevice devices[], size_t numDevices, const RokuFleetOperation* operation,
+                          unsigned maxParallel, RokuFleetResult results[]);
+
+/**
+ * Create a new RokuContext with its own sessions, parser state, configuration, and statistics.
+ * @return New context, to be freed with destroyRokuContext()
+ */
+RokuContext* createRokuContext(void);
+
+/**
+ * Free a RokuContext, closing all connections it kept alive to Roku devices.
+ * @note No calls using the context may be in progress.
+ * @param ctx Context to free (NULL is ignored)
+ */
+void destroyRokuContext(RokuContext* ctx);
+
+/**
+ * Set the timeouts for requests sent with a RokuContext. Requests exceeding them fail with ROKU_ERROR_TIMEOUT.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param connectTimeout Maximum time to wait for a connection to a device in milliseconds, or 0 for none
+ * @param readTimeout Maximum time to wait for a complete response once connected in milliseconds, or 0 for none
+ */
+void setRokuContextTimeouts(RokuContext* ctx, unsigned connectTimeout, unsigned readTimeout);
+
+/**
+ * Set the maximum number of requests a RokuContext will have in flight to a single device at once. Roku devices don't
+ * cope well with many parallel requests, so any requests over the limit wait their turn and are sent in the order
+ * they were made. The default is 2.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param maxRequests Maximum number of requests in flight per device, or 0 for no limit
+ */
+void setRokuContextMaxRequestsPerDevice(RokuContext* ctx, unsigned maxRequests);
+
+/**
+ * Limit how fast a RokuContext sends requests to each device, using a token bucket per device. Up to burst requests
+ * can be sent back-to-back, after which requests are delayed to requestsPerSecond. This keeps fast sequences like
+ * rokuTypeString() from being throttled by the device, which drops input when it does. There is no limit by default.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param requestsPerSecond Sustained number of requests per second to each device, or 0 for no limit
+ * @param burst Number of requests that can be sent to a device at once before the rate applies (at least 1)
+ */
+void setRokuContextRateLimit(RokuContext* ctx, double requestsPerSecond, unsigned burst);
+
+/**
+ * Choose how a RokuContext sends requests that only need a status code back. See RokuTransport.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param transport Transport to use
+ */
+void setRokuContextTransport(RokuContext* ctx, RokuTransport transport);
+
+/**
+ * Set how many keypresses rokuSendKeySequence() and rokuTypeString() may have in flight on one connection with HTTP/1.1
+ * pipelining. This turns a sequence of n keypresses into about n / depth round trips. Pipelining is off by default,
+ * and only applies to blocking calls to devices addressed by IP.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param depth Maximum number of pipelined keypresses, or 0 or 1 to send keypresses one at a time
+ */
+void setRokuContextPipelineDepth(RokuContext* ctx, unsigned depth);
+
+/**
+ * Set how a RokuContext retries failed GET requests (queries and icon downloads). Requests that time out, fail without
+ * a response, or get 503 Service Unavailable are retried after baseDelay, then twice as long for each retry after that,
+ * with random jitter of up to half the delay. Retries stop once the call's deadline would pass. Commands (POSTs) are
+ * never retried, since they aren't safe to send twice. Retries are off by default.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param maxRetries Maximum number of retries per request, or 0 for none
+ * @param baseDelay Delay before the first retry in milliseconds
+ */
+void setRokuContextRetries(RokuContext* ctx, unsigned maxRetries, unsigned baseDelay);
+
+/**
+ * Set up per-device circuit breakers for a RokuContext. Once failureThreshold requests in a row to a device fail without
+ * it answering (including timeouts), the device is treated as down: calls to it fail with ROKU_ERROR_CIRCUIT_OPEN
+ * without sending anything, while the device is probed in the background every probeInterval seconds. The first probe
+ * it answers closes the circuit breaker again. Circuit breakers are off by default.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param failureThreshold Number of failures in a row that open a device's circuit breaker, or 0 to turn circuit breakers off
+ * @param probeInterval Seconds between probes of a device that is down
+ */
+void setRokuContextCircuitBreaker(RokuContext* ctx, unsigned failureThreshold, unsigned probeInterval);
+
+/**
+ * Turn on connection pre-warming for a RokuContext. Once a device is found by findRokuDevices() or resolved by
+ * getRokuDevice(), a keep-alive connection to it is opened in the background (for the transport set with
+ * setRokuContextTransport()), so the first command doesn't have to wait for a new connection. The connection is
+ * checked and reopened if needed every refreshInterval seconds, which should be shorter than the device's idle timeout.
+ * Pre-warming is off by default.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param refreshInterval Seconds between connection refreshes, or 0 to turn pre-warming off
+ */
+void setRokuContextPrewarm(RokuContext* ctx, unsigned refreshInterval);
+
+/**
+ * Register a function to be called at each point in the life of every request a RokuContext sends, like to feed
+ * tracing spans. Requests are only traced once they pass the cancellation, deadline, and circuit breaker checks.
+ * No tracer is registered by default, and tracing costs nothing while none is.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param callback Function to call for each event, or NULL to stop tracing
+ * @param userData Data to pass to callback
+ */
+void setRokuContextTracer(RokuContext* ctx, RokuTraceCallback callback, void* userData);
+
+/**
+ * Set how long findRokuDevices() searches with a RokuContext. By default, a search runs for five seconds unless the
+ * device list fills up first.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param options Options to use, or NULL to restore the defaults
+ */
+void setRokuContextDiscoveryOptions(RokuContext* ctx, const RokuDiscoveryOptions* options);
+
+/**
+ * Keep the devices a RokuContext finds in a cache file, so later runs can get them from getCachedRokuDevices() without
+ * searching first. The file is loaded right away and rewritten whenever a search finds devices or a refresh finishes.
+ * @param ctx Context to configure, or NULL for the default context
+ * @param path Path of the cache file, which doesn't have to exist yet, or NULL to stop caching
+ * @return 0 on success, or -1 if the file exists but couldn't be loaded, in which case the cache starts out empty and
+ *         the file is replaced the next time it is saved
+ */
+int setRokuContextDiscoveryCache(RokuContext* ctx, const char* path);
+
+/**
+ * Create a RokuEventLoop.
+ * @return New event loop, to be destroyed with destroyRokuEventLoop()
+ */
+RokuEventLoop* createRokuEventLoop(void);
+
+/**
+ * Destroy a RokuEventLoop. Calls still running in it never complete, so they should be cancelled and dispatched first.
+ * @param loop Event loop to destroy
+ */
+void destroyRokuEventLoop(RokuEventLoop* loop);
+
+/**
+ * Get the GMainContext of a RokuEventLoop, to pass as the mainContext of _async calls that should run in it.
+ * @param loop Event loop
+ * @return Context owned by the event loop
+ */
+GMainContext* getRokuEventLoopContext(RokuEventLoop* loop);
+
+/**
+ * Get the file descriptors and deadline a RokuEventLoop is waiting on. If the return value is more than maxFds, only
+ * maxFds entries are filled in, and rokuPrepare() can be called again with a bigger array before rokuDispatch().
+ * rokuPrepare() and rokuDispatch() must be called from the same thread.
+ * @param loop Event loop
+ * @param fds Array (of size maxFds) to fill in with the file descriptors to watch
+ * @param maxFds Number of entries fds can hold
+ * @param deadline Pointer to int64_t, set to the g_get_monotonic_time() microseconds by which rokuDispatch() should be
+ *                 called even if no file descriptor is ready, or -1 if there's no deadline. May be NULL.
+ * @return Number of file descriptors to watch, or -1 if another thread is running the loop's context
+ */
+int rokuPrepare(RokuEventLoop* loop, RokuPollFd fds[], int maxFds, int64_t* deadline);
+
+/**
+ * Advance the calls running in a RokuEventLoop after waiting on what rokuPrepare() returned, running any callbacks due.
+ * @param loop Event loop
+ * @param fds Array returned by rokuPrepare(), with revents filled in
+ * @param numFds Number of entries in fds
+ */
+void rokuDispatch(RokuEventLoop* loop, const RokuPollFd fds[], int numFds);
+
+/**
+ * Get statistics gathered by a RokuContext.
+ * @param ctx Context to get statistics of, or NULL for the default context
+ * @param stats Pointer to RokuContextStats to fill in
+ */
+void getRokuContextStats(RokuContext* ctx, RokuContextStats* stats);
+
+/**
+ * Get per-endpoint request statistics gathered by a RokuContext, either for one device or summed over every device.
+ * Recording them never takes a lock, so this can be called at any time without slowing requests down.
+ * @param ctx Context to get statistics of, or NULL for the default context
+ * @param url ECP URL of the device to get statistics of, or NULL for all devices
+ * @param stats Array (of size ROKU_NUM_ENDPOINTS) of RokuEndpointStats to fill in, indexed by RokuEndpoint
+ * @return 0 on success, -1 if the context has never sent a request to the device
+ */
+int getRokuEndpointStats(RokuContext* ctx, const char* url, RokuEndpointStats stats[ROKU_NUM_ENDPOINTS]);
+
+/**
+ * Free the default context used by functions without the _ctx suffix, closing all connections it kept alive to
+ * Roku devices. Any function can still be called afterwards; it will simply create a new default context.
+ * @note No calls using the default context may be in progress.
+ */
+void rokuShutdown(void);
+
 #endif //ROKUECP_H